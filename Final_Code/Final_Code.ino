@@ -3,462 +3,60 @@
 #include <vector>
 #include <sstream>
 #include <iomanip>
-#include <bitset>
 #include <map>
+#include <cstring>
+#include <algorithm>
 #include <WiFi.h>
-#include <WiFiMulti.h>
 #include <vector>
 #include <FS.h>
 #include <SPIFFS.h>
 #include <SPI.h>
+#include "profiler.h"
+#include "logger.h"
+#include "keyboard_geometry.h"
+#include "display_image.h"
+#include "song_arena.h"
+#include "frame_stream.h"
+#include "midi_parser.h"
+#include "lz_stream.h"
+#include "session.h"
+#include "playlist.h"
+#include "frame_clock.h"
+#include "song_index.h"
+#include "practice_log.h"
+#include "song_snapshot.h"
 
 //Serial.print("");
 //Serial.println("");
 
-WiFiMulti WiFiMulti;
 std::string midi;
+SongArena songArena; //holds every allocation for the song being played
+FrameStream frameStream; //reads songs too big for RAM straight off SPIFFS
+Playlist playlist;       //songs after the first, fetched while the current one plays
+FrameClock frameClock;   //when each frame goes up, at the song's tempo and practice speed
+SongTransfer songTransfer; //undoes compressed downloads as they arrive
+Session session;         //the one connection to the server, kept open between songs
+PracticeRequest practice; //bar to jump to or passage to loop, typed on the serial port
+PracticeLog practiceLog;  //how each note was played, kept on SPIFFS until the server has it
+SongSnapshot bootSnapshot; //the last song parsed, played at boot before WiFi is up
+bool bootSong = false;     //bootSnapshot is open and hasn't been played yet
+
+#define SONG_PATH "/song.mid"      //where downloads too big for RAM are kept
+#define DEMO_PATH "/demo.mid"      //played at boot when there is no snapshot yet
+#define SONG_RAM_LIMIT (32 * 1024) //downloads bigger than this go to SPIFFS
+#define SONG_REPLY_TIMEOUT_MS 2000 //give up on a reply that stops arriving for this long
+#define SERVER_HOST "172.20.10.2"  //ip or dns
+#define SERVER_PORT 1235
+
+//the Arduino builder writes prototypes itself; these let the sketch build as
+//plain C++ too (host/main.cpp)
+void idle_cycle();
 
-// Define custom functions for byte order conversion
-unsigned int bigEndianToHost(unsigned char* buffer, int size) {
-    unsigned int result = 0;
-    for (int i = 0; i < size; i++) {
-        result = (result << 8) | buffer[i];
-    }
-    return result;
-}
-
-unsigned short bigEndianToHostShort(unsigned char* buffer) {
-    return (buffer[0] << 8) | buffer[1];
-}
-
-// Structure to store key signature data
-struct KeySignature {
-    char key;
-    std::string scale;
-    int ticks;
-};
-
-// Structure to store tempo data
-struct Tempo {
-    int bpm;
-    int ticks;
-};
-
-// Structure to store time signature data
-struct TimeSignature {
-    int ticks;
-    int numerator;
-    int denominator;
-    int measures;
-};
-
-// Structure to store control change data
-struct ControlChange {
-    int number;
-    int ticks;
-    int time;
-    double value;
-};
-
-// Structure to store note data
-struct Note {
-    double duration = 0.0;
-    int durationTicks;
-    int midi;
-    std::string name;
-    int ticks;
-    double velocity;
-    int channel;
-    std::string notetype;
-    char binary;
-};
-
-// Structure to represent a track
-struct Track {
-    int channel;
-    std::vector<ControlChange> controlChanges;
-    std::vector<Note> notes;
-    int endOfTrackTicks;
-    long int tempoQuarterNote;
-    std::string name;
-    int thirtysecondNotesPerDivision;
-    int maxTick = 0;
-    std::map<int, std::bitset<88>> bitmap;
-};
-
-// Structure to store header information and tracks
-struct MidiData {
-    std::vector<KeySignature> keySignatures;
-    std::vector<Tempo> tempos;
-    std::vector<TimeSignature> timeSignatures;
-    std::vector<Track> tracks;
-    int division;
-    int thirtysecondNotesPerDivision;
-    std::map<int, std::bitset<88>> bitmap;
-};
-
-char noteOutput(Note note, bool hand);
-bool readTrackChunk(std::istringstream& file, Track& track, unsigned short division);
-void processMidiEvent(Track& track, int ticks, int channel, char statusByte, char dataByte1, char dataByte2, unsigned short division);
-Note* findCorrespondingNoteOnEvent(Track& track, int note, int channel, int ticks);
-std::string getNoteName(int midiNote);
-int ReadVariableLengthValue(std::istringstream& file);
-
-// Helper function to read a variable-length quantity from the stream
-int ReadVariableLengthValue(std::istringstream& file) {
-    int value = 0;
-    int shift = 0;
-    char byte;
-    do {
-        file.read(&byte, 1);
-        value = (value << shift) | (byte & 0x7F);
-        shift += 7;
-    } while (byte & 0x80);
-    return value;
-}
-
-std::string getNoteName(int midiNote) {
-    const std::string pianoKeys[] = {
-        "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"
-    };
-
-    if (midiNote >= 0 && midiNote <= 127) {
-        int octave = (midiNote / 12) - 1;
-        int noteInOctave = midiNote % 12;
-
-        return pianoKeys[noteInOctave] + std::to_string(octave);
-    }
-    else {
-        return "Unknown";
-    }
-}
-
-// Helper function to find the corresponding Note On event for a Note Off event
-Note* findCorrespondingNoteOnEvent(Track& track, int note, int channel, int ticks) {
-    for (Note& noteEvent : track.notes) {
-        if (noteEvent.name == "Note On" && noteEvent.midi == note && noteEvent.ticks < ticks && noteEvent.channel == channel) {
-            // Check if the Note On event has not been matched to a Note Off event
-            if (noteEvent.duration == 0.0) {
-                return &noteEvent;
-            }
-        }
-    }
-    return nullptr;
-}
-
-
-
-
-
-// Function to process MIDI events
-void processMidiEvent(Track& track, int ticks, int channel, char statusByte, char dataByte1, char dataByte2, unsigned short division) {
-    switch (statusByte & 0xF0) {
-    case 0x80: // Note Off
-            // Extract note and velocity information
-    {
-        int note = static_cast<int>(dataByte1);
-        int velocity = static_cast<int>(dataByte2);
-
-        // Find the corresponding Note On event
-        Note* correspondingNoteOn = findCorrespondingNoteOnEvent(track, note, channel, ticks);
-
-        if (correspondingNoteOn) {
-            // Calculate the duration and update the Note On event
-            double durationTicks = ticks - correspondingNoteOn->ticks;
-            correspondingNoteOn->duration = (durationTicks / division);  // Convert ticks to seconds
-
-            // Update the Note Off event
-            Note noteOffEvent;
-            noteOffEvent.durationTicks = ticks;
-            noteOffEvent.midi = note;
-            noteOffEvent.velocity = velocity;
-            noteOffEvent.ticks = ticks;
-            //noteOffEvent.duration = durationTicks / division;  // Convert ticks to seconds
-            noteOffEvent.name = "Note Off";
-            noteOffEvent.channel = channel;
-
-            //track.notes.push_back(noteOffEvent);
-        }
-        // Map MIDI note to piano key
-        std::string pianoKey = getNoteName(note);
-
-        // Output to console
-        //std::cout << "Note Off - Channel: " << channel << ", Note: " << note
-          //  << " (" << pianoKey << "), Velocity: " << velocity << ", Ticks: " << ticks << std::endl;
-    }
-    break;
-    case 0x90: // Note On
-        // Extract note and velocity information
-    {
-        int note = static_cast<int>(dataByte1);
-        int velocity = static_cast<int>(dataByte2);
-
-        // Create a Note structure and add it to the track
-        Note noteOnEvent;
-        noteOnEvent.durationTicks = ticks;
-        noteOnEvent.midi = note;
-        noteOnEvent.velocity = velocity;
-        noteOnEvent.ticks = ticks;
-        noteOnEvent.duration = 0.0; // Duration for Note On is 0
-        noteOnEvent.name = "Note On";
-        noteOnEvent.channel = channel;
-        if (noteOnEvent.velocity == 0)
-        {
-            Note* correspondingNoteOn = findCorrespondingNoteOnEvent(track, note, channel, ticks);
-
-            if (correspondingNoteOn) {
-                // Calculate the duration and update the Note On event
-                double durationTicks = ticks - correspondingNoteOn->ticks;
-                correspondingNoteOn->duration = (durationTicks / division);
-                correspondingNoteOn->durationTicks = durationTicks;
-                //std::cout << "Note off for " << correspondingNoteOn->midi << " for " << correspondingNoteOn->duration << std::endl;
-            }
-
-        }
-        else {
-            track.notes.push_back(noteOnEvent);
-
-            // Map MIDI note to piano key
-            std::string pianoKey = getNoteName(note);
-            // When velocity is 0 set the duration for the previous note on of that type
-            // Output to console
-            //std::cout << "Note On - Channel: " << channel << ", Note: " << note
-              //  << " (" << pianoKey << "), Velocity: " << velocity << ", Current Tick: " << ticks << std::endl;
-        }
-        break; }
-
-    case 0xA0: // Aftertouch
-        // Extract note and aftertouch pressure information
-    {
-        int note = static_cast<int>(dataByte1);
-        int pressure = static_cast<int>(dataByte2);
-
-        // Output to console (you can add logic to store this information if needed)
-        //std::cout << "Aftertouch - Channel: " << channel << ", Note: " << note
-          //  << ", Pressure: " << pressure << ",Current Ticks " << ticks << std::endl;
-    }
-    break;
-    case 0xB0: // Control Change
-        // Extract control change number and value information
-    {
-        int controlNumber = static_cast<int>(dataByte1);
-        int controlValue = static_cast<int>(dataByte2);
-
-        // Create a ControlChange structure and add it to the track
-        ControlChange controlChangeEvent;
-        controlChangeEvent.ticks = ticks;
-        controlChangeEvent.number = controlNumber;
-        controlChangeEvent.value = controlValue;
-        track.controlChanges.push_back(controlChangeEvent);
-
-        //std::cout << "Control Change - Channel: " << channel << ", Control Number: " << controlNumber
-            //<< ", Value: " << controlValue << ", Current Tick: " << ticks << std::endl;
-    }
-    break;
-    case 0xE0: // Pitch Bend
-        // Extract pitch bend LSB and MSB
-    {
-        int lsb = static_cast<int>(dataByte1);
-        int msb = static_cast<int>(dataByte2);
-
-        // Combine LSB and MSB to get the 14-bit pitch bend value
-        int pitchBendValue = (msb << 7) | lsb;
-
-        // Output to console (you can add logic to store this information if needed)
-        //std::cout << "Pitch Bend - Channel: " << channel << ", Value: " << pitchBendValue
-           // << ",Current Tick: " << ticks << std::endl;
-    }
-    break;
-    // Other cases can be added here for Midi Events
-    default:
-        // Unrecognized MIDI event, ignore it
-        break;
-    }
-}
-
-
-// Function to read the track chunk
-bool readTrackChunk(std::istringstream& file, Track& track, unsigned short division) {
-    char trackChunkID[4];
-    file.read(trackChunkID, 4);
-
-    if (std::string(trackChunkID, 4) != "MTrk") {
-        std::cerr << "Invalid or missing track chunk in the MIDI file." << std::endl;
-        return false;
-    }
-
-    // Read the track chunk size
-    unsigned char trackChunkSizeBuffer[4];
-    file.read(reinterpret_cast<char*>(trackChunkSizeBuffer), 4);
-    int trackChunkSize = bigEndianToHost(trackChunkSizeBuffer, 4);
-
-    // Store the starting position of the track data
-    std::streampos trackStartPos = file.tellg();
-
-    // Read track events
-    int currentTick = 0;
-    while (file && file.tellg() - trackStartPos < trackChunkSize) {
-        int deltaTime = ReadVariableLengthValue(file);
-        currentTick += deltaTime;
-
-        char statusByte;
-        file.read(&statusByte, 1);
-
-        if (statusByte == static_cast<char>(0xFF)) {
-            // Meta Event
-            char metaType;
-            file.read(&metaType, 1);
-
-            int metaLength = ReadVariableLengthValue(file);
-
-            // Handle meta events
-            switch (metaType) {
-            case 0x00: {
-                // Sequence Number
-                if (metaLength == 2) {
-                    unsigned char sequenceNumberBuffer[2];
-                    file.read(reinterpret_cast<char*>(sequenceNumberBuffer), 2);
-                    int sequenceNumber = bigEndianToHostShort(sequenceNumberBuffer);
-                    //std::cout << "Sequence Number: " << sequenceNumber << std::endl;
-                }
-                break;
-            }
-            case 0x01: {
-                // Text Event
-                std::vector<char> textEvent(metaLength);
-                file.read(textEvent.data(), metaLength);
-                textEvent.push_back('\0'); // Null-terminate the string
-                //std::cout << "Text Event: " << textEvent.data() << std::endl;
-                break;
-            }
-            case 0x02: {
-                // Copyright Notice
-                std::vector<char> copyrightNotice(metaLength);
-                file.read(copyrightNotice.data(), metaLength);
-                copyrightNotice.push_back('\0'); // Null-terminate the string
-                //std::cout << "Copyright Notice: " << copyrightNotice.data() << std::endl;
-                break;
-            }
-            case 0x03: {
-                // Sequence/Track Name
-                std::vector<char> sequenceName(metaLength);
-                file.read(sequenceName.data(), metaLength);
-                sequenceName.push_back('\0'); // Null-terminate the string
-                track.name = sequenceName.data();
-                Serial.print("Sequence/Track Name: "); 
-                Serial.println(sequenceName.data());
-                break;
-            }
-            case 0x04: {
-                // Instrument Name
-                std::vector<char> instrumentName(metaLength);
-                file.read(instrumentName.data(), metaLength);
-                instrumentName.push_back('\0'); // Null-terminate the string
-                //std::cout << "Instrument Name: " << instrumentName.data() << std::endl;
-                break;
-            }
-            case 0x20: {
-                // MIDI Channel Prefix
-                if (metaLength == 1) {
-                    char channelPrefix;
-                    file.read(&channelPrefix, 1);
-                    int midiChannel = channelPrefix & 0x0F; // Extract the channel bits
-                    //std::cout << "MIDI Channel Prefix: " << midiChannel << std::endl;
-                }
-                break;
-            }
-            case 0x2F: {
-                // End of Track
-                if (metaLength == 0) {
-                    Serial.println("End of Track");
-                    // You might want to set the endOfTrackTicks value in the Track struct here
-                }
-                break;
-            }
-            case 0x51: {
-                // Set Tempo
-                if (metaLength == 3) {
-                    char tempoBytes[3];
-                    file.read(tempoBytes, 3);
-                    long int microsecondsPerQuarterNote = (tempoBytes[0] << 16) | (tempoBytes[1] << 8) | tempoBytes[2];
-                    track.tempoQuarterNote = microsecondsPerQuarterNote;
-                    Serial.print("Set Tempo: ");
-                    Serial.print(microsecondsPerQuarterNote);
-                    Serial.println(" microseconds per quarter note");
-                }
-                break;
-            }
-            case 0x58: {
-                // Time Signature
-                if (metaLength == 4) {
-                    char timeSignatureBytes[4];
-                    file.read(timeSignatureBytes, 4);
-                    int nn = timeSignatureBytes[0]; // Numerator
-                    int dd = timeSignatureBytes[1]; // Denominator
-                    int cc = timeSignatureBytes[2]; // MIDI clocks per metronome click
-                    int bb = timeSignatureBytes[3]; // Notated 32nd-notes per MIDI quarter note
-                    //std::cout << "Time Signature: " << nn << "/" << (1 << dd) << ", MIDI clocks per metronome click: " << cc
-                      //  << ", Notated 32nd-notes per MIDI quarter note: " << bb << std::endl;
-                    track.thirtysecondNotesPerDivision = bb;
-                }
-                break;
-            }
-            case 0x59: {
-                // Key Signature
-                if (metaLength == 2) {
-                    char keySignatureBytes[2];
-                    file.read(keySignatureBytes, 2);
-                    int sf = keySignatureBytes[0]; // Key Signature
-                    int mi = keySignatureBytes[1]; // Minor Key
-                    //std::cout << "Key Signature: " << sf << " " << (mi ? "Minor" : "Major") << std::endl;
-                }
-                break;
-            }
-                     // Handle other meta events as needed
-            default:
-                // Skip other meta events
-                file.ignore(metaLength);
-                break;
-            }
-
-        }
-        else {
-            // MIDI Event
-            int midiChannel = (statusByte & 0x0F) + 1; // Extract the channel bits (1-16)
-
-            switch (statusByte & 0xF0) {
-            case 0x80: // Note Off
-            case 0x90: // Note On
-            case 0xA0: // Aftertouch
-            case 0xB0: // Control Change
-            case 0xE0: // Pitch Bend
-                // These messages have two data bytes
-                char dataByte1, dataByte2;
-                file.read(&dataByte1, 1);
-                file.read(&dataByte2, 1);
-
-                // Process and store the MIDI event using the function
-                processMidiEvent(track, currentTick, midiChannel, statusByte, dataByte1, dataByte2, division);
-                break;
-            case 0xC0: // Program change
-                dataByte1;
-                file.read(&dataByte1, 1);
-                //Midi Event process 2
-                break;
-            default:
-                // Unrecognized MIDI event, ignore it
-                break;
-            }
-        }
-    }
-
-    return true;
-}
 
 char noteOutput(Note note, bool hand)
 {
     char temp;
-    int midimanipulated = note.midi - 21;
+    int midimanipulated = ActiveKeyboard::keyIndex(note.midi);
     temp = midimanipulated;
     if (hand) // if left hand is true 
     {
@@ -466,18 +64,20 @@ char noteOutput(Note note, bool hand)
     }
     return temp;
 }
-void recording(std::bitset<88> notesplayed[])
+// Turn 20 scanned frames into a one track MIDI file on SPIFFS: a note on
+// for every key that goes down, a note off for every key that comes up
+void recording(const KeyFrame notesplayed[])
 {
     File file = SPIFFS.open("/recording.mid","w");
     
     if(!file)
     {
-      Serial.println("Failed to open file for writing");
+      LOG_ERROR(KEYS, "Failed to open file for writing");
       return;
     }
     else
     {
-      Serial.println("File opened for writing");
+      LOG_INFO(KEYS, "File opened for writing");
     }
     //std::ofstream clearmidi("C:\\Users\\caden\\source\\repos\\testrecordingc++\\newFile.mid", std::ios::trunc);
     //clearmidi.close();
@@ -488,7 +88,7 @@ void recording(std::bitset<88> notesplayed[])
     //}
     
     // MIDI header
-    const char header[] = { 'M','T','h','d', 0x00, 0x00, 0x00, 0x06, 0x00, 0x01, 0x00, 0x01, 0x00, 0x80 };
+    const uint8_t header[] = { 'M','T','h','d', 0x00, 0x00, 0x00, 0x06, 0x00, 0x01, 0x00, 0x01, 0x00, 0x80 };
 
 
     // MIDI track header
@@ -502,48 +102,23 @@ void recording(std::bitset<88> notesplayed[])
     // Iterate over each set of notes played
     // Initialize deltaTime outside the loop
     for (size_t i = 0; i < 20; ++i) {
-        const auto& currentNotes = notesplayed[i];
+        const KeyFrame& currentNotes = notesplayed[i];
 
-        // Iterate through each bit in the bitset
-        for (size_t j = 0; j < currentNotes.size(); ++j) {
-            // Check if the note is turned on (0 to 1 transition)
-            if (i == 0)
+        if (i == 0)
+        {
+            // Every key already down starts the track
+            for (int j : currentNotes)
             {
-                if (currentNotes[j])
-                {
-                    trackData.push_back(0x00);
-                    trackData.push_back(0x90); // Note-on status byte
-                    trackData.push_back(j + 20); // Note number
-                    trackData.push_back(0x7F); // Velocity (max velocity)
-                }
-
-            }
-            else if (currentNotes[j] && (!notesplayed[i - 1][j])) {
-                // Write MIDI note-on event with current deltaTime
-                // Calculate VLQ for delta time
-                std::vector<unsigned char> vlqBytes;
-                unsigned int deltaTimeValue = deltaTime;
-                do {
-                    unsigned char byte = deltaTimeValue & 0x7F; // Extract lowest 7 bits
-                    deltaTimeValue >>= 7; // Shift right by 7 bits
-                    if (deltaTimeValue > 0) {
-                        byte |= 0x80; // Set MSB if more bytes follow
-                    }
-                    vlqBytes.push_back(byte);
-                } while (deltaTimeValue > 0);
-
-                // Write VLQ bytes to trackData
-                for (auto it = vlqBytes.rbegin(); it != vlqBytes.rend(); ++it) {
-                    trackData.push_back(*it);
-                }
+                trackData.push_back(0x00);
                 trackData.push_back(0x90); // Note-on status byte
-                trackData.push_back(j + 20); // Note number
+                trackData.push_back(ActiveKeyboard::noteOf(j)); // Note number
                 trackData.push_back(0x7F); // Velocity (max velocity)
             }
-            // Check if the note is turned off (1 to 0 transition)
-            else if (!currentNotes[j] && (notesplayed[i - 1][j])) 
-            {
-                // Write MIDI note-off event with current deltaTime
+        }
+        else
+        {
+            // Only the keys that changed since the last frame, lowest first
+            for (int j : currentNotes ^ notesplayed[i - 1]) {
                 // Calculate VLQ for delta time
                 std::vector<unsigned char> vlqBytes;
                 unsigned int deltaTimeValue = deltaTime;
@@ -560,9 +135,11 @@ void recording(std::bitset<88> notesplayed[])
                 for (auto it = vlqBytes.rbegin(); it != vlqBytes.rend(); ++it) {
                     trackData.push_back(*it);
                 }
-                trackData.push_back(0x80); // Note-off status byte
-                trackData.push_back(j + 20); // Note number
-                trackData.push_back(0x00); // Velocity (note-off)
+                // Note on for a 0 to 1 transition, note off for 1 to 0
+                bool down = currentNotes[j];
+                trackData.push_back(down ? 0x90 : 0x80); // status byte
+                trackData.push_back(ActiveKeyboard::noteOf(j)); // Note number
+                trackData.push_back(down ? 0x7F : 0x00); // Velocity (max, or note-off)
             }
         }
         
@@ -612,21 +189,31 @@ void recording(std::bitset<88> notesplayed[])
 static const long long int spiClk = 1000000;  // 1 MHz
 SPIClass* vspi = NULL;
 
-int note_bytes[11] = {0};
-unsigned long previous_time = 0;
+uint8_t note_bytes[LED_LEVEL_BITS][ActiveKeyboard::registers] = { { 0 } }; //the newest frame, one row burst per bit plane
 
 #define DELAY 2000  //general delay used between writes to a row of shift registers
-#define ShiftRegNum 11 //number of shift registers to test
-#define Rows 4        //how many rows of LEDs
+//register and row counts come from ActiveKeyboard (keyboard_geometry.h)
 #define LED 2         //pin for LED on board of ESP32 (for debugging purposes)
 //these are all arbitrary values
 //Cadens code should write into the 'next' array with bits and it should cycle through from there
 //for PIC24
-int next[11] = { 0};
-int  first[11] = { 0 }; //initial first row
-int  second[11] = { 0 };//initial second row
-int third[11] = { 0 };//initial third row
-int  fourth[11] = { 0 };
+uint8_t next[LED_LEVEL_BITS][ActiveKeyboard::registers] = { { 0 } };
+uint8_t led_rows[ActiveKeyboard::rows][LED_LEVEL_BITS][ActiveKeyboard::registers] = { { { 0 } } }; //row 0 is the first (top) row
+DisplayBuffers display; //what waterfall_display() shows: led_rows as of the last cycle()
+const uint8_t blank_row[ActiveKeyboard::registers] = { 0 };
+
+//Brightness is binary code modulation over whole refresh passes: plane b is
+//shown for 2^b passes out of every LED_BCM_PASSES. The latch pin also clocks
+//the decade counter, so a row can't be relatched within a pass; the passes
+//are the time slices instead.
+#define LED_BCM_PASSES (LED_LEVELS - 1)
+int bcm_pass = 0;
+
+//bit plane shown on each pass of the cycle: 0, 1, 1, 2, 2, 2, 2, ...
+constexpr int bcmPlane(int pass)
+{
+    return pass < 1 ? 0 : 1 + bcmPlane((pass - 1) / 2);
+}
 //for ESP32
 // int next =    0b111111111111;
 // int first =   0b100011000000; //initial first row
@@ -639,23 +226,21 @@ int  fourth[11] = { 0 };
 //used to 'push down' arrays and fill the next one with incoming new data
 void cycle() 
 {
-    for (int i = 0; i < ShiftRegNum; i++) 
-    {
-        fourth[i] = third[i];
-        third[i] = second[i];
-        second[i] = first[i];
-        first[i] = next[i];
-        next[i] =note_bytes[i];
-    }
+    PROFILE_SCOPE(PROBE_CYCLE);
+    //every row moves down one, the bottom row drops off
+    memmove(led_rows[1], led_rows[0], sizeof(led_rows) - sizeof(led_rows[0]));
+    memcpy(led_rows[0], next, sizeof(next));
+    memcpy(next, note_bytes, sizeof(note_bytes));
     //next = Cadens data!!!! (these may need to be floats or broken back up into an array)
+    display_publish(display, led_rows); //the display only sees whole pictures
 }
 
 //if desired to show static LED arrays (spelling a word or something)
-void static_display(int array[Rows][ShiftRegNum]) 
+void static_display(uint8_t array[ActiveKeyboard::rows][ActiveKeyboard::registers]) 
 {
   digitalWrite(4, LOW); //reset pin of decade counter low
 
-  for (int r = 0; r < Rows; r++)
+  for (int r = 0; r < ActiveKeyboard::rows; r++)
   {
     //for 'SPIsettings' spiClk speed is prev declared, MSBFIRST is most sig bit is transmitted first
     //SPI_MODE can still be looked at, might be 2 instead of 0???
@@ -663,7 +248,7 @@ void static_display(int array[Rows][ShiftRegNum])
       //for driving latch low for shift register and counter low for the decade counter
       digitalWrite(vspi->pinSS(), LOW);  //pull SS low to prep other end for transfer
     
-    for(int c = 0; c < ShiftRegNum; c++)
+    for(int c = 0; c < ActiveKeyboard::registers; c++)
     {
       //for transferring the desired data
       vspi->transfer(array[r][c]);
@@ -683,40 +268,33 @@ void static_display(int array[Rows][ShiftRegNum])
 //for 'waterfall' effect (what we will be using for the learning experience)
 void waterfall_display() 
 {
-  //std::bitset<8> array[Rows][ShiftRegNum];
-  //after every cycle function this will be updated to next iteration of notes
-    int array[Rows][ShiftRegNum];
-
-         for (int k = 0; k<ShiftRegNum ; k++) 
-       {
-        array[0][k] = first[k];
-        array[1][k] = second[k];
-        array[2][k] = third[k];
-        array[3][k] = fourth[k];
-       }
+    PROFILE_SCOPE(PROBE_DISPLAY);
+  //after every cycle function the newest image holds the next iteration of notes,
+  //each row already rendered per bit plane in the order its registers are clocked;
+  //the whole pass sends the one image it took here
+  const DisplayImage& image = display_take(display);
+  int plane = bcmPlane(bcm_pass);
+  bcm_pass = (bcm_pass + 1) % LED_BCM_PASSES;
 
   digitalWrite(4, LOW); //reset pin of decade counter low
 
-  for (int r = 0; r < Rows; r++)
+  //for 'SPIsettings' spiClk speed is prev declared, MSBFIRST is most sig bit is transmitted first
+  //SPI_MODE can still be looked at, might be 2 instead of 0???
+  vspi->beginTransaction(SPISettings(spiClk, MSBFIRST, SPI_MODE0)); //begins spi transaction
+  for (int r = 0; r <= ActiveKeyboard::rows; r++)
   {
-    //for 'SPIsettings' spiClk speed is prev declared, MSBFIRST is most sig bit is transmitted first
-    //SPI_MODE can still be looked at, might be 2 instead of 0???
-      vspi->beginTransaction(SPISettings(spiClk, MSBFIRST, SPI_MODE0)); //begins spi transaction
       //for driving latch low for shift register and counter low for the decade counter
       digitalWrite(vspi->pinSS(), LOW);  //pull SS low to prep other end for transfer
-    
-    for(int c = 8; c > 2; c--)
-    {
-      //for transferring the desired data
-      vspi->transfer(array[r][c]);
-      //
-    } 
-
+      //the whole row goes out in one burst; the extra last row is blank so the
+      //bottom row is lit for one burst like the others and nothing stays lit
+      //between passes, which keeps the plane weights exact
+      vspi->writeBytes(r < ActiveKeyboard::rows ? image.rows[r][plane] : blank_row, ActiveKeyboard::registers);
     //every high signal latches the shift register data and counts the decade counter to the next row of LEDs
       digitalWrite(vspi->pinSS(), HIGH);  //pull ss high to signify end of data transfer
-      vspi->endTransaction(); //ends SPI transaction
       //delay(1000); //this delay can be increased a lot to show individual rows cycling through
   }
+  vspi->endTransaction(); //ends SPI transaction
+  PROFILE_LED_LATCHED();
 
   //digitalWrite(4, HIGH); //reset pin of decade counter high to reset the counter to remove the delay
   //delay(10);
@@ -732,76 +310,59 @@ const int q_h = 16;
 const long shift_interval = 1000;  // Function will be called once a millisecond
 int i = 0;
 int k = 0;
-std::bitset<8> keyPress = 0;
-std::bitset<8> shift_register_1 = 0;
-std::bitset<8> shift_register_2 = 0;
-std::bitset<8> shift_register_3 = 0;
-std::bitset<8> shift_register_4 = 0;
-std::bitset<8> shift_register_5 = 0;
-std::bitset<8> shift_register_6 = 0;
-std::bitset<8> shift_register_7 = 0;
-std::bitset<8> shift_register_8 = 0;
-std::bitset<8> shift_register_9 = 0;
-std::bitset<8> shift_register_10 = 0;
-std::bitset<8> shift_register_11 = 0;
-std::bitset<88> output;
-
-
-std::bitset<8> receiveSR(void) {
-    std::bitset<8> shift_register = {};
-
-    for (i = 0; i < 8; i++) {
-        if (i < 3)
-        {}
-        else if (digitalRead(q_h) == HIGH) {
-            shift_register.set(i);  // Load output into variable
-        }
-        else {
-            shift_register.reset(i);  // Load output into variable
-        }
-
+KeyFrame output; //keys held at the last scan, indexed like frames
+unsigned long lastScanUs = 0;
 
-        // Clock toggle
-        digitalWrite(clock_pin, HIGH);
-        digitalWrite(clock_pin, LOW);
-    }
 
-    return shift_register;
-}
-void readSR(void) {
+//scan the keyboard; returns the keys that went down since the last scan
+KeyFrame readSR(void) {
+    PROFILE_SCOPE(PROBE_READSR);
+    KeyFrame previous = output;
     output.reset();
-    shift_register_1.reset();
 
     digitalWrite(shift_load, LOW); // Load the registers
     digitalWrite(shift_load, HIGH); // Prepare to shift
     digitalWrite(clock_inhibit, LOW); // Clock can now be used
 
-    shift_register_1 = receiveSR();
-          for(int i = 3; i < 8; i++)
-          {
-              // Set the bit in the byte
-              if (shift_register_1[i]) 
-              {
-                  output.set(i+25); // Set the bit to 1
-                  Serial.print("X");
-              } 
-              else 
-              {
-                  output.reset(i+25); // Set the bit to 0 (optional, already initialized to 0)
-                  Serial.print(".");
-              }
-          }
-          Serial.println();
-    
-    
+    //clock the whole 165 chain; the scan table says which key each bit is
+    for (int b = 0; b < ActiveKeyboard::scanBits; b++)
+    {
+        int key = ActiveKeyboard::scan.key[b];
+        if (key >= 0 && digitalRead(q_h) == HIGH)
+        {
+            output.set(key);
+        }
+
+        // Clock toggle
+        digitalWrite(clock_pin, HIGH);
+        digitalWrite(clock_pin, LOW);
+    }
+#if LOG_ENABLED(DEBUG, KEYS)
+    char scanned[ActiveKeyboard::scanBits + 1];
+    int wired = 0;
+    for (int b = 0; b < ActiveKeyboard::scanBits; b++)
+    {
+        if (ActiveKeyboard::scan.key[b] >= 0)
+        {
+            scanned[wired++] = output[ActiveKeyboard::scan.key[b]] ? 'X' : '.';
+        }
+    }
+    scanned[wired] = '\0';
+    LOG_DEBUG(KEYS, "%s", scanned);
+#endif
+
 
     digitalWrite(clock_inhibit, HIGH); // Disable the clock
 
-    return;
+    KeyFrame pressed = output.without(previous);
+    if (pressed.any())
+    {
+        PROFILE_KEY_PRESSED(); // a key went down since the last scan
+    }
+    return pressed;
 }
 
 unsigned long past_time = 0;
-unsigned long p_time = 0;
 
 int idle_next[7] =   { 0b11000000, 0b11000000, 0b11000000, 0b11000000, 0b11000000, 0b11000000, 0b11000000 };
 int idle_first[7] =  { 0b00110000, 0b00110000, 0b00110000, 0b00110000, 0b00110000, 0b00110000, 0b00110000 }; //initial first row
@@ -809,10 +370,11 @@ int idle_second[7] = { 0b00001100, 0b00001100, 0b00001100, 0b00001100, 0b0000110
 int idle_third[7] =  { 0b00110000, 0b00110000, 0b00110000, 0b00110000, 0b00110000, 0b00110000, 0b00110000 };//initial third row
 int idle_fourth[7] = { 0b11000000, 0b11000000, 0b11000000, 0b11000000, 0b11000000, 0b11000000, 0b11000000 };//initial fourth row
 int idle_hold[7] =   { 0b00000000, 0b00000000, 0b00000000, 0b00000000, 0b00000000, 0b00000000, 0b00000000 };
+const int idle_registers = 7; //the idle pattern is its own 7 register wide picture
 
 void idle_waterfall_display() 
 {
-  int array[Rows][7];
+  int array[ActiveKeyboard::rows][idle_registers];
   //after every cycle function this will be updated to next iteration of notes
 
 for (int k = 6; k > -1 ; k--) 
@@ -825,7 +387,7 @@ for (int k = 6; k > -1 ; k--)
 
   digitalWrite(4, LOW); //reset pin of decade counter low
 
-  for (int r = 0; r < Rows; r++)
+  for (int r = 0; r < ActiveKeyboard::rows; r++)
   {
     //for 'SPIsettings' spiClk speed is prev declared, MSBFIRST is most sig bit is transmitted first
     //SPI_MODE can still be looked at, might be 2 instead of 0???
@@ -868,7 +430,7 @@ for (int k = 6; k > -1 ; k--)
 
 void idle_cycle() 
 {
-    for (int i = 0; i < ShiftRegNum; i++) 
+    for (int i = 0; i < idle_registers; i++) 
     {
         idle_hold[i] = idle_fourth[i];
         idle_fourth[i] = idle_third[i];
@@ -883,10 +445,145 @@ void idle_cycle()
 
 //#define DELAY 300  //general delay used between writes to a row of shift registers
 
+// The song being downloaded: small songs stay in RAM; once a song outgrows
+// SONG_RAM_LIMIT what we have moves to SPIFFS and the rest is appended there
+struct SongDownload {
+    File spillFile;
+    bool spilled = false;
+    bool ok = true;
+
+    //decoded song bytes land here, never the compressed ones
+    void operator()(const uint8_t* data, size_t length)
+    {
+        if (!spilled && midi.size() + length > SONG_RAM_LIMIT)
+        {
+            spillFile = SPIFFS.open(SONG_PATH, "w");
+            spillFile.write(reinterpret_cast<const uint8_t*>(midi.data()), midi.size());
+            midi.clear();
+            midi.shrink_to_fit();
+            spilled = true;
+        }
+        if (spilled)
+        {
+            spillFile.write(data, length);
+        }
+        else
+        {
+            midi.append(reinterpret_cast<const char*>(data), length);
+        }
+    }
+};
+
+// Session sink for a GET reply: undo the compression as it arrives
+void receiveSong(void* context, const uint8_t* data, size_t length)
+{
+    SongDownload& download = *static_cast<SongDownload*>(context);
+    download.ok = song_transfer_feed(songTransfer, data, length, download) && download.ok;
+}
+
+// A multi-line report, into the log a line at a time so it stays in order
+// with everything else
+void logReport(const std::string& text)
+{
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+        std::string line = text.substr(start, end - start);
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        LOG_INFO(PLAYER, "%s", line.c_str());
+        start = end + 1;
+    }
+}
+
+// Probe results, arena and log use, for STAT
+void statsReport(Print& out)
+{
+    PROFILE_DUMP(out);
+    arena_report(songArena, out);
+    log_report(out);
+    practice_log_report(practiceLog, out);
+}
+
+// Requests the server sends us: it can ask for the stats at any time. None
+// of them carry a payload yet.
+void handleSessionRequest(Session& s, uint16_t id, uint8_t command, const uint8_t*, size_t)
+{
+    if (command == SESSION_STAT)
+    {
+        SessionText stats;
+        statsReport(stats);
+        session_reply(s, id, command, SESSION_OK, reinterpret_cast<const uint8_t*>(stats.text.data()), stats.text.size());
+    }
+    else
+    {
+        session_reply(s, id, command, SESSION_BAD_REQUEST, nullptr, 0);
+    }
+}
+
+// The info line for the song in midi, from its meta events alone. Uses the
+// song arena, so call it before parsing.
+std::string describeSong()
+{
+    SessionText info;
+    MidiData preview(songArena);
+    if (scanSong(reinterpret_cast<const unsigned char*>(midi.data()), midi.size(), songArena, preview))
+    {
+        printSongInfo(preview, info);
+    }
+    return info.text;
+}
+
+// Parse the demo song and save it as the snapshot. The slow path, taken
+// once on a board that has a demo song and no snapshot yet.
+bool snapshotDemo()
+{
+    File demo = SPIFFS.open(DEMO_PATH, "r");
+    midi.resize(demo.size());
+    midi.resize(demo.read(reinterpret_cast<uint8_t*>(&midi[0]), midi.size()));
+    demo.close();
+    LOG_INFO(PLAYER, "Parsing the demo song for the next boot");
+
+    std::string title = describeSong();
+    std::istringstream midiFile(midi, std::ios::binary);
+    midiFile.ignore(4); //"MThd", measureSong() checks it
+    SongSizing sizing;
+    MidiData midiData(songArena);
+    bool ok = measureSong(midi, songArena, sizing) && sizing.bytes <= arena_remaining(songArena) &&
+              parseSong(midiFile, sizing, songArena, midiData) && !midiData.tracks.empty() && buildFrames(midiData);
+    if (ok)
+    {
+        SongIndex songIndex;
+        buildSongIndex(midiData, songIndex);
+        song_snapshot_save(midiData.frames.data(), songIndex, midiData.usPerQuarter, song_snapshot_source(midi), title);
+        song_snapshot_wait();
+    }
+    else
+    {
+        LOG_ERROR(PLAYER, "The demo song won't parse in RAM");
+    }
+    midi.clear();
+    midi.shrink_to_fit();
+    return ok;
+}
+
 void setup()
 {
     pinMode(LED_BUILTIN, OUTPUT);
     Serial.begin(115200);
+    log_begin();
+    //take the song arena first, while the heap is still in one piece
+    if (!arena_init(songArena, SONG_ARENA_BUDGET))
+    {
+      LOG_ERROR(PLAYER, "could not reserve the song arena!");
+    }
     pinMode(clock_pin, OUTPUT);
     pinMode(clock_inhibit, OUTPUT);
     pinMode(shift_load, OUTPUT);
@@ -903,94 +600,327 @@ void setup()
 
     if(SPIFFS.begin(true))
     {
-      Serial.println("SPIFFS filesystem mounted successfully");
-      if(SPIFFS.exists("/recording.mid")) Serial.println("A recording exists in SPIFFS filesystem!");
-      if(SPIFFS.exists("/demo.mid")) Serial.println("A demo MIDI exists in SPIFFS filesystem!");
+      LOG_INFO(PLAYER, "SPIFFS filesystem mounted successfully");
+      if(SPIFFS.exists("/recording.mid")) LOG_INFO(PLAYER, "A recording exists in SPIFFS filesystem!");
+      practice_log_begin(practiceLog);
+      //the last song parsed is ready to go; the first boot with a demo song
+      //parses it the long way once, so every boot after that is quick
+      bootSong = song_snapshot_open(bootSnapshot, SNAPSHOT_PATH) ||
+                 (SPIFFS.exists(DEMO_PATH) && snapshotDemo() && song_snapshot_open(bootSnapshot, SNAPSHOT_PATH));
     }
     else 
     {
-      Serial.println("ERROR: SPIFFS filesystem mount failed!");
+      LOG_ERROR(PLAYER, "SPIFFS filesystem mount failed!");
     }
     delay(10);
 
-    // We start by connecting to a WiFi network
-    WiFiMulti.addAP("Kirby", "8675309bro");
+    // Join the WiFi network and find the server in the background; the
+    // session reports when each step is done and loop() idles until then
+    WiFi.mode(WIFI_STA);
+    WiFi.begin("Kirby", "8675309bro");
+    session.handler = handleSessionRequest;
+    session_open(session, SERVER_HOST, SERVER_PORT);
+}
+
+// Serial commands while playing: '+'/'-' change the practice speed by 10%,
+// '=' goes back to full speed, 'b'/'l' jump to a bar or loop some
+// (song_index.h), anything else goes to the profiler. Also drains the log,
+// where no task does that.
+void pollSerialCommands()
+{
+    log_poll(Serial);
+    while (Serial.available() > 0)
+    {
+        int command = Serial.read();
+        if (practice_input(practice, command))
+        {
+            continue;
+        }
+        if (command == '+' || command == '-' || command == '=')
+        {
+            int speed = command == '=' ? 100 : frameClock.speedPercent + (command == '+' ? 10 : -10);
+            frame_clock_set_speed(frameClock, speed);
+            practice_speed(practiceLog, frameClock.speedPercent, frame_clock_now_us());
+            LOG_INFO(PLAYER, "Speed %d%%", frameClock.speedPercent);
+        }
+        else
+        {
+            PROFILE_COMMAND(command, Serial);
+        }
+    }
+}
+
+// Start timing a song's frames from now, and grading how they are played
+void startSongClock(uint32_t usPerQuarter, uint32_t division, uint32_t ticksPerFrame, uint32_t frames)
+{
+    frame_clock_start(frameClock, usPerQuarter, division, ticksPerFrame);
+    practice_song(practiceLog, frames, frameClock.usPerQuarter, frameClock.speedPercent, frame_clock_now_us());
+    LOG_INFO(PLAYER, "Frame every %lu us", static_cast<unsigned long>(frame_clock_time_of(frameClock, ticksPerFrame) - frameClock.anchorUs));
+}
+
+void reportSongClock()
+{
+    practice_song_end(practiceLog, frame_clock_now_us());
+    LOG_INFO(PLAYER, "Clock drift: %ld us", static_cast<long>(frame_clock_drift_us(frameClock)));
+}
+
+// The notes in a frame about to go up are due when it reaches the bottom
+// row: after the 'next' buffer and every row above
+void gradeFrame(const LedFrame& frame, uint32_t songFrame)
+{
+    uint64_t dueUs = frame_clock_time_of(frameClock, frameClock.frameTick + (ActiveKeyboard::rows + 1) * frameClock.ticksPerFrame);
+    practice_frame(practiceLog, frame, songFrame, dueUs, frame_clock_now_us());
+}
+
+// Show one frame of notes: load it into note_bytes, then keep the display
+// refreshing until the frame clock says it is time to push the rows down
+void playFrame(const LedFrame& bitVector)
+{
+        //the geometry's wire table puts each key straight into its register byte
+        render_planes<ActiveKeyboard>(bitVector, note_bytes);
+#if LOG_ENABLED(DEBUG, DISPLAY)
+        //each key's level, then the register bytes of the brightest plane in hex
+        char shown[ActiveKeyboard::keys + 2 + 2 * ActiveKeyboard::registers];
+        int length = 0;
+        for (int count = 0; count < ActiveKeyboard::keys; count++)
+        {
+              int level = bitVector.level(count);
+              shown[length++] = level > 0 ? '0' + level : '.';
+          }
+        shown[length++] = ' ';
+  for (int i = 0; i < ActiveKeyboard::registers; i++) {
+      length += snprintf(shown + length, sizeof(shown) - length, "%02x", note_bytes[LED_LEVEL_BITS - 1][i]);
+  }
+        LOG_DEBUG(DISPLAY, "%s", shown);
+#endif
+
+          bool flag = 1;
+          while(flag == 1)
+          {
+            waterfall_display();
 
-    Serial.println();
-    Serial.println();
-    Serial.print("Waiting for WiFi... ");
+            pollSerialCommands();
+            if (micros() - lastScanUs >= shift_interval)
+            {
+              lastScanUs = micros();
+              practice_keys(practiceLog, readSR(), frame_clock_now_us());
+            }
+            if (frame_clock_due(frameClock))
+              {
+              PROFILE_RECORD_US(PROBE_FRAME_JITTER, frame_clock_advance(frameClock));
+              digitalWrite(4, HIGH); //reset pin of decade counter high to reset the counter to remove the delay
+              cycle(); //cycles through notes
+              practice_expire(practiceLog, frame_clock_now_us());
+              practice_log_poll(practiceLog);
+              //delay(200); //eventually remove just a debounce for proof of concept
+              flag = 0;
+            }
+            else
+            {
+              digitalWrite(4, HIGH); //reset pin of decade counter high to reset the counter to remove the delay
+            //delay(10);
+            }
+/*
+            if(digitalRead(0) == 0) //if 'correct' buttons are pressed example
+            {
+              digitalWrite(4, HIGH); //reset pin of decade counter high to reset the counter to remove the delay
+              cycle(); //cycles through notes
+              delay(200); //eventually remove just a debounce for proof of concept
+              flag = 0;
+            }
+            else
+            {
+              digitalWrite(4, HIGH); //reset pin of decade counter high to reset the counter to remove the delay
+            //delay(10);
+            }
+          }
+*/          
+          }
+}
 
-    while(WiFiMulti.run() != WL_CONNECTED) {
-        Serial.print(".");
-        delay(500);
+// Play every frame of an open stream, then close it. Jumps and loops
+// reposition the stream's decoder; the clock just carries on.
+void playStream(FrameStream& stream)
+{
+    LedFrame bitVector;
+    PracticeMove move;
+    uint32_t frame = 0; //song frame of bitVector, for grading
+    startSongClock(stream.usPerQuarter, stream.division, stream.step, stream.index.frames);
+    while (frame_stream_next(stream, bitVector))
+    {
+        gradeFrame(bitVector, frame);
+        playFrame(bitVector);
+        frame++;
+        if (practice_take(practice, stream.index, move))
+        {
+            if (move.loopEnd == 0 && move.seekFrame >= 0)
+            {
+                frame_stream_seek(stream, move.seekFrame);
+            }
+            else
+            {
+                frame_stream_loop(stream, move.loopStart, move.loopEnd);
+            }
+            frame = move.loopEnd > 0 ? move.loopStart : move.seekFrame >= 0 ? move.seekFrame : frame;
+        }
+        else if (move.loopEnd > 0 && frame >= move.loopEnd)
+        {
+            frame = move.loopStart; //the stream wrapped too
+        }
     }
+    frame_stream_close(stream);
+    reportSongClock();
+    LOG_INFO(STREAM, "Stream underruns: %lu", static_cast<unsigned long>(stream.underruns));
+}
 
-    Serial.println("");
-    Serial.println("WiFi connected");
-    Serial.println("IP address: ");
-    Serial.println(WiFi.localIP());
-    delay(500);
+// Play the song kept in a snapshot, then close it. Its frames come a block
+// at a time from SPIFFS; a damaged block ends the song there.
+void playSnapshot(SongSnapshot& snapshot)
+{
+    LOG_INFO(PLAYER, "%s", snapshot.header.title);
+    startSongClock(snapshot.header.usPerQuarter, snapshot.header.division, snapshot.header.step, snapshot.header.frames);
+    LedFrame bitVector;
+    PracticeMove loop;
+    for (uint32_t index = 0; song_snapshot_frame(snapshot, index, bitVector); )
+    {
+        gradeFrame(bitVector, index);
+        playFrame(bitVector);
+        index++;
+        if (practice_take(practice, snapshot.index, loop) && loop.seekFrame >= 0)
+        {
+            index = loop.seekFrame;
+        }
+        else if (loop.loopEnd > 0 && index >= loop.loopEnd)
+        {
+            index = loop.loopStart;
+        }
+    }
+    song_snapshot_close(snapshot);
+    reportSongClock();
 }
 
-unsigned timeout = 0;
-void loop() {
-    const uint16_t port = 1235;
-    const char * host = "172.20.10.2"; // ip or dns
-    int mode = PLAYBACK_MODE;
-    int maxloops = 0;
+// Play a song that lives on SPIFFS, decoding a few frames ahead of the display
+void playStreamedSong(const char* path)
+{
+    if (frame_stream_open(frameStream, path))
+    {
+        playStream(frameStream);
+    }
+}
 
-    Serial.print("Connecting to host machine ");
-    Serial.println(host);
-    pinMode(LED_BUILTIN, HIGH);
-    // Use WiFiClient class to create TCP connections
-    WiFiClient client;
+// Keep playing whatever the server queues up. Each song was fetched while the
+// one before it played, so it starts on the very next frame tick; while a
+// slow download is still running the rows just keep falling empty.
+void playPlaylist()
+{
+    LedFrame blank;
+    for (;;)
+    {
+        SongSlot& slot = playlist.slots[playlist.current];
+        while (slot.state.load() == SLOT_LOADING)
+        {
+            playFrame(blank);
+        }
+        if (slot.state.load() != SLOT_READY)
+        {
+            break;
+        }
+        //fetch the song after this one into the other slot while it plays
+        playlist.current = (playlist.current + 1) % PLAYLIST_SLOTS;
+        playlist_prefetch(playlist, playlist.current);
+
+        playlist.songsPlayed++;
+        LOG_INFO(PLAYER, "Playlist song %lu", static_cast<unsigned long>(playlist.songsPlayed));
+        playStream(slot.stream);
+        slot.state.store(SLOT_EMPTY);
+    }
 
-    File readFile = SPIFFS.open("/recording.mid","r");
-   
+    //let the last notes fall off the bottom
+    for (int index = 0; index < 3; index++)
+    {
+        playFrame(blank);
+    }
+    LOG_INFO(PLAYER, "Playlist finished");
+}
 
-    if (!client.connect(host, port)) {
-        //pinMode(LED_BUILTIN, LOW);
-        //Serial.println("Connection to host failed.");
-        //Serial.println("Waiting 5 seconds before retrying...");
-        //delay(5000);
+SongDownload download;         //the song on its way in
+int songRequest = -1;          //session slot of that GET, -1 when none is out
+unsigned long downloadStartUs = 0;
+
+unsigned timeout = 0;
+void loop() {
+    int mode = PLAYBACK_MODE;
 
-    unsigned long n_time = millis();
+    if (bootSong)
+    {
+      //straight into last time's song, while WiFi comes up behind it
+      bootSong = false;
+      playSnapshot(bootSnapshot);
+      return;
+    }
 
-      if (n_time - p_time >= 5000)
-      {
+    // Nothing here waits on the network: until the session is up and the
+    // song has arrived, every pass just draws the idle animation
+    if (!session_open(session, SERVER_HOST, SERVER_PORT)) {
         pinMode(LED_BUILTIN, LOW);
-        Serial.println("Connection to host failed.");
-        Serial.println("Waiting 5 seconds before retrying...");
-        p_time = n_time;
-      }
-      else
+        idle_waterfall_display();
+        pollSerialCommands();
+        return;
+    }
+    pinMode(LED_BUILTIN, HIGH);
+
+    if (songRequest < 0)
+    {
+      //ask for the next song, compressed if the server can; small songs stay
+      //in RAM, bigger ones move to SPIFFS (see SongDownload)
+      download = SongDownload();
+      song_transfer_begin(songTransfer);
+      downloadStartUs = micros();
+      const uint8_t getOptions = SESSION_GET_COMPRESSED;
+      songRequest = session_request(session, SESSION_GET, &getOptions, 1, receiveSong, &download);
+      if (songRequest < 0)
       {
-          idle_waterfall_display(); 
+        return;
       }
+    }
+    if (!session_done(session, songRequest, SONG_REPLY_TIMEOUT_MS))
+    {
+        idle_waterfall_display();
+        pollSerialCommands();
+        practice_log_upload(practiceLog, session); //nothing is playing: a good time to send it
         return;
     }
-
-    // This will send a request to the server
-    //uncomment this line to send an arbitrary string to the server
-    //client.print("Send this data to the server");
-    //uncomment this line to send a basic document request to the server
-    
-    client.print("GET\n\n");
-
-  //wait for the server's reply to become available
-  while (!client.available() && maxloops < 1000)
+  uint8_t status = session_finish(session, songRequest);
+  songRequest = -1;
+  download.ok = song_transfer_end(songTransfer, download) && download.ok;
+  if (download.spilled)
   {
-    maxloops++;
-    delay(1); //delay 1 msec
+    download.spillFile.close();
+  }
+  PROFILE_RECORD_US(PROBE_DOWNLOAD, micros() - downloadStartUs);
+  LOG_INFO(SESSION, "Received %lu %sbytes for %lu bytes of song", static_cast<unsigned long>(songTransfer.received),
+           songTransfer.mode == TRANSFER_COMPRESSED ? "compressed " : "",
+           static_cast<unsigned long>(songTransfer.mode == TRANSFER_COMPRESSED ? songTransfer.lz.produced : songTransfer.received));
+  if (status != SESSION_OK)
+  {
+    LOG_WARN(SESSION, "%s", status == SESSION_NOT_FOUND ? "Server has no song for us" : "Song request failed");
+    midi.clear();
+    return;
+  }
+  if (!download.ok)
+  {
+    LOG_ERROR(SESSION, "Compressed song was cut short or corrupt");
+    midi.clear();
+    return;
   }
 
-  while (client.available() > 0 && mode == PLAYBACK_MODE)
+  if (download.spilled && mode == PLAYBACK_MODE)
   {
-        //read back one line from the server
-        char c = client.read();
-        midi.push_back(c);
-        
-        Serial.print(c);
+    LOG_INFO(PLAYER, "Song is bigger than RAM, streaming it from SPIFFS");
+    playlist_init(playlist, session);
+    playlist_prefetch(playlist, 0);
+    playStreamedSong(SONG_PATH);
+    goto END;
   }
 
 
@@ -1002,7 +932,7 @@ if(mode == PLAYBACK_MODE)
 
     if (!midiFile) 
     {
-        std::cerr << "Error opening the MIDI file." << std::endl;
+        LOG_ERROR(PARSER, "Error opening the MIDI file.");
         return;
     }
 
@@ -1012,266 +942,143 @@ if(mode == PLAYBACK_MODE)
     if(std::string(headerChunkID, 4) == "SKIP")
     {
         pinMode(LED_BUILTIN, LOW);
-        std::bitset<88> bitsets[20]{};
-        bitsets[0][40]=  1;
-        bitsets[1][40] = 0; 
-        bitsets[2][41] = 1;
-        bitsets[3][41] = 0; 
-        bitsets[4][42] = 1;
-        bitsets[5][42] = 0; 
-        bitsets[6][43] = 1;
-        bitsets[7][43] = 0; 
-        bitsets[8][44] = 1;
-        bitsets[9][44] = 0; 
-        bitsets[10][45] = 1;
-        bitsets[11][45] = 0; 
-        bitsets[12][46] = 1;
-        bitsets[13][46] = 0;
-        bitsets[14][47] = 1;
-        bitsets[15][47] = 0;
-        bitsets[16][48] = 1;
-        bitsets[17][48] = 0;
-        bitsets[18][48] = 1;
-        bitsets[19][48] = 0;
+        KeyFrame bitsets[20]{};
+        bitsets[0].set(40, 1);
+        bitsets[1].set(40, 0); 
+        bitsets[2].set(41, 1);
+        bitsets[3].set(41, 0); 
+        bitsets[4].set(42, 1);
+        bitsets[5].set(42, 0); 
+        bitsets[6].set(43, 1);
+        bitsets[7].set(43, 0); 
+        bitsets[8].set(44, 1);
+        bitsets[9].set(44, 0); 
+        bitsets[10].set(45, 1);
+        bitsets[11].set(45, 0); 
+        bitsets[12].set(46, 1);
+        bitsets[13].set(46, 0);
+        bitsets[14].set(47, 1);
+        bitsets[15].set(47, 0);
+        bitsets[16].set(48, 1);
+        bitsets[17].set(48, 0);
+        bitsets[18].set(48, 1);
+        bitsets[19].set(48, 0);
         recording(bitsets);
-        client.print("PUT\n\n");
+        std::string recorded;
+        File readFile = SPIFFS.open("/recording.mid","r");
         while(readFile.available())
         {
-            char byte = readFile.read();
-            client.write(byte);
+            recorded.push_back(static_cast<char>(readFile.read()));
         }
-        Serial.println("Closing connection.");
-        client.stop();
-        while(true);
+        readFile.close();
+        if (session_wait(session, session_request(session, SESSION_PUT, reinterpret_cast<const uint8_t*>(recorded.data()), recorded.size(), nullptr, nullptr), SONG_REPLY_TIMEOUT_MS) != SESSION_OK)
+        {
+            LOG_WARN(SESSION, "Server didn't take the recording");
+        }
+        while(true){ log_poll(Serial); delay(10); }
     }
-        Serial.println("Closing connection.");
-        client.stop();
 
     if (std::string(headerChunkID, 4) != "MThd") 
     {
-        std::cerr << "Invalid MIDI file format." << std::endl;
+        LOG_ERROR(PARSER, "Invalid MIDI file format.");
         return;
     }
 
-    MidiData midiData;
-
-    unsigned char headerChunkSizeBuffer[4];
-    midiFile.read(reinterpret_cast<char*>(headerChunkSizeBuffer), 4);
-    unsigned int headerChunkSize = bigEndianToHost(headerChunkSizeBuffer, 4);
+    //the snapshot save may still be reading the last song out of the arena
+    song_snapshot_wait();
+    std::string title = describeSong();
+    logReport(title);
 
-    unsigned char formatTypeBuffer[2];
-    midiFile.read(reinterpret_cast<char*>(formatTypeBuffer), 2);
-    unsigned short formatType = bigEndianToHostShort(formatTypeBuffer);
-
-    unsigned char numTracksBuffer[2];
-    midiFile.read(reinterpret_cast<char*>(numTracksBuffer), 2);
-    unsigned short numTracks = bigEndianToHostShort(numTracksBuffer);
-
-    unsigned char divisionBuffer[2];
-    midiFile.read(reinterpret_cast<char*>(divisionBuffer), 2);
-    unsigned short division = bigEndianToHostShort(divisionBuffer);
-
-    std::cout << "Format Type: " << formatType << std::endl;
-    std::cout << "Number of Tracks: " << numTracks << std::endl;
-    std::cout << "Division: " << division << std::endl;
-    midiData.division = division;
-
-
-
-    for (int trackNumber = 0; trackNumber < numTracks; ++trackNumber) 
+    PROFILE_BEGIN(parse);
+    // Size the song before touching it: drops the previous song's arena and
+    // refuses anything that won't fit, rather than failing halfway through
+    SongSizing sizing;
+    if (!measureSong(midi, songArena, sizing))
     {
-        Track track;
-        if (!readTrackChunk(midiFile, track, division)) 
-        {
-            return;
-        }
-
-        // Add the track to the MidiData structure
-        midiData.tracks.push_back(track);
+        LOG_ERROR(PARSER, "Invalid MIDI file format.");
+        return;
     }
-    for (int i = 0; i < midiData.tracks.size(); i++)
+    if (sizing.bytes > arena_remaining(songArena))
     {
-
-        int notesize = midiData.tracks[i].notes.size();
-        for (int noteindex = 0; noteindex < notesize; noteindex++)
-        {
-            if (midiData.tracks[i].maxTick < midiData.tracks[i].notes[noteindex].ticks)
-            {
-                midiData.tracks[i].maxTick = midiData.tracks[i].notes[noteindex].ticks;
-            }
-        }
-        int counter = midiData.division / midiData.tracks[i].thirtysecondNotesPerDivision;
-        for (int count = 0; count < midiData.tracks[i].maxTick; count = count + counter)
-        {
-            midiData.tracks[i].bitmap[count] = std::move(std::bitset<88>());
-        }
-        for (int noteindex = 0; noteindex < notesize; noteindex++)
-        {
-            int tick = midiData.tracks[i].notes[noteindex].ticks; // Get the tick count
-            int midiNote = midiData.tracks[i].notes[noteindex].midi; // Get the MIDI note
-
-            // Check if the tick count entry exists in the bitmap
-            if (midiData.tracks[i].bitmap.find(tick) != midiData.tracks[i].bitmap.end()) {
-                // Access the bit vector associated with the tick count
-                std::bitset<88>& bitVector = midiData.tracks[i].bitmap[tick];
-                bitVector[midiNote] = true;
-            }
-        }
-       /*for (int index = 0; index < midiData.tracks[i].bitmap.size(); index++)
-        {
-            std::bitset<88>& bitVector = midiData.tracks[i].bitmap[index * counter];
-            for(int count = 0; count < 88; count++)
-            {
-                if (bitVector[count] == false)
-                {
-                    std::cout << "0";
-                }
-                else if (bitVector[count] == true)
-                {
-                    std::cout << "1";
-                }
-            }
-            std::cout << std::endl;
-            //std::cin.ignore(); // Ignore any previous input
-            //std::cin.get(); // Wait for a key press
-        }*/
+        //too big to parse in RAM: park the bytes on SPIFFS and stream them
+        LOG_INFO(PLAYER, "Song needs %lu bytes, arena has %lu", static_cast<unsigned long>(sizing.bytes),
+                 static_cast<unsigned long>(arena_remaining(songArena)));
+        File songFile = SPIFFS.open(SONG_PATH, "w");
+        songFile.write(reinterpret_cast<const uint8_t*>(midi.data()), midi.size());
+        songFile.close();
+        midi.clear();
+        midi.shrink_to_fit();
+        playlist_init(playlist, session);
+        playlist_prefetch(playlist, 0);
+        playStreamedSong(SONG_PATH);
+        goto END;
     }
 
-    int counter = midiData.division / midiData.tracks[1].thirtysecondNotesPerDivision;
-    if (midiData.tracks.size() > 2)
+    MidiData midiData(songArena);
+    if (!parseSong(midiFile, sizing, songArena, midiData))
     {
-        for (int count = 0; count < midiData.tracks[1].maxTick; count = count + counter)
-        {
-            midiData.bitmap[count] = std::move(std::bitset<88>());
-        }
-        for (int index = 0; index < midiData.tracks[1].bitmap.size(); index++)
-        {
-            std::bitset<88>& bitVector = midiData.tracks[1].bitmap[index * counter];
-            std::bitset<88>& bitVector2 = midiData.tracks[2].bitmap[index * counter];
-            std::bitset<88>& midibitvector = midiData.bitmap[index * counter];
-            for (int count = 0; count < 88; count++)
-            {
-                midibitvector[count] = (bitVector[count] || bitVector2[count]);
-            }
-            Serial.print("bitmap made");
-
-        }
+        return;
     }
-    if (midiData.tracks.size() == 2)
+    PROFILE_END(parse, PROBE_PARSE);
+    PROFILE_BEGIN(bitmap);
+    if (!buildFrames(midiData))
     {
-        for (int count = 0; count < midiData.tracks[1].maxTick; count = count + counter)
-        {
-            midiData.bitmap[count] = std::move(std::bitset<88>());
-        }
-        for (int index = 0; index < midiData.tracks[1].bitmap.size(); index++)
-        {
-            std::bitset<88>& bitVector = midiData.tracks[1].bitmap[index * counter];
-            std::bitset<88>& midibitvector = midiData.bitmap[index * counter];
-         //std::cin.ignore(); // Ignore any previous input
-         //std::cin.get(); // Wait for a key press
-            for (int count = 0; count < 88; count++)
-            {
-                midibitvector[count] = (bitVector[count]);
-            }
-        }
+        return;
+    }
+    PROFILE_END(bitmap, PROBE_BITMAP);
+    SongIndex songIndex;
+    buildSongIndex(midiData, songIndex);
+    {
+        SessionText arenaUse;
+        arena_report(songArena, arenaUse);
+        logReport(arenaUse.text);
     }
+    LOG_INFO(PLAYER, "%lu bars, %lu frames", static_cast<unsigned long>(song_index_bars(songIndex)),
+             static_cast<unsigned long>(midiData.frames.size()));
+    //the song will play: start on the next one, it downloads on the other
+    //core meanwhile. Not before, or a song turned away would leave a fetch
+    //running into the next loop()
+    playlist_init(playlist, session);
+    playlist_prefetch(playlist, 0);
+    //keep it for the next boot; core 0 writes it out while it plays
+    song_snapshot_save(midiData.frames.data(), songIndex, midiData.usPerQuarter, song_snapshot_source(midi), title);
     
-    for (int index = 0; index < midiData.bitmap.size()+3; index++)
+    //every frame is one grid step of song time, rests included; a jump or
+    //loop only changes which frame goes up next, the clock carries on
+    startSongClock(midiData.usPerQuarter, midiData.division, midiData.step, midiData.frames.size());
+    PracticeMove loop;
+    for (uint32_t index = 0; index < midiData.frames.size(); )
     {
-      std::bitset<88> bitVector;
-      if(index < midiData.bitmap.size())
-      {
-         bitVector = midiData.bitmap[index * counter];
-      }
-      else
-      {
-        bitVector.reset();
-      }
-        bool fl = false;
-        for (int count = 0; count < 88; count++)
-        {
-            if (bitVector[count] == true) 
-            {
-                      fl = true;
-            }
-        }
-        if ((fl == false) && !(midiData.bitmap.size() <= index))
-        {
-            continue;
-        }
-
-        
+      LedFrame bitVector = midiData.frames[index];
 
         //waterfall_display(bitVector);
-        for (int count = 0; count < 88; count++)
-        {
-              int byteIndex = count / 8; // Calculate the index of the byte in thenote_bytes array
-              int bitIndex = count % 8;  // Calculate the index of the bit within the byte
-
-              // Set the bit in the byte
-              if (bitVector[count]) 
-              {
-                 note_bytes[byteIndex] |= (1 << bitIndex); // Set the bit to 1
-                  Serial.print("X");
-              } 
-              else 
-              {
-                 note_bytes[byteIndex] &= ~(1 << bitIndex); // Set the bit to 0 (optional, already initialized to 0)
-                  Serial.print(".");
-              }
-          }
-
-          // Output the 11 8-bit array elements
-  for (int i = 0; i < 11; i++) {
-      Serial.print(note_bytes[i], BIN); // Output in binary format
-      Serial.print(" "); // Separate bytes with a space
-  }
-
-          bool flag = 1;
-          while(flag == 1)
-          {
-            waterfall_display();
-
-
-            unsigned long current_time = millis();
-
-            if (current_time - previous_time >= 1000)
-              {
-              digitalWrite(4, HIGH); //reset pin of decade counter high to reset the counter to remove the delay
-              cycle(); //cycles through notes
-              //delay(200); //eventually remove just a debounce for proof of concept
-              flag = 0;
-              previous_time = current_time;
-            }
-            else
-            {
-              digitalWrite(4, HIGH); //reset pin of decade counter high to reset the counter to remove the delay
-            //delay(10);
-            }
-/*
-            if(digitalRead(0) == 0) //if 'correct' buttons are pressed example
-            {
-              digitalWrite(4, HIGH); //reset pin of decade counter high to reset the counter to remove the delay
-              cycle(); //cycles through notes
-              delay(200); //eventually remove just a debounce for proof of concept
-              flag = 0;
-            }
-            else
-            {
-              digitalWrite(4, HIGH); //reset pin of decade counter high to reset the counter to remove the delay
-            //delay(10);
-            }
-          }
-*/          
-          }
-        Serial.println("line end");
+        gradeFrame(bitVector, index);
+        playFrame(bitVector);
         //std::cin.ignore(); // Ignore any previous input
         //std::cin.get(); // Wait for a key press
+        index++;
+        if (practice_take(practice, songIndex, loop) && loop.seekFrame >= 0)
+        {
+            index = loop.seekFrame;
+        }
+        else if (loop.loopEnd > 0 && index >= loop.loopEnd)
+        {
+            index = loop.loopStart;
+        }
     }
+    reportSongClock();
 }
     /*
     Store in the cache
     */
 END:
-    while(true){}
+    playPlaylist();
+    //done: send what was played, then wait; delay() lets the host build's clock run out
+    while(true)
+    {
+        log_poll(Serial);
+        practice_log_poll(practiceLog);
+        practice_log_upload(practiceLog, session);
+        delay(10);
+    }
   }
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+// How a new picture reaches the LED rows without tearing.
+//
+// The player composes: cycle() pushes its rows down, and the whole picture,
+// every row in every bit plane, is then copied into a back image and
+// published with one atomic exchange. The display scans: at the start of
+// each refresh pass it takes the newest published image and sends that
+// one for the whole pass. A pass never mixes two pictures, and neither
+// side takes a lock or waits for the other.
+//
+// There are three images: the scanner's, the composer's, and the one
+// handed between them. Publishing swaps the composer's image with the
+// handed-over one, marked fresh; taking swaps the scanner's image with it
+// when it is fresh. Each side only ever writes or reads its own image, so
+// the scan could move to a timer or another task without touching the
+// composer. Overlays composed on top of the rows would go in between the
+// copy and the publish.
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include "keyboard_geometry.h"
+
+#define DISPLAY_FRESH 0x4 // set in DisplayBuffers::handoff when its image hasn't been scanned
+
+// One picture: each row as the bursts of its bit planes, row 0 on top
+struct DisplayImage {
+    uint8_t rows[ActiveKeyboard::rows][LED_LEVEL_BITS][ActiveKeyboard::registers];
+};
+
+struct DisplayBuffers {
+    DisplayImage images[3];
+    uint8_t back = 0;                 // being composed, only the composer touches it
+    uint8_t front = 1;                // being scanned, only the scanner touches it
+    std::atomic<uint8_t> handoff{2};  // the image between them, | DISPLAY_FRESH once published
+};
+
+// Copy a whole picture into the back image and publish it
+inline void display_publish(DisplayBuffers& d, const uint8_t (&rows)[ActiveKeyboard::rows][LED_LEVEL_BITS][ActiveKeyboard::registers])
+{
+    memcpy(d.images[d.back].rows, rows, sizeof(rows));
+    d.back = d.handoff.exchange(d.back | DISPLAY_FRESH, std::memory_order_acq_rel) & ~DISPLAY_FRESH;
+}
+
+// The newest published picture, held until the next call
+inline const DisplayImage& display_take(DisplayBuffers& d)
+{
+    if (d.handoff.load(std::memory_order_relaxed) & DISPLAY_FRESH)
+    {
+        d.front = d.handoff.exchange(d.front, std::memory_order_acq_rel) & ~DISPLAY_FRESH;
+    }
+    return d.images[d.front];
+}
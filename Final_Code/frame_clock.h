@@ -0,0 +1,177 @@
+#pragma once
+
+// Decides when the next frame goes up, in song time.
+//
+// Each frame is ticksPerFrame MIDI ticks long. Deadlines are always worked
+// out from an anchor (a tick and the microsecond it was due), never by
+// adding a period to the last deadline, so a late refresh makes one frame
+// late instead of shifting the rest of the song. The tick -> microsecond
+// rate is kept in 16.16 fixed point so the ESP32 never needs doubles; the
+// rounding adds well under 1 us per thousand frames.
+//
+// Practice speed (50-150%) scales that rate. Changing it re-anchors at the
+// frame on screen, so the song slows down or speeds up from there without
+// jumping.
+//
+// On the ESP32 an esp_timer one-shot marks each deadline. The host build
+// (host/) reads its simulated hardware clock; other host builds use a clock
+// that moves forward every time the player polls it.
+
+#include <stdint.h>
+#include <atomic>
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <esp_timer.h>
+#endif
+
+#define FRAME_CLOCK_MIN_SPEED 50
+#define FRAME_CLOCK_MAX_SPEED 150
+#define FRAME_CLOCK_DEFAULT_TEMPO 500000 // us per quarter note when a song doesn't say (120 bpm)
+
+#if !defined(ARDUINO_ARCH_ESP32) && !defined(PIANO_HOST)
+// Host builds: how far the simulated clock moves on each poll, roughly what
+// one waterfall_display() refresh costs on the board
+#ifndef FRAME_CLOCK_SIM_POLL_US
+#define FRAME_CLOCK_SIM_POLL_US 250
+#endif
+static uint64_t frameClockSimUs = 0;
+#endif
+
+struct FrameClock {
+    uint32_t usPerQuarter = FRAME_CLOCK_DEFAULT_TEMPO;
+    uint32_t division = 480;       // ticks per quarter note
+    uint32_t ticksPerFrame = 60;
+    int speedPercent = 100;
+    uint64_t usPerTickQ16 = 0;     // 16.16 fixed point, at the current speed
+    uint64_t anchorTick = 0;
+    uint64_t anchorUs = 0;         // when anchorTick was due
+    uint64_t frameTick = 0;        // tick of the frame on screen
+    uint64_t frameUs = 0;          // when it was due
+    uint64_t deadlineUs = 0;       // when the next frame is due
+    bool running = false;
+    std::atomic<bool> due{false};  // set by the timer at deadlineUs
+#if defined(ARDUINO_ARCH_ESP32)
+    esp_timer_handle_t timer = nullptr;
+#endif
+};
+
+static inline uint64_t frame_clock_now_us()
+{
+#if defined(ARDUINO_ARCH_ESP32)
+    return static_cast<uint64_t>(esp_timer_get_time());
+#elif defined(PIANO_HOST)
+    return hal_now_ns() / 1000;
+#else
+    return frameClockSimUs;
+#endif
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+static void frame_clock_fire(void* arg)
+{
+    static_cast<FrameClock*>(arg)->due.store(true);
+}
+#endif
+
+// 16.16 microseconds per tick for the song's tempo at the given speed. A
+// slow song on a coarse division at half speed needs more than 32 bits
+// (1 s a quarter over 24 ticks at 50% is 2^32.3).
+static inline uint64_t frame_clock_rate(uint32_t usPerQuarter, uint32_t division, int speedPercent)
+{
+    uint64_t scaled = (static_cast<uint64_t>(usPerQuarter) << 16) * 100;
+    uint64_t per = static_cast<uint64_t>(division) * speedPercent;
+    return (scaled + per / 2) / per;
+}
+
+static inline uint64_t frame_clock_time_of(const FrameClock& c, uint64_t tick)
+{
+    return c.anchorUs + (((tick - c.anchorTick) * c.usPerTickQ16 + 0x8000) >> 16);
+}
+
+// Point the timer at the next frame's deadline
+static inline void frame_clock_arm(FrameClock& c)
+{
+    c.deadlineUs = frame_clock_time_of(c, c.frameTick + c.ticksPerFrame);
+    c.due.store(false);
+#if defined(ARDUINO_ARCH_ESP32)
+    if (c.timer != nullptr)
+    {
+        uint64_t now = frame_clock_now_us();
+        esp_timer_stop(c.timer); // fails harmlessly if it isn't running
+        esp_timer_start_once(c.timer, c.deadlineUs > now ? c.deadlineUs - now : 1);
+    }
+#endif
+}
+
+// Start a song: the frame on screen now is tick 0
+void frame_clock_start(FrameClock& c, uint32_t usPerQuarter, uint32_t division, uint32_t ticksPerFrame)
+{
+#if defined(ARDUINO_ARCH_ESP32)
+    if (c.timer == nullptr)
+    {
+        esp_timer_create_args_t args = {};
+        args.callback = frame_clock_fire;
+        args.arg = &c;
+        args.name = "frame";
+        if (esp_timer_create(&args, &c.timer) != ESP_OK)
+        {
+            c.timer = nullptr; // frame_clock_due() still compares against the clock
+        }
+    }
+#endif
+    c.usPerQuarter = usPerQuarter > 0 ? usPerQuarter : FRAME_CLOCK_DEFAULT_TEMPO;
+    c.division = division > 0 ? division : 480;
+    c.ticksPerFrame = ticksPerFrame > 0 ? ticksPerFrame : 1;
+    c.usPerTickQ16 = frame_clock_rate(c.usPerQuarter, c.division, c.speedPercent);
+    c.anchorTick = c.frameTick = 0;
+    c.anchorUs = c.frameUs = frame_clock_now_us();
+    c.running = true;
+    frame_clock_arm(c);
+}
+
+// Change the practice speed; the song carries on from the frame on screen
+void frame_clock_set_speed(FrameClock& c, int percent)
+{
+    if (percent < FRAME_CLOCK_MIN_SPEED) percent = FRAME_CLOCK_MIN_SPEED;
+    if (percent > FRAME_CLOCK_MAX_SPEED) percent = FRAME_CLOCK_MAX_SPEED;
+    c.speedPercent = percent;
+    c.usPerTickQ16 = frame_clock_rate(c.usPerQuarter, c.division, percent);
+    if (c.running)
+    {
+        c.anchorTick = c.frameTick;
+        c.anchorUs = c.frameUs;
+        frame_clock_arm(c);
+    }
+}
+
+// True once the next frame's deadline has passed
+static inline bool frame_clock_due(FrameClock& c)
+{
+#if defined(ARDUINO_ARCH_ESP32)
+    return c.due.load() || frame_clock_now_us() >= c.deadlineUs;
+#elif defined(PIANO_HOST)
+    return frame_clock_now_us() >= c.deadlineUs; // the simulated hardware moves the clock
+#else
+    frameClockSimUs += FRAME_CLOCK_SIM_POLL_US;
+    return frameClockSimUs >= c.deadlineUs;
+#endif
+}
+
+// Move on to the next frame. Returns how late it went up, in microseconds.
+uint32_t frame_clock_advance(FrameClock& c)
+{
+    uint64_t now = frame_clock_now_us();
+    uint32_t late = now > c.deadlineUs ? static_cast<uint32_t>(now - c.deadlineUs) : 0;
+    c.frameTick += c.ticksPerFrame;
+    c.frameUs = c.deadlineUs;
+    frame_clock_arm(c);
+    return late;
+}
+
+// How far the fixed point schedule has wandered from exact integer math for
+// the frame on screen (only meaningful while the speed hasn't changed)
+static inline int32_t frame_clock_drift_us(const FrameClock& c)
+{
+    uint64_t exact = c.anchorUs + ((c.frameTick - c.anchorTick) * c.usPerQuarter * 100) / (static_cast<uint64_t>(c.division) * c.speedPercent);
+    return static_cast<int32_t>(c.frameUs - exact);
+}
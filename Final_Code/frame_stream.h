@@ -0,0 +1,735 @@
+#pragma once
+
+// Out-of-core playback: the song stays in a SPIFFS file and only a small
+// ring of upcoming frames is ever decoded into RAM.
+//
+// Every track chunk gets a cursor with a little read buffer. The decoder
+// always advances whichever track has the earliest pending event, so events
+// come out in song order without loading any track. That makes it the same
+// sweep buildFrames() does in RAM: events snap to the nearest grid step
+// (one notated 32nd note, by the rule in SongGrid) and each step's frame
+// shows every key held, sustained by the pedal, or struck during it, at the
+// level its latest strike's velocity set. Empty steps are kept,
+// as in the RAM path, because every step is a fixed slice of song time.
+//
+// Opening a stream decodes the whole song once without showing it, to
+// index its bars (song_index.h), count its frames and keep checkpoints:
+// snapshots of every track cursor and of the held and sustained keys at
+// evenly spaced frames. The table has a fixed size; when it fills, every
+// other checkpoint is dropped and the spacing doubles. A seek restores the
+// last checkpoint at or before the frame and decodes forward from there. A
+// loop keeps one more checkpoint at its first frame, and the decoder jumps
+// back to it as it passes the end of the loop, so the ring already holds
+// the start of the next pass and the loop plays without a gap.
+//
+// On the ESP32 a prefetch task on core 0 keeps the ring topped up while the
+// display runs on core 1. Memory use is fixed by the constants below,
+// whatever the length of the song.
+
+#include <stdint.h>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+#include <SPIFFS.h>
+#include "keyboard_geometry.h"
+#include "logger.h"
+#include "song_index.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+#define STREAM_MAX_TRACKS 16
+#define STREAM_TRACK_BUFFER 64 // bytes cached per track cursor
+#define STREAM_RING_FRAMES 32  // decoded frames kept ahead of the playhead, power of two
+#define STREAM_CHECKPOINTS 8   // decoder snapshots kept for seeking, even
+
+struct StreamTrack {
+    uint32_t filePos;    // file offset of the next byte not yet in buffer
+    uint32_t end;        // file offset where this track chunk ends
+    uint8_t buffer[STREAM_TRACK_BUFFER];
+    uint8_t bufferPos;
+    uint8_t bufferLen;
+    uint8_t runningStatus;
+    bool done;
+    uint32_t nextTick;   // absolute tick of the event the cursor is sitting on
+};
+
+// Where a track cursor was, without its buffer
+struct StreamCursor {
+    uint32_t offset;     // file offset of its next byte
+    uint32_t nextTick;
+    uint8_t runningStatus;
+    bool done;
+};
+
+// Everything the decoder needs to carry on from the start of a frame
+struct StreamCheckpoint {
+    uint32_t step;
+    StreamCursor tracks[STREAM_MAX_TRACKS];
+    uint8_t heldCount[88];
+    KeyFrame sustained[16];
+    uint16_t pedalDown;
+    LedFrame levels;
+};
+
+struct FrameStream {
+    File file;
+    StreamTrack tracks[STREAM_MAX_TRACKS];
+    int numTracks = 0;
+    int division = 0;
+    int step = 0;                  // ticks per frame
+    SongGrid grid;                 // what the pass at open found for step
+    uint32_t usPerQuarter = 500000; // first Set Tempo in the song
+    uint32_t currentStep = 0;      // grid step being swept; earlier ones are in the ring
+    uint8_t heldCount[88];         // notes holding each key down
+    KeyFrame held;
+    KeyFrame struck;               // keys whose note started this step
+    KeyFrame sustained[16];        // keys released under each channel's pedal
+    KeyFrame allSustained;
+    uint16_t pedalDown = 0;        // one bit per channel
+    LedFrame levels;               // level of each key's latest strike
+
+    LedFrame ring[STREAM_RING_FRAMES];
+    std::atomic<uint32_t> head{0}; // frames written, only the prefetcher moves it
+    std::atomic<uint32_t> tail{0}; // frames read, only the player moves it
+    std::atomic<bool> finished{false};
+    std::atomic<bool> stop{false};
+    std::atomic<bool> taskRunning{false};
+    uint32_t underruns = 0;        // times the player found the ring empty
+
+    SongIndex index;               // bars and frames, from the pass at open
+    StreamCheckpoint checkpoints[STREAM_CHECKPOINTS];
+    int checkpointCount = 0;
+    uint32_t checkpointSpacing = 1; // frames between checkpoints
+    bool indexing = false;         // in the pass at open
+    StreamCheckpoint loopStart;    // decoder at the loop's first frame
+    uint32_t loopEnd = 0;          // frame after the loop's last, 0 for no loop
+};
+
+static inline uint32_t stream_offset(const StreamTrack& track)
+{
+    return track.filePos - track.bufferLen + track.bufferPos;
+}
+
+// Next byte of a track, refilling its buffer from the file when it runs dry
+static inline int stream_byte(FrameStream& s, StreamTrack& track)
+{
+    if (track.bufferPos == track.bufferLen)
+    {
+        if (track.filePos >= track.end)
+        {
+            return -1;
+        }
+        uint32_t want = track.end - track.filePos;
+        if (want > STREAM_TRACK_BUFFER) want = STREAM_TRACK_BUFFER;
+        s.file.seek(track.filePos);
+        size_t got = s.file.read(track.buffer, want);
+        if (got == 0)
+        {
+            return -1;
+        }
+        track.filePos += got;
+        track.bufferLen = got;
+        track.bufferPos = 0;
+    }
+    return track.buffer[track.bufferPos++];
+}
+
+static inline void stream_skip(StreamTrack& track, uint32_t count)
+{
+    uint32_t buffered = track.bufferLen - track.bufferPos;
+    if (count <= buffered)
+    {
+        track.bufferPos += count;
+        return;
+    }
+    track.filePos += count - buffered;
+    track.bufferPos = track.bufferLen = 0;
+}
+
+static inline uint32_t stream_variable_length(FrameStream& s, StreamTrack& track)
+{
+    uint32_t value = 0;
+    int byte;
+    do {
+        byte = stream_byte(s, track);
+        if (byte < 0)
+        {
+            return value;
+        }
+        value = (value << 7) | (byte & 0x7F);
+    } while (byte & 0x80);
+    return value;
+}
+
+// Read the delta time in front of the track's next event
+static inline void stream_advance(FrameStream& s, StreamTrack& track)
+{
+    if (stream_offset(track) >= track.end)
+    {
+        track.done = true;
+        return;
+    }
+    track.nextTick += stream_variable_length(s, track);
+}
+
+// Hand a finished frame to the ring
+static inline void stream_emit(FrameStream& s, const LedFrame& frame)
+{
+    uint32_t head = s.head.load(std::memory_order_relaxed);
+    s.ring[head & (STREAM_RING_FRAMES - 1)] = frame;
+    s.head.store(head + 1, std::memory_order_release);
+}
+
+static inline LedFrame stream_current_frame(const FrameStream& s)
+{
+    return s.levels.masked(s.held | s.allSustained | s.struck);
+}
+
+static void stream_save(const FrameStream& s, StreamCheckpoint& checkpoint)
+{
+    checkpoint.step = s.currentStep;
+    for (int t = 0; t < s.numTracks; t++)
+    {
+        const StreamTrack& track = s.tracks[t];
+        checkpoint.tracks[t].offset = stream_offset(track);
+        checkpoint.tracks[t].nextTick = track.nextTick;
+        checkpoint.tracks[t].runningStatus = track.runningStatus;
+        checkpoint.tracks[t].done = track.done;
+    }
+    memcpy(checkpoint.heldCount, s.heldCount, sizeof(checkpoint.heldCount));
+    for (int c = 0; c < 16; c++)
+    {
+        checkpoint.sustained[c] = s.sustained[c];
+    }
+    checkpoint.pedalDown = s.pedalDown;
+    checkpoint.levels = s.levels;
+}
+
+static void stream_restore(FrameStream& s, const StreamCheckpoint& checkpoint)
+{
+    s.currentStep = checkpoint.step;
+    for (int t = 0; t < s.numTracks; t++)
+    {
+        StreamTrack& track = s.tracks[t];
+        track.filePos = checkpoint.tracks[t].offset;
+        track.bufferPos = track.bufferLen = 0;
+        track.nextTick = checkpoint.tracks[t].nextTick;
+        track.runningStatus = checkpoint.tracks[t].runningStatus;
+        track.done = checkpoint.tracks[t].done;
+    }
+    memcpy(s.heldCount, checkpoint.heldCount, sizeof(s.heldCount));
+    s.held.reset();
+    for (int key = 0; key < 88; key++)
+    {
+        if (s.heldCount[key] > 0)
+        {
+            s.held.set(key);
+        }
+    }
+    s.allSustained.reset();
+    for (int c = 0; c < 16; c++)
+    {
+        s.sustained[c] = checkpoint.sustained[c];
+        s.allSustained |= s.sustained[c];
+    }
+    s.pedalDown = checkpoint.pedalDown;
+    s.levels = checkpoint.levels;
+    s.struck.reset();
+}
+
+// Keep a checkpoint every checkpointSpacing frames while indexing; a full
+// table keeps every other one and spaces them twice as far apart
+static void stream_checkpoint(FrameStream& s)
+{
+    if (s.currentStep % s.checkpointSpacing != 0)
+    {
+        return;
+    }
+    if (s.checkpointCount == STREAM_CHECKPOINTS)
+    {
+        for (int c = 1; c < STREAM_CHECKPOINTS / 2; c++)
+        {
+            s.checkpoints[c] = s.checkpoints[2 * c];
+        }
+        s.checkpointCount = STREAM_CHECKPOINTS / 2;
+        s.checkpointSpacing *= 2;
+        if (s.currentStep % s.checkpointSpacing != 0)
+        {
+            return;
+        }
+    }
+    stream_save(s, s.checkpoints[s.checkpointCount++]);
+}
+
+// The current step is complete: hand its frame over and start the next,
+// which may be the start of the loop again
+static void stream_next_step(FrameStream& s)
+{
+    stream_emit(s, stream_current_frame(s));
+    s.struck.reset();
+    s.currentStep++;
+    if (s.indexing)
+    {
+        stream_checkpoint(s);
+    }
+    else if (s.loopEnd > 0 && s.currentStep == s.loopEnd)
+    {
+        stream_restore(s, s.loopStart);
+    }
+}
+
+static inline void stream_note_off(FrameStream& s, int key, int channel)
+{
+    if (s.heldCount[key] > 0 && --s.heldCount[key] == 0)
+    {
+        s.held.reset(key);
+        if (s.pedalDown & (1 << channel))
+        {
+            s.sustained[channel].set(key);
+            s.allSustained.set(key);
+        }
+    }
+}
+
+// Consume one event from the track with the earliest pending tick. Returns
+// false once every track is finished.
+static bool stream_decode_event(FrameStream& s)
+{
+    StreamTrack* track = nullptr;
+    for (int t = 0; t < s.numTracks; t++)
+    {
+        if (!s.tracks[t].done && (track == nullptr || s.tracks[t].nextTick < track->nextTick))
+        {
+            track = &s.tracks[t];
+        }
+    }
+    if (track == nullptr)
+    {
+        return false;
+    }
+
+    // Everything on the current step is in: close its frame before moving on.
+    // At most one frame goes out per call so the ring can't overflow.
+    uint32_t eventStep = (track->nextTick + s.step / 2) / s.step;
+    if (eventStep > s.currentStep)
+    {
+        stream_next_step(s);
+        return true;
+    }
+
+    int status = stream_byte(s, *track);
+    if (status < 0)
+    {
+        track->done = true;
+        return true;
+    }
+    int dataByte1 = -1;
+    if (status < 0x80)
+    {
+        // Running status: this byte is already the first data byte
+        dataByte1 = status;
+        status = track->runningStatus;
+    }
+
+    if (status == 0xFF)
+    {
+        int metaType = stream_byte(s, *track);
+        uint32_t metaLength = stream_variable_length(s, *track);
+        if (metaType == 0x2F)
+        {
+            track->done = true;
+            return true;
+        }
+        if (metaType == 0x58 && metaLength == 4)
+        {
+            int numerator = stream_byte(s, *track);
+            int denominator = 1 << (stream_byte(s, *track) & 0x07);
+            stream_skip(*track, 1);
+            int bb = stream_byte(s, *track); // notated 32nd notes per quarter
+            if (s.indexing)
+            {
+                song_index_signature(s.index, track->nextTick, numerator, denominator);
+            }
+            if (s.indexing)
+            {
+                song_grid_offer(s.grid, track->nextTick, bb);
+            }
+        }
+        else if (metaType == 0x51 && metaLength == 3)
+        {
+            uint32_t tempo = stream_byte(s, *track) << 16;
+            tempo |= stream_byte(s, *track) << 8;
+            tempo |= stream_byte(s, *track);
+            // the pass at open takes the first one; tempo changes later
+            // in the song aren't followed yet
+            if (tempo > 0 && s.indexing && s.usPerQuarter == 0)
+            {
+                s.usPerQuarter = tempo;
+            }
+        }
+        else
+        {
+            stream_skip(*track, metaLength);
+        }
+    }
+    else if (status == 0xF0 || status == 0xF7)
+    {
+        // SysEx: length-prefixed, nothing for us in it
+        stream_skip(*track, stream_variable_length(s, *track));
+    }
+    else if (status >= 0x80)
+    {
+        track->runningStatus = status;
+        if (dataByte1 < 0)
+        {
+            dataByte1 = stream_byte(s, *track);
+        }
+        int channel = status & 0x0F;
+        switch (status & 0xF0)
+        {
+        case 0x90: {
+            int velocity = stream_byte(s, *track);
+            if (ActiveKeyboard::hasNote(dataByte1))
+            {
+                int key = ActiveKeyboard::keyIndex(dataByte1);
+                if (velocity == 0)
+                {
+                    stream_note_off(s, key, channel);
+                }
+                else
+                {
+                    if (s.heldCount[key]++ == 0)
+                    {
+                        s.held.set(key);
+                    }
+                    s.struck.set(key);
+                    s.levels.set(key, velocity_level(velocity));
+                }
+            }
+            break;
+        }
+        case 0x80:
+            stream_byte(s, *track); // release velocity
+            if (ActiveKeyboard::hasNote(dataByte1))
+            {
+                stream_note_off(s, ActiveKeyboard::keyIndex(dataByte1), channel);
+            }
+            break;
+        case 0xB0: {
+            int value = stream_byte(s, *track);
+            if (dataByte1 == 64) // sustain pedal
+            {
+                if (value >= 64)
+                {
+                    s.pedalDown |= 1 << channel;
+                }
+                else
+                {
+                    s.pedalDown &= ~(1 << channel);
+                    s.sustained[channel].reset();
+                    s.allSustained.reset();
+                    for (int c = 0; c < 16; c++)
+                    {
+                        s.allSustained |= s.sustained[c];
+                    }
+                }
+            }
+            break;
+        }
+        case 0xA0:
+        case 0xE0:
+            stream_skip(*track, 1);
+            break;
+        default: // 0xC0 and 0xD0 have a single data byte
+            break;
+        }
+    }
+
+    stream_advance(s, *track);
+    return true;
+}
+
+// Decode until the ring is full or the song is over
+static void frame_stream_fill(FrameStream& s)
+{
+    while (!s.finished.load(std::memory_order_relaxed) && !s.stop.load(std::memory_order_relaxed))
+    {
+        uint32_t queued = s.head.load(std::memory_order_relaxed) - s.tail.load(std::memory_order_acquire);
+        if (queued >= STREAM_RING_FRAMES)
+        {
+            return;
+        }
+        // Decode until a frame is produced (head moves) or the tracks run out
+        uint32_t before = s.head.load(std::memory_order_relaxed);
+        while (s.head.load(std::memory_order_relaxed) == before)
+        {
+            if (!stream_decode_event(s))
+            {
+                LedFrame frame = stream_current_frame(s);
+                if (frame.lit().any())
+                {
+                    stream_emit(s, frame);
+                }
+                if (s.loopEnd > 0)
+                {
+                    // the loop runs to the end of the song: round again
+                    stream_restore(s, s.loopStart);
+                    continue;
+                }
+                s.finished.store(true, std::memory_order_release);
+                break;
+            }
+        }
+    }
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+static void frame_stream_task(void* arg)
+{
+    FrameStream* s = static_cast<FrameStream*>(arg);
+    while (!s->stop.load() && !s->finished.load())
+    {
+        frame_stream_fill(*s);
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+    s->taskRunning.store(false);
+    vTaskDelete(NULL);
+}
+#endif
+
+// Refill the ring from wherever the decoder is, then keep it topped up
+static void stream_start(FrameStream& s)
+{
+    frame_stream_fill(s); // have the first window ready before playback starts
+#if defined(ARDUINO_ARCH_ESP32)
+    s.taskRunning.store(true);
+    if (xTaskCreatePinnedToCore(frame_stream_task, "prefetch", 4096, &s, 1, NULL, 0) != pdPASS)
+    {
+        s.taskRunning.store(false);
+    }
+#endif
+}
+
+// Stop prefetching so the player can move the decoder
+static void stream_pause(FrameStream& s)
+{
+    s.stop.store(true);
+    while (s.taskRunning.load())
+    {
+        delay(1);
+    }
+    s.stop.store(false);
+}
+
+// Put the decoder at the start of a frame, with the ring empty: back to the
+// last checkpoint at or before it, then decode forward the rest of the way
+static void stream_position(FrameStream& s, uint32_t frame)
+{
+    const StreamCheckpoint* checkpoint = std::upper_bound(s.checkpoints, s.checkpoints + s.checkpointCount, frame,
+                                                          [](uint32_t f, const StreamCheckpoint& c) { return f < c.step; }) - 1;
+    stream_restore(s, *checkpoint);
+    uint32_t loopEnd = s.loopEnd;
+    s.loopEnd = 0; // no jumping back on the way
+    while (s.currentStep < frame && stream_decode_event(s))
+    {
+    }
+    s.loopEnd = loopEnd;
+    s.head.store(0);
+    s.tail.store(0);
+    s.finished.store(false);
+}
+
+// One decode of the whole song from its start, the first checkpoint
+static void stream_index_pass(FrameStream& s)
+{
+    stream_restore(s, s.checkpoints[0]);
+    song_index_begin(s.index, s.division, s.step);
+    s.checkpointCount = 1;
+    s.checkpointSpacing = 1;
+    while (stream_decode_event(s))
+    {
+    }
+}
+
+// The pass at open: decode the whole song once, for its bar index, frame
+// count and checkpoints, then go back to the start. The grid's time
+// signature can be anywhere in the song, so one that moves the grid off
+// the default means decoding it again on the right one.
+static void stream_build_index(FrameStream& s)
+{
+    s.indexing = true;
+    s.grid = SongGrid();
+    s.step = song_grid_step(s.grid, s.division);
+    stream_save(s, s.checkpoints[0]);
+    stream_index_pass(s);
+    if (song_grid_step(s.grid, s.division) != s.step)
+    {
+        s.step = song_grid_step(s.grid, s.division);
+        stream_index_pass(s);
+    }
+    s.index.frames = s.currentStep + (stream_current_frame(s).lit().any() ? 1 : 0);
+    s.indexing = false;
+    stream_position(s, 0);
+}
+
+static inline uint32_t stream_read_be(File& file, int size)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < size; i++)
+    {
+        value = (value << 8) | (file.read() & 0xFF);
+    }
+    return value;
+}
+
+// Open a song on SPIFFS, find its track chunks and start prefetching
+bool frame_stream_open(FrameStream& s, const char* path)
+{
+    s.file = SPIFFS.open(path, "r");
+    if (!s.file)
+    {
+        LOG_ERROR(STREAM, "Could not open the streamed song");
+        return false;
+    }
+    char id[4];
+    if (s.file.readBytes(id, 4) != 4 || memcmp(id, "MThd", 4) != 0)
+    {
+        LOG_ERROR(STREAM, "Streamed song is not a MIDI file");
+        s.file.close();
+        return false;
+    }
+    uint32_t headerChunkSize = stream_read_be(s.file, 4);
+    stream_read_be(s.file, 2); // format
+    int numTracks = stream_read_be(s.file, 2);
+    s.division = stream_read_be(s.file, 2);
+
+    if (numTracks > STREAM_MAX_TRACKS)
+    {
+        LOG_WARN(STREAM, "Only streaming the first %d tracks", STREAM_MAX_TRACKS);
+        numTracks = STREAM_MAX_TRACKS;
+    }
+
+    // Walk the chunk table once to find where each track starts and ends
+    uint32_t pos = 8 + headerChunkSize;
+    s.numTracks = 0;
+    for (int t = 0; t < numTracks; t++)
+    {
+        s.file.seek(pos);
+        if (s.file.readBytes(id, 4) != 4 || memcmp(id, "MTrk", 4) != 0)
+        {
+            break;
+        }
+        uint32_t chunkSize = stream_read_be(s.file, 4);
+        StreamTrack& track = s.tracks[s.numTracks++];
+        track.filePos = pos + 8;
+        track.end = pos + 8 + chunkSize;
+        track.bufferPos = track.bufferLen = 0;
+        track.runningStatus = 0;
+        track.done = false;
+        track.nextTick = 0;
+        stream_advance(s, track);
+        pos = track.end;
+    }
+
+    s.usPerQuarter = 0; // until the pass at open finds a Set Tempo
+    s.currentStep = 0;
+    memset(s.heldCount, 0, sizeof(s.heldCount));
+    s.held.reset();
+    s.struck.reset();
+    for (int c = 0; c < 16; c++)
+    {
+        s.sustained[c].reset();
+    }
+    s.allSustained.reset();
+    s.pedalDown = 0;
+    s.levels = LedFrame();
+    s.head.store(0);
+    s.tail.store(0);
+    s.finished.store(false);
+    s.stop.store(false);
+    s.underruns = 0;
+    s.loopEnd = 0;
+
+    stream_build_index(s);
+    if (s.usPerQuarter == 0)
+    {
+        s.usPerQuarter = 500000;
+    }
+    LOG_INFO(STREAM, "Streaming %lu bars, %lu frames", static_cast<unsigned long>(song_index_bars(s.index)),
+             static_cast<unsigned long>(s.index.frames));
+    stream_start(s);
+    return true;
+}
+
+// Next frame for the display. Returns false once the song has run out.
+bool frame_stream_next(FrameStream& s, LedFrame& frame)
+{
+    uint32_t tail = s.tail.load(std::memory_order_relaxed);
+    if (s.head.load(std::memory_order_acquire) == tail)
+    {
+        if (s.finished.load(std::memory_order_acquire) && s.head.load(std::memory_order_acquire) == tail)
+        {
+            return false;
+        }
+        s.underruns++;
+#if defined(ARDUINO_ARCH_ESP32)
+        if (!s.taskRunning.load())
+        {
+            frame_stream_fill(s);
+        }
+        while (s.head.load(std::memory_order_acquire) == tail && !s.finished.load(std::memory_order_acquire))
+        {
+            delay(1);
+        }
+#else
+        frame_stream_fill(s);
+#endif
+        if (s.head.load(std::memory_order_acquire) == tail)
+        {
+            return false;
+        }
+    }
+    frame = s.ring[tail & (STREAM_RING_FRAMES - 1)];
+    s.tail.store(tail + 1, std::memory_order_release);
+#if !defined(ARDUINO_ARCH_ESP32)
+    frame_stream_fill(s);
+#endif
+    return true;
+}
+
+// Jump to a frame, ending any loop
+void frame_stream_seek(FrameStream& s, uint32_t frame)
+{
+    stream_pause(s);
+    s.loopEnd = 0;
+    stream_position(s, frame);
+    stream_start(s);
+}
+
+// Play frames [start, end) over and over, from start; end 0 ends the loop
+// and the song plays on from wherever the ring has got to
+void frame_stream_loop(FrameStream& s, uint32_t start, uint32_t end)
+{
+    stream_pause(s);
+    s.loopEnd = 0;
+    if (end > start && start < s.index.frames)
+    {
+        stream_position(s, start);
+        stream_save(s, s.loopStart);
+        s.loopEnd = end < s.index.frames ? end : s.index.frames;
+    }
+    stream_start(s);
+}
+
+void frame_stream_close(FrameStream& s)
+{
+    s.stop.store(true);
+    while (s.taskRunning.load())
+    {
+        delay(1);
+    }
+    s.file.close();
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+// Where every key lives on the hardware, worked out at compile time.
+//
+// A KeyboardGeometry describes one board: how many keys it has, which MIDI
+// note the lowest one plays, how many LED rows it has, the order its 74HC595
+// registers are clocked, and the order keys sit within each register. It
+// also describes the 74HC165 scan chain: how many registers to clock, how
+// many leading bits are unwired and which key the first wired bit belongs to.
+// From that the compiler works out:
+//
+//   burstByte(r) -> which byte of a row burst register r's 8 keys go in
+//   wireBits(x)  -> those 8 keys (a KeyFrame byte) in the order they're wired
+//   scan.key[b]  -> which key the b-th bit shifted out of the 165s belongs to
+//
+// so a row is rendered a register at a time (render_row), never key by key.
+//
+// Frames are indexed by key, not by MIDI note: bit k is MIDI note
+// lowestNote + k. Notes off the keyboard are never stored. A set of keys is
+// a KeyFrame; a played frame (LedFrame) also carries each key's brightness,
+// as one KeyFrame per bit plane.
+
+#include <stdint.h>
+
+// A set of keys, bit k for key k, packed into 32-bit words (the ESP32's
+// width) that whole-frame operations work on a word at a time. count() is a
+// popcount, and for (int key : frame) visits only the keys that are set,
+// lowest first, by counting trailing zeros. Byte i holds keys 8i to 8i+7,
+// key 8i in bit 0, which is one 74HC595's worth.
+struct KeyFrame {
+    static constexpr int keys = 88;
+    static constexpr int words = 3;
+    uint32_t word[words] = { 0, 0, 0 };
+
+    constexpr bool test(int key) const { return (word[key >> 5] >> (key & 31)) & 1; }
+    constexpr bool operator[](int key) const { return test(key); }
+    void set(int key) { word[key >> 5] |= 1u << (key & 31); }
+    void reset(int key) { word[key >> 5] &= ~(1u << (key & 31)); }
+    void set(int key, bool on) { on ? set(key) : reset(key); }
+    void reset() { word[0] = word[1] = word[2] = 0; }
+
+    constexpr bool any() const { return (word[0] | word[1] | word[2]) != 0; }
+    constexpr bool none() const { return !any(); }
+    constexpr int count() const { return __builtin_popcount(word[0]) + __builtin_popcount(word[1]) + __builtin_popcount(word[2]); }
+
+    // Lowest key that is set, -1 if none
+    constexpr int first() const { return first(word); }
+    static constexpr int first(const uint32_t* w)
+    {
+        return w[0] ? __builtin_ctz(w[0]) : w[1] ? 32 + __builtin_ctz(w[1]) : w[2] ? 64 + __builtin_ctz(w[2]) : -1;
+    }
+
+    constexpr uint8_t byte(int index) const { return static_cast<uint8_t>(word[index >> 2] >> ((index & 3) * 8)); }
+
+    constexpr KeyFrame operator|(const KeyFrame& o) const { return KeyFrame{ { word[0] | o.word[0], word[1] | o.word[1], word[2] | o.word[2] } }; }
+    constexpr KeyFrame operator&(const KeyFrame& o) const { return KeyFrame{ { word[0] & o.word[0], word[1] & o.word[1], word[2] & o.word[2] } }; }
+    constexpr KeyFrame operator^(const KeyFrame& o) const { return KeyFrame{ { word[0] ^ o.word[0], word[1] ^ o.word[1], word[2] ^ o.word[2] } }; }
+    // The keys here that aren't in o
+    constexpr KeyFrame without(const KeyFrame& o) const { return KeyFrame{ { word[0] & ~o.word[0], word[1] & ~o.word[1], word[2] & ~o.word[2] } }; }
+    KeyFrame& operator|=(const KeyFrame& o) { return *this = *this | o; }
+    KeyFrame& operator&=(const KeyFrame& o) { return *this = *this & o; }
+    KeyFrame& operator^=(const KeyFrame& o) { return *this = *this ^ o; }
+    constexpr bool operator==(const KeyFrame& o) const { return word[0] == o.word[0] && word[1] == o.word[1] && word[2] == o.word[2]; }
+    constexpr bool operator!=(const KeyFrame& o) const { return !(*this == o); }
+
+    // Walks the set keys, dropping each one as it is visited
+    struct Iterator {
+        uint32_t rest[words];
+        int operator*() const { return first(rest); }
+        Iterator& operator++()
+        {
+            uint32_t& w = rest[0] ? rest[0] : rest[1] ? rest[1] : rest[2];
+            w &= w - 1;
+            return *this;
+        }
+        bool operator!=(const Iterator& o) const { return rest[0] != o.rest[0] || rest[1] != o.rest[1] || rest[2] != o.rest[2]; }
+    };
+    Iterator begin() const { return Iterator{ { word[0], word[1], word[2] } }; }
+    Iterator end() const { return Iterator{ { 0, 0, 0 } }; }
+};
+
+// Order the 74HC595s are clocked within a row burst
+enum RegisterOrder {
+    LOWEST_REGISTER_FIRST,  // the register with the lowest keys is sent first
+    HIGHEST_REGISTER_FIRST  // the register with the highest keys is sent first
+};
+
+// Where the lowest of a register's 8 keys is wired
+enum BitOrder {
+    LOWEST_KEY_BIT0, // key 0 of the register is bit 0 (sent last with MSBFIRST)
+    LOWEST_KEY_BIT7  // key 0 of the register is bit 7 (sent first with MSBFIRST)
+};
+
+template <int Bits>
+struct ScanWireTable {
+    int8_t key[Bits]; // -1 where nothing is wired
+};
+
+template <int KeyCount, int LowestNote, int RowCount, RegisterOrder LedOrder, BitOrder LedBits,
+          int ScanRegisters, int ScanSkipBits, int ScanFirstKey>
+struct KeyboardGeometry {
+    static constexpr int keys = KeyCount;
+    static constexpr int lowestNote = LowestNote;
+    static constexpr int highestNote = LowestNote + KeyCount - 1;
+    static constexpr int rows = RowCount;
+    static constexpr int registers = (KeyCount + 7) / 8;   // 74HC595s per LED row
+    static constexpr int scanBits = ScanRegisters * 8;     // bits clocked out of the 74HC165s
+
+    static_assert(KeyCount > 0 && KeyCount <= 88, "frames hold at most 88 keys");
+    static_assert(LowestNote >= 0 && LowestNote + KeyCount - 1 <= 127, "keys must be MIDI notes");
+    static_assert(ScanSkipBits >= 0 && ScanSkipBits <= ScanRegisters * 8, "more skipped bits than the chain has");
+
+    static constexpr bool hasNote(int midi) { return midi >= LowestNote && midi < LowestNote + KeyCount; }
+    static constexpr int keyIndex(int midi) { return midi - LowestNote; }
+    static constexpr int noteOf(int key) { return LowestNote + key; }
+
+    // Where the register holding keys 8 * reg up goes in a row burst
+    static constexpr int burstByte(int reg) { return LedOrder == LOWEST_REGISTER_FIRST ? reg : registers - 1 - reg; }
+
+    // A register's 8 keys (lowest in bit 0, as KeyFrame::byte gives them) as wired
+    static constexpr uint8_t wireBits(uint8_t keys)
+    {
+        if (LedBits == LOWEST_KEY_BIT0)
+        {
+            return keys;
+        }
+        keys = (keys & 0xF0) >> 4 | (keys & 0x0F) << 4;
+        keys = (keys & 0xCC) >> 2 | (keys & 0x33) << 2;
+        return (keys & 0xAA) >> 1 | (keys & 0x55) << 1;
+    }
+
+    static constexpr ScanWireTable<ScanRegisters * 8> buildScanTable()
+    {
+        ScanWireTable<ScanRegisters * 8> table = {};
+        for (int b = 0; b < ScanRegisters * 8; b++)
+        {
+            int key = ScanFirstKey + b - ScanSkipBits;
+            table.key[b] = (b < ScanSkipBits || key >= KeyCount) ? -1 : key;
+        }
+        return table;
+    }
+
+    static constexpr ScanWireTable<ScanRegisters * 8> scan = buildScanTable();
+};
+
+template <int KC, int LN, int RC, RegisterOrder LO, BitOrder LB, int SR, int SS, int SF>
+constexpr ScanWireTable<SR * 8> KeyboardGeometry<KC, LN, RC, LO, LB, SR, SS, SF>::scan;
+
+// The prototype: 48 LED columns (MIDI 24-71) on six registers sent highest
+// first, 4 rows, and one 165 whose top five inputs are keys 28-32.
+typedef KeyboardGeometry<48, 24, 4, HIGHEST_REGISTER_FIRST, LOWEST_KEY_BIT0, 1, 3, 28> PrototypeBoard;
+// Full size boards: one LED column and one switch per key
+typedef KeyboardGeometry<61, 36, 4, HIGHEST_REGISTER_FIRST, LOWEST_KEY_BIT0, 8, 0, 0> Keyboard61;
+typedef KeyboardGeometry<76, 28, 4, HIGHEST_REGISTER_FIRST, LOWEST_KEY_BIT0, 10, 0, 0> Keyboard76;
+typedef KeyboardGeometry<88, 21, 4, HIGHEST_REGISTER_FIRST, LOWEST_KEY_BIT0, 11, 0, 0> Keyboard88;
+
+// Pick the board with -DKEYBOARD_KEYS=61/76/88; the prototype otherwise
+#if !defined(KEYBOARD_KEYS)
+typedef PrototypeBoard ActiveKeyboard;
+#elif KEYBOARD_KEYS == 61
+typedef Keyboard61 ActiveKeyboard;
+#elif KEYBOARD_KEYS == 76
+typedef Keyboard76 ActiveKeyboard;
+#elif KEYBOARD_KEYS == 88
+typedef Keyboard88 ActiveKeyboard;
+#else
+#error "KEYBOARD_KEYS must be 61, 76 or 88"
+#endif
+
+// Brightness: a lit key has a level from 1 to LED_LEVELS - 1, set by the
+// velocity it was struck with. -DLED_LEVEL_BITS=3 gives 8 levels.
+#ifndef LED_LEVEL_BITS
+#define LED_LEVEL_BITS 2
+#endif
+#define LED_LEVELS (1 << LED_LEVEL_BITS)
+
+static_assert(LED_LEVEL_BITS >= 1 && LED_LEVEL_BITS <= 3, "1 to 3 brightness bits");
+
+// Level for a Note On velocity (1-127); any struck key gets at least level 1
+inline int velocity_level(int velocity)
+{
+    return velocity <= 0 ? 0 : 1 + (velocity - 1) * (LED_LEVELS - 1) / 127;
+}
+
+// One frame of levels, stored the way the display scans it out: plane b
+// holds bit b of every key's level, so a key is lit when any plane has it.
+struct LedFrame {
+    KeyFrame plane[LED_LEVEL_BITS];
+
+    KeyFrame lit() const
+    {
+        KeyFrame any = plane[0];
+        for (int b = 1; b < LED_LEVEL_BITS; b++)
+        {
+            any |= plane[b];
+        }
+        return any;
+    }
+
+    int level(int key) const
+    {
+        int value = 0;
+        for (int b = 0; b < LED_LEVEL_BITS; b++)
+        {
+            value |= plane[b].test(key) << b;
+        }
+        return value;
+    }
+
+    void set(int key, int value)
+    {
+        for (int b = 0; b < LED_LEVEL_BITS; b++)
+        {
+            plane[b].set(key, (value >> b) & 1);
+        }
+    }
+
+    // Only the keys in mask, at their levels here
+    LedFrame masked(const KeyFrame& mask) const
+    {
+        LedFrame frame;
+        for (int b = 0; b < LED_LEVEL_BITS; b++)
+        {
+            frame.plane[b] = plane[b] & mask;
+        }
+        return frame;
+    }
+};
+
+// Set the key for a MIDI note in a frame, ignoring notes off the keyboard
+template <typename Geometry>
+inline void frame_set_note(KeyFrame& frame, int midi)
+{
+    if (Geometry::hasNote(midi))
+    {
+        frame.set(Geometry::keyIndex(midi));
+    }
+}
+
+// Turn a frame into the bytes of one LED row, in the order they are clocked
+// out: each register's byte comes straight out of the frame's words
+template <typename Geometry>
+inline void render_row(const KeyFrame& frame, uint8_t (&burst)[Geometry::registers])
+{
+    for (int r = 0; r < Geometry::registers; r++)
+    {
+        burst[Geometry::burstByte(r)] = Geometry::wireBits(frame.byte(r));
+    }
+}
+
+// Render every bit plane of a frame, one row burst per plane
+template <typename Geometry>
+inline void render_planes(const LedFrame& frame, uint8_t (&bursts)[LED_LEVEL_BITS][Geometry::registers])
+{
+    for (int b = 0; b < LED_LEVEL_BITS; b++)
+    {
+        render_row<Geometry>(frame.plane[b], bursts[b]);
+    }
+}
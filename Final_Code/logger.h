@@ -0,0 +1,277 @@
+#pragma once
+
+// Leveled logging that never waits on the UART.
+//
+//   LOG_ERROR(SESSION, "Song request failed");
+//   LOG_DEBUG(DISPLAY, "%s", keys);
+//
+// Each subsystem has its own compile-time level, LOG_LEVEL_<SUBSYSTEM>,
+// which defaults to LOG_LEVEL (LOG_LEVEL_INFO unless the build sets it).
+// A message above its subsystem's level is an if on a constant: it
+// compiles to nothing and its arguments are never evaluated, so debug
+// messages cost nothing until a build asks for them, e.g.
+// -DLOG_LEVEL_DISPLAY=LOG_LEVEL_DEBUG.
+//
+// An enabled message is formatted straight into a slot of a lock-free ring,
+// from any task on either core, and the caller moves on. On the ESP32 a
+// low-priority task on core 0 drains the ring to Serial; the host build
+// drains it from log_poll(), a FIFO's worth at a time. When the ring is
+// full the message is dropped and counted against its subsystem, and the
+// drain says how many went missing.
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+#define LOG_LEVEL_OFF 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#ifndef LOG_LEVEL_SESSION
+#define LOG_LEVEL_SESSION LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_PARSER
+#define LOG_LEVEL_PARSER LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_STREAM
+#define LOG_LEVEL_STREAM LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_DISPLAY
+#define LOG_LEVEL_DISPLAY LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_KEYS
+#define LOG_LEVEL_KEYS LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_PLAYER
+#define LOG_LEVEL_PLAYER LOG_LEVEL
+#endif
+
+#define LOG_SLOTS 32           // messages the ring holds, power of two
+#define LOG_LINE_BYTES 128     // longest message, longer ones are cut
+#define LOG_DRAIN_MS 10        // how often the ESP32 drain task looks at the ring
+
+enum LogSubsystem {
+    LOG_SESSION = 0, // WiFi and the server session
+    LOG_PARSER,      // MIDI parsing
+    LOG_STREAM,      // songs streamed from SPIFFS
+    LOG_DISPLAY,     // the LED waterfall
+    LOG_KEYS,        // the keyboard scan
+    LOG_PLAYER,      // song playback and the playlist
+    LOG_SUBSYSTEM_COUNT
+};
+
+// Whether a level of a subsystem is compiled in; usable in #if too
+#define LOG_ENABLED(level, SUBSYSTEM) ((LOG_LEVEL_##level) <= LOG_LEVEL_##SUBSYSTEM)
+
+#define LOG_AT(level, SUBSYSTEM, ...) \
+    do { \
+        if ((LOG_LEVEL_##level) <= LOG_LEVEL_##SUBSYSTEM) \
+        { \
+            log_message(LOG_LEVEL_##level, LOG_##SUBSYSTEM, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_ERROR(SUBSYSTEM, ...) LOG_AT(ERROR, SUBSYSTEM, __VA_ARGS__)
+#define LOG_WARN(SUBSYSTEM, ...) LOG_AT(WARN, SUBSYSTEM, __VA_ARGS__)
+#define LOG_INFO(SUBSYSTEM, ...) LOG_AT(INFO, SUBSYSTEM, __VA_ARGS__)
+#define LOG_DEBUG(SUBSYSTEM, ...) LOG_AT(DEBUG, SUBSYSTEM, __VA_ARGS__)
+
+struct LogSlot {
+    std::atomic<uint32_t> sequence; // ticket that may fill it, +1 once it is filled
+    uint8_t level;
+    uint8_t subsystem;
+    char text[LOG_LINE_BYTES];
+};
+
+static LogSlot logRing[LOG_SLOTS];
+static std::atomic<uint32_t> logHead{0};       // next ticket for a producer
+static uint32_t logTail = 0;                   // next ticket to drain, only the drain moves it
+static std::atomic<uint32_t> logDropped[LOG_SUBSYSTEM_COUNT];
+static uint32_t logDroppedReported = 0;
+static bool logStarted = false;
+static std::atomic<bool> logTaskRunning{false};
+
+// The line being written out, taken from the ring so its slot is free again
+static char logLine[LOG_LINE_BYTES + 24];
+static size_t logLineLength = 0;
+static size_t logLinePos = 0;
+
+static const char* const logSubsystemNames[LOG_SUBSYSTEM_COUNT] = {
+    "session", "parser", "stream", "display", "keys", "player"
+};
+
+static const char* const logLevelNames[] = { "", "ERROR", "WARN", "", "DEBUG" };
+
+static inline void log_message(int level, int subsystem, const char* format, ...) __attribute__((format(printf, 3, 4)));
+static inline void log_message(int level, int subsystem, const char* format, ...)
+{
+    if (!logStarted)
+    {
+        logDropped[subsystem].fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // Claim a ticket whose slot the drain has already emptied
+    uint32_t ticket = logHead.load(std::memory_order_relaxed);
+    LogSlot* slot;
+    for (;;)
+    {
+        slot = &logRing[ticket & (LOG_SLOTS - 1)];
+        int32_t lag = static_cast<int32_t>(slot->sequence.load(std::memory_order_acquire) - ticket);
+        if (lag == 0)
+        {
+            if (logHead.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (lag < 0)
+        {
+            // the slot still holds a message from the last lap: the ring is full
+            logDropped[subsystem].fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            ticket = logHead.load(std::memory_order_relaxed);
+        }
+    }
+    slot->level = level;
+    slot->subsystem = subsystem;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    slot->sequence.store(ticket + 1, std::memory_order_release);
+}
+
+static inline uint32_t log_dropped_total()
+{
+    uint32_t total = 0;
+    for (int s = 0; s < LOG_SUBSYSTEM_COUNT; s++)
+    {
+        total += logDropped[s].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+// Load the next line to write into logLine. Returns false if there is none.
+static inline bool log_take()
+{
+    uint32_t dropped = log_dropped_total();
+    if (dropped != logDroppedReported)
+    {
+        logLineLength = snprintf(logLine, sizeof(logLine), "(%lu log messages dropped)\r\n",
+                                 static_cast<unsigned long>(dropped - logDroppedReported));
+        logDroppedReported = dropped;
+        logLinePos = 0;
+        return true;
+    }
+    LogSlot& slot = logRing[logTail & (LOG_SLOTS - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != logTail + 1)
+    {
+        return false;
+    }
+    // info lines go out as they are, the others say what they are
+    if (logLevelNames[slot.level][0] != '\0')
+    {
+        logLineLength = snprintf(logLine, sizeof(logLine), "%s %s: %s\r\n", logLevelNames[slot.level],
+                                 logSubsystemNames[slot.subsystem], slot.text);
+    }
+    else
+    {
+        logLineLength = snprintf(logLine, sizeof(logLine), "%s\r\n", slot.text);
+    }
+    if (logLineLength >= sizeof(logLine))
+    {
+        // cut short, but still a line of its own
+        logLineLength = sizeof(logLine) - 1;
+        memcpy(logLine + logLineLength - 2, "\r\n", 2);
+    }
+    logLinePos = 0;
+    slot.sequence.store(logTail + LOG_SLOTS, std::memory_order_release);
+    logTail++;
+    return true;
+}
+
+// Write up to budget bytes of queued messages to out, picking up where the
+// last call stopped. Only one task may drain.
+template <typename Output>
+void log_drain(Output& out, size_t budget)
+{
+    while (budget > 0)
+    {
+        if (logLinePos == logLineLength && !log_take())
+        {
+            return;
+        }
+        size_t length = logLineLength - logLinePos;
+        if (length > budget)
+        {
+            length = budget;
+        }
+        out.write(reinterpret_cast<const uint8_t*>(logLine) + logLinePos, length);
+        logLinePos += length;
+        budget -= length;
+    }
+}
+
+// Dropped message counts, for STAT
+template <typename Output>
+void log_report(Output& out)
+{
+    out.print("log dropped:");
+    for (int s = 0; s < LOG_SUBSYSTEM_COUNT; s++)
+    {
+        out.print(" ");
+        out.print(logSubsystemNames[s]);
+        out.print(" ");
+        out.print(static_cast<unsigned long>(logDropped[s].load(std::memory_order_relaxed)));
+    }
+    out.println();
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+static void log_task(void* arg)
+{
+    for (;;)
+    {
+        log_drain(Serial, SIZE_MAX); // only this task waits on the UART
+        vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_MS));
+    }
+}
+#endif
+
+// Open the ring and, on the ESP32, start the drain task. Call after Serial.begin().
+void log_begin()
+{
+    for (uint32_t i = 0; i < LOG_SLOTS; i++)
+    {
+        logRing[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    logStarted = true;
+#if defined(ARDUINO_ARCH_ESP32)
+    logTaskRunning.store(xTaskCreatePinnedToCore(log_task, "log", 3072, NULL, tskIDLE_PRIORITY, NULL, 0) == pdPASS);
+#endif
+}
+
+// Drain what the UART can take without waiting, unless the task does it
+template <typename Output>
+void log_poll(Output& out)
+{
+    if (!logTaskRunning.load(std::memory_order_relaxed))
+    {
+        log_drain(out, out.availableForWrite());
+    }
+}
@@ -0,0 +1,306 @@
+#pragma once
+
+// Compressed song transfers. The device sets the SESSION_GET_COMPRESSED
+// option bit on a GET; a server that knows about it answers with an LZSS
+// stream, one that doesn't sends the plain file as before. The first four bytes tell them apart.
+//
+// Stream format (song_server.py writes it, and lz_compress() below for
+// what the device uploads):
+//
+//   "PHZ1", original length (4 bytes, little-endian)
+//   then groups of one flag byte and 8 items, flag bit 0 first:
+//     1: one literal byte
+//     0: a match, two bytes: b0 = distance-1 low 8 bits,
+//        b1 = distance-1 high 4 bits << 4 | (length - 3)
+//        copy length (3-18) bytes from distance (1-4096) bytes back
+//
+// The decoder keeps only the last 4 KB of output and a few bytes of state,
+// takes input in whatever pieces the network hands over, and passes output
+// on in small batches, so a song is never held compressed.
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#define LZ_MAGIC "PHZ1"
+#define LZ_HEADER_BYTES 8
+#define LZ_WINDOW_BITS 12
+#define LZ_WINDOW (1 << LZ_WINDOW_BITS) // bytes of history a match can reach back
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15)
+#define LZ_HASH_BITS 10 // lz_compress() remembers 2^10 earlier prefixes
+#define LZ_OUT_BATCH 64 // decoded bytes handed to the sink at a time
+
+struct LzStream {
+    uint8_t window[LZ_WINDOW];
+    uint32_t produced;   // bytes decoded so far
+    uint32_t expected;   // original length from the header
+    uint8_t header[LZ_HEADER_BYTES];
+    uint8_t headerLen;
+    uint8_t flags;       // current flag byte, shifted as items are used
+    uint8_t flagsLeft;   // items left under it
+    uint8_t matchByte;   // first byte of a match split across two feeds
+    bool haveMatchByte;
+    bool error;
+};
+
+inline void lz_begin(LzStream& lz)
+{
+    lz.produced = 0;
+    lz.expected = 0;
+    lz.headerLen = 0;
+    lz.flagsLeft = 0;
+    lz.haveMatchByte = false;
+    lz.error = false;
+}
+
+inline bool lz_finished(const LzStream& lz)
+{
+    return lz.headerLen == LZ_HEADER_BYTES && lz.produced == lz.expected;
+}
+
+// Decode as much of in[] as there is. sink(const uint8_t*, size_t) gets the
+// output. Returns false once the stream is known to be corrupt.
+template <typename Sink>
+bool lz_feed(LzStream& lz, const uint8_t* in, size_t length, Sink& sink)
+{
+    uint8_t out[LZ_OUT_BATCH];
+    size_t outLen = 0;
+    size_t i = 0;
+
+    while (i < length && lz.headerLen < LZ_HEADER_BYTES)
+    {
+        lz.header[lz.headerLen++] = in[i++];
+        if (lz.headerLen == LZ_HEADER_BYTES)
+        {
+            if (memcmp(lz.header, LZ_MAGIC, 4) != 0)
+            {
+                lz.error = true;
+            }
+            lz.expected = lz.header[4] | (lz.header[5] << 8) | (lz.header[6] << 16) | (static_cast<uint32_t>(lz.header[7]) << 24);
+        }
+    }
+
+    while (i < length && !lz.error && lz.produced < lz.expected)
+    {
+        if (lz.flagsLeft == 0)
+        {
+            lz.flags = in[i++];
+            lz.flagsLeft = 8;
+            continue;
+        }
+        if (lz.flags & 1)
+        {
+            uint8_t byte = in[i++];
+            lz.window[lz.produced & (LZ_WINDOW - 1)] = byte;
+            lz.produced++;
+            out[outLen++] = byte;
+        }
+        else
+        {
+            if (!lz.haveMatchByte)
+            {
+                lz.matchByte = in[i++];
+                lz.haveMatchByte = true;
+                continue; // the flag bit stays until both bytes are in
+            }
+            uint8_t second = in[i++];
+            lz.haveMatchByte = false;
+            uint32_t distance = (lz.matchByte | ((second & 0xF0) << 4)) + 1;
+            uint32_t count = (second & 0x0F) + LZ_MIN_MATCH;
+            if (distance > lz.produced || count > lz.expected - lz.produced)
+            {
+                lz.error = true;
+                break;
+            }
+            // byte by byte, so a match may overlap the bytes it is producing
+            for (uint32_t c = 0; c < count; c++)
+            {
+                uint8_t byte = lz.window[(lz.produced - distance) & (LZ_WINDOW - 1)];
+                lz.window[lz.produced & (LZ_WINDOW - 1)] = byte;
+                lz.produced++;
+                out[outLen++] = byte;
+                if (outLen == LZ_OUT_BATCH)
+                {
+                    sink(out, outLen);
+                    outLen = 0;
+                }
+            }
+        }
+        lz.flags >>= 1;
+        lz.flagsLeft--;
+        if (outLen >= LZ_OUT_BATCH)
+        {
+            sink(out, outLen);
+            outLen = 0;
+        }
+    }
+    if (outLen > 0)
+    {
+        sink(out, outLen);
+    }
+    return !lz.error;
+}
+
+// One download, compressed or not: holds back the first four bytes until
+// it knows which, then passes plain bytes through or decodes them.
+enum SongTransferMode {
+    TRANSFER_UNKNOWN = 0,
+    TRANSFER_RAW,
+    TRANSFER_COMPRESSED
+};
+
+struct SongTransfer {
+    LzStream lz;
+    uint8_t head[4];
+    uint8_t headLen;
+    uint8_t mode;
+    uint32_t received; // bytes off the network
+};
+
+inline void song_transfer_begin(SongTransfer& t)
+{
+    t.headLen = 0;
+    t.mode = TRANSFER_UNKNOWN;
+    t.received = 0;
+    lz_begin(t.lz);
+}
+
+template <typename Sink>
+bool song_transfer_feed(SongTransfer& t, const uint8_t* in, size_t length, Sink& sink)
+{
+    t.received += length;
+    if (t.mode == TRANSFER_UNKNOWN)
+    {
+        while (length > 0 && t.headLen < 4)
+        {
+            t.head[t.headLen++] = *in++;
+            length--;
+        }
+        if (t.headLen < 4)
+        {
+            return true;
+        }
+        t.mode = memcmp(t.head, LZ_MAGIC, 4) == 0 ? TRANSFER_COMPRESSED : TRANSFER_RAW;
+        if (t.mode == TRANSFER_COMPRESSED)
+        {
+            lz_feed(t.lz, t.head, 4, sink);
+        }
+        else
+        {
+            sink(t.head, 4);
+        }
+    }
+    if (t.mode == TRANSFER_COMPRESSED)
+    {
+        return lz_feed(t.lz, in, length, sink);
+    }
+    if (length > 0)
+    {
+        sink(in, length);
+    }
+    return true;
+}
+
+// Call when the server has gone quiet: a short transfer still counts as raw
+template <typename Sink>
+bool song_transfer_end(SongTransfer& t, Sink& sink)
+{
+    if (t.mode == TRANSFER_UNKNOWN && t.headLen > 0)
+    {
+        t.mode = TRANSFER_RAW;
+        sink(t.head, t.headLen);
+    }
+    return t.mode != TRANSFER_COMPRESSED || lz_finished(t.lz);
+}
+
+// What lz_compress() remembers: where each hashed 3-byte prefix was last
+// seen, as position + 1 so 0 means never
+struct LzEncoder {
+    uint16_t last[1 << LZ_HASH_BITS];
+};
+
+static inline uint32_t lz_hash(const uint8_t* p)
+{
+    uint32_t prefix = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (prefix * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Compress in[0, length) into out, header and all. Greedy with one
+// candidate per position: much quicker than song_server.py's search and
+// not as tight, which suits small uploads. length must be under 64 KB.
+// Returns the stream's size, 0 if it didn't fit in room.
+inline size_t lz_compress(LzEncoder& encoder, const uint8_t* in, size_t length, uint8_t* out, size_t room)
+{
+    if (room < LZ_HEADER_BYTES || length > 0xFFFF)
+    {
+        return 0;
+    }
+    memcpy(out, LZ_MAGIC, 4);
+    for (int b = 0; b < 4; b++)
+    {
+        out[4 + b] = static_cast<uint8_t>(length >> (8 * b));
+    }
+    memset(encoder.last, 0, sizeof(encoder.last));
+
+    size_t outLen = LZ_HEADER_BYTES;
+    size_t flagAt = 0;
+    int items = 8; // items under the current flag byte
+    size_t i = 0;
+    while (i < length)
+    {
+        if (items == 8)
+        {
+            if (outLen >= room)
+            {
+                return 0;
+            }
+            flagAt = outLen;
+            out[outLen++] = 0;
+            items = 0;
+        }
+        size_t best = 0;
+        size_t distance = 0;
+        if (i + LZ_MIN_MATCH <= length)
+        {
+            uint32_t hash = lz_hash(in + i);
+            size_t seen = encoder.last[hash];
+            encoder.last[hash] = static_cast<uint16_t>(i + 1);
+            if (seen > 0 && i - (seen - 1) <= LZ_WINDOW)
+            {
+                const uint8_t* from = in + seen - 1;
+                size_t limit = length - i < LZ_MAX_MATCH ? length - i : LZ_MAX_MATCH;
+                while (best < limit && from[best] == in[i + best])
+                {
+                    best++;
+                }
+                distance = i - (seen - 1);
+            }
+        }
+        if (best >= LZ_MIN_MATCH)
+        {
+            if (outLen + 2 > room)
+            {
+                return 0;
+            }
+            out[outLen++] = static_cast<uint8_t>((distance - 1) & 0xFF);
+            out[outLen++] = static_cast<uint8_t>(((distance - 1) >> 8) << 4 | (best - LZ_MIN_MATCH));
+            for (size_t k = 1; k < best && i + k + LZ_MIN_MATCH <= length; k++)
+            {
+                encoder.last[lz_hash(in + i + k)] = static_cast<uint16_t>(i + k + 1);
+            }
+            i += best;
+        }
+        else
+        {
+            if (outLen >= room)
+            {
+                return 0;
+            }
+            out[flagAt] |= 1 << items;
+            out[outLen++] = in[i++];
+        }
+        items++;
+    }
+    return outLen;
+}
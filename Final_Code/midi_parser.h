@@ -0,0 +1,1125 @@
+#pragma once
+
+// The song parser: MIDI header and track chunks into MidiData, and MidiData
+// into one frame per grid step.
+//
+// Everything a song owns lives in a SongArena. measureSong() walks the raw
+// bytes first and says exactly how much each container needs, so the
+// parser never grows a vector. Nothing here touches WiFi, SPIFFS or the
+// LEDs, so host tools (tools/indexer.cpp) build the same code; they can
+// set LOG_LEVEL_PARSER to LOG_LEVEL_OFF to drop the parser's messages.
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <istream>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "keyboard_geometry.h"
+#include "logger.h"
+#include "song_arena.h"
+#include "song_index.h"
+
+// Define custom functions for byte order conversion
+unsigned int bigEndianToHost(unsigned char* buffer, int size) {
+    unsigned int result = 0;
+    for (int i = 0; i < size; i++) {
+        result = (result << 8) | buffer[i];
+    }
+    return result;
+}
+
+unsigned short bigEndianToHostShort(unsigned char* buffer) {
+    return (buffer[0] << 8) | buffer[1];
+}
+
+// Structure to store key signature data
+struct KeySignature {
+    char key;               // sharps, negative for flats
+    const char* scale = ""; // "major" / "minor"
+    int ticks;
+};
+
+// Structure to store tempo data
+struct Tempo {
+    int bpm;
+    int ticks;
+    long int microsecondsPerQuarterNote;
+};
+
+// Structure to store time signature data
+struct TimeSignature {
+    int ticks;
+    int numerator;
+    int denominator;
+    int measures; // bars before this signature starts
+};
+
+// Structure to store control change data
+struct ControlChange {
+    int number;
+    int ticks;
+    int time;
+    double value;
+    int channel;
+};
+
+// Structure to store note data
+struct Note {
+    double duration = 0.0;
+    int durationTicks;
+    int midi;
+    const char* name = ""; // "Note On" / "Note Off", always a string literal
+    int ticks;
+    double velocity;
+    int channel;
+    const char* notetype = "";
+    char binary;
+};
+
+// Structure to represent a track
+// Everything lives in the song arena; notes and controlChanges must be
+// reserved to their measured size before the chunk is read.
+struct Track {
+    int channel;
+    SongVector<ControlChange> controlChanges;
+    SongVector<Note> notes;
+    int endOfTrackTicks = 0;
+    long int tempoQuarterNote = 500000; // us per quarter note, 120 bpm until a Set Tempo
+    int firstTempoTicks = -1;           // where the track's first Set Tempo is, -1 without one
+    long int firstTempoQuarterNote = 500000;
+    SongString name;
+    SongGrid grid;                        // the track's first time signature with a 32nd-note count
+    int timeSignatureNumerator = 4;
+    int timeSignatureDenominator = 4;
+    int keySignatureSharps = 0;           // negative for flats
+    bool keySignatureMinor = false;
+    int maxTick = 0;
+
+    explicit Track(SongArena& arena)
+        : controlChanges(ArenaAllocator<ControlChange>(arena)),
+          notes(ArenaAllocator<Note>(arena)),
+          name(ArenaAllocator<char>(arena)) {}
+};
+
+// What EventMerge can name in a heap entry; parseSong() turns away songs
+// with more
+#define MERGE_INDEX_BITS 22
+#define MERGE_MAX_TRACKS 256
+#define MERGE_MAX_EVENTS (1 << MERGE_INDEX_BITS) // notes, or control changes, in one track
+
+// One event of the whole song, from any track (see EventMerge)
+struct SongEvent {
+    int tick;
+    uint8_t kind;    // SONG_*, also the order events apply within a tick
+    uint8_t track;
+    uint8_t channel; // 0-15
+    uint8_t number;  // MIDI note, or controller number
+    uint8_t value;   // Note On velocity, or controller value
+};
+
+enum {
+    SONG_NOTE_OFF = 0,
+    SONG_CONTROL,
+    SONG_NOTE_ON
+};
+
+// Structure to store header information and tracks
+struct MidiData {
+    SongVector<KeySignature> keySignatures;
+    SongVector<Tempo> tempos;
+    SongVector<TimeSignature> timeSignatures;
+    SongVector<Track> tracks;
+    int division;
+    SongGrid grid;                      // frame grid, from every track's time signatures
+    int step = 1;                       // ticks per frame
+    uint32_t usPerQuarter = 500000;     // first Set Tempo in the song; later ones aren't followed yet
+    SongVector<LedFrame> frames;        // keys held or sustained at each grid step, with their levels
+
+    explicit MidiData(SongArena& arena)
+        : keySignatures(ArenaAllocator<KeySignature>(arena)),
+          tempos(ArenaAllocator<Tempo>(arena)),
+          timeSignatures(ArenaAllocator<TimeSignature>(arena)),
+          tracks(ArenaAllocator<Track>(arena)),
+          frames(ArenaAllocator<LedFrame>(arena)) {}
+};
+
+// What one track will need from the arena, counted before it is parsed
+struct TrackSizing {
+    int notes = 0;
+    int controlChanges = 0;
+    int nameLength = 0;
+    int maxTick = 0;
+    int timeSignatures = 0;
+    SongGrid grid;
+};
+
+// What the whole song will need, worked out from the header and track chunks
+struct SongSizing {
+    unsigned short numTracks = 0;
+    unsigned short division = 0;
+    TrackSizing* tracks = nullptr; // numTracks entries, carved from the arena
+    int timeSignatures = 0;        // in every track, for MidiData::timeSignatures
+    SongGrid grid;                 // the one buildFrames() will use
+    size_t bytes = 0;              // estimated arena bytes for everything else
+};
+
+bool readTrackChunk(std::istream& file, Track& track, unsigned short division, SongVector<TimeSignature>* timeSignatures = nullptr);
+void processMidiEvent(Track& track, int ticks, int channel, char statusByte, char dataByte1, char dataByte2, unsigned short division);
+Note* findCorrespondingNoteOnEvent(Track& track, int note, int channel, int ticks);
+std::string getNoteName(int midiNote);
+int ReadVariableLengthValue(std::istream& file);
+bool measureSong(const unsigned char* bytes, size_t size, SongArena& arena, SongSizing& sizing);
+bool parseSong(std::istream& midiFile, const SongSizing& sizing, SongArena& arena, MidiData& midiData);
+bool measureSong(const std::string& data, SongArena& arena, SongSizing& sizing);
+bool buildFrames(MidiData& midiData);
+void buildSongIndex(MidiData& midiData, SongIndex& index);
+bool scanSong(const unsigned char* bytes, size_t size, SongArena& arena, MidiData& midiData);
+
+// Helper function to read a variable-length quantity from the stream
+int ReadVariableLengthValue(std::istream& file) {
+    int value = 0;
+    char byte = 0;
+    do {
+        if (!file.read(&byte, 1)) {
+            break; // truncated file: don't spin on the last byte
+        }
+        value = (value << 7) | (byte & 0x7F);
+    } while (byte & 0x80);
+    return value;
+}
+
+std::string getNoteName(int midiNote) {
+    const std::string pianoKeys[] = {
+        "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"
+    };
+
+    if (midiNote >= 0 && midiNote <= 127) {
+        int octave = (midiNote / 12) - 1;
+        int noteInOctave = midiNote % 12;
+
+        return pianoKeys[noteInOctave] + std::to_string(octave);
+    }
+    else {
+        return "Unknown";
+    }
+}
+
+// Helper function to find the corresponding Note On event for a Note Off event
+Note* findCorrespondingNoteOnEvent(Track& track, int note, int channel, int ticks) {
+    for (Note& noteEvent : track.notes) {
+        if (strcmp(noteEvent.name, "Note On") == 0 && noteEvent.midi == note && noteEvent.ticks < ticks && noteEvent.channel == channel) {
+            // Check if the Note On event has not been matched to a Note Off event
+            if (noteEvent.duration == 0.0) {
+                return &noteEvent;
+            }
+        }
+    }
+    return nullptr;
+}
+
+
+
+
+
+// Function to process MIDI events
+void processMidiEvent(Track& track, int ticks, int channel, char statusByte, char dataByte1, char dataByte2, unsigned short division) {
+    switch (statusByte & 0xF0) {
+    case 0x80: // Note Off
+            // Extract the note; its release velocity isn't kept
+    {
+        int note = static_cast<int>(dataByte1);
+
+        // Find the corresponding Note On event
+        Note* correspondingNoteOn = findCorrespondingNoteOnEvent(track, note, channel, ticks);
+
+        if (correspondingNoteOn) {
+            // Calculate the duration and update the Note On event
+            double durationTicks = ticks - correspondingNoteOn->ticks;
+            correspondingNoteOn->duration = (durationTicks / division);  // Convert ticks to seconds
+            correspondingNoteOn->durationTicks = durationTicks;
+        }
+    }
+    break;
+    case 0x90: // Note On
+        // Extract note and velocity information
+    {
+        int note = static_cast<int>(dataByte1);
+        int velocity = static_cast<int>(dataByte2);
+
+        // Create a Note structure and add it to the track
+        Note noteOnEvent;
+        noteOnEvent.durationTicks = 0; // filled in by the matching Note Off
+        noteOnEvent.midi = note;
+        noteOnEvent.velocity = velocity;
+        noteOnEvent.ticks = ticks;
+        noteOnEvent.duration = 0.0; // Duration for Note On is 0
+        noteOnEvent.name = "Note On";
+        noteOnEvent.channel = channel;
+        if (noteOnEvent.velocity == 0)
+        {
+            Note* correspondingNoteOn = findCorrespondingNoteOnEvent(track, note, channel, ticks);
+
+            if (correspondingNoteOn) {
+                // Calculate the duration and update the Note On event
+                double durationTicks = ticks - correspondingNoteOn->ticks;
+                correspondingNoteOn->duration = (durationTicks / division);
+                correspondingNoteOn->durationTicks = durationTicks;
+                //std::cout << "Note off for " << correspondingNoteOn->midi << " for " << correspondingNoteOn->duration << std::endl;
+            }
+
+        }
+        else if (track.notes.size() < track.notes.capacity()) {
+            // Never grow past the measured size: the arena can't reallocate
+            track.notes.push_back(noteOnEvent);
+        }
+        break; }
+
+    case 0xA0: // Aftertouch (not kept)
+        break;
+    case 0xB0: // Control Change
+        // Extract control change number and value information
+    {
+        int controlNumber = static_cast<int>(dataByte1);
+        int controlValue = static_cast<int>(dataByte2);
+
+        // Create a ControlChange structure and add it to the track
+        ControlChange controlChangeEvent;
+        controlChangeEvent.ticks = ticks;
+        controlChangeEvent.number = controlNumber;
+        controlChangeEvent.value = controlValue;
+        controlChangeEvent.channel = channel;
+        if (track.controlChanges.size() < track.controlChanges.capacity()) {
+            track.controlChanges.push_back(controlChangeEvent);
+        }
+
+        //std::cout << "Control Change - Channel: " << channel << ", Control Number: " << controlNumber
+            //<< ", Value: " << controlValue << ", Current Tick: " << ticks << std::endl;
+    }
+    break;
+    case 0xE0: // Pitch Bend (not kept)
+        break;
+    // Other cases can be added here for Midi Events
+    default:
+        // Unrecognized MIDI event, ignore it
+        break;
+    }
+}
+
+
+// Function to read the track chunk. Its time signatures are also added to
+// timeSignatures, if given, up to the capacity reserved for them.
+bool readTrackChunk(std::istream& file, Track& track, unsigned short division, SongVector<TimeSignature>* timeSignatures) {
+    char trackChunkID[4];
+    file.read(trackChunkID, 4);
+
+    if (std::string(trackChunkID, 4) != "MTrk") {
+        std::cerr << "Invalid or missing track chunk in the MIDI file." << std::endl;
+        return false;
+    }
+
+    // Read the track chunk size
+    unsigned char trackChunkSizeBuffer[4];
+    file.read(reinterpret_cast<char*>(trackChunkSizeBuffer), 4);
+    int trackChunkSize = bigEndianToHost(trackChunkSizeBuffer, 4);
+
+    // Store the starting position of the track data
+    std::streampos trackStartPos = file.tellg();
+
+    // Read track events
+    int currentTick = 0;
+    char runningStatus = 0;
+    while (file && file.tellg() - trackStartPos < trackChunkSize) {
+        int deltaTime = ReadVariableLengthValue(file);
+        currentTick += deltaTime;
+
+        char statusByte;
+        file.read(&statusByte, 1);
+        if ((statusByte & 0x80) == 0) {
+            // Running status: that was the first data byte of another event like the last one
+            file.unget();
+            statusByte = runningStatus;
+        }
+
+        if (statusByte == static_cast<char>(0xFF)) {
+            // Meta Event
+            char metaType;
+            file.read(&metaType, 1);
+
+            int metaLength = ReadVariableLengthValue(file);
+
+            // Handle meta events
+            switch (metaType) {
+            case 0x00: {
+                // Sequence Number (not kept)
+                file.ignore(metaLength);
+                break;
+            }
+            case 0x01: {
+                // Text Event (not kept, so don't buffer it)
+                file.ignore(metaLength);
+                break;
+            }
+            case 0x02: {
+                // Copyright Notice (not kept)
+                file.ignore(metaLength);
+                break;
+            }
+            case 0x03: {
+                // Sequence/Track Name, read straight into the arena string
+                if (!arena_reserve(track.name, metaLength)) {
+                    LOG_ERROR(PARSER, "No room in the song arena for a track name");
+                    return false;
+                }
+                track.name.assign(metaLength, '\0');
+                file.read(&track.name[0], metaLength);
+                LOG_INFO(PARSER, "Sequence/Track Name: %s", track.name.c_str());
+                break;
+            }
+            case 0x04: {
+                // Instrument Name (not kept)
+                file.ignore(metaLength);
+                break;
+            }
+            case 0x20: {
+                // MIDI Channel Prefix (not kept)
+                file.ignore(metaLength);
+                break;
+            }
+            case 0x2F: {
+                // End of Track
+                if (metaLength == 0) {
+                    LOG_DEBUG(PARSER, "End of Track");
+                    track.endOfTrackTicks = currentTick;
+                }
+                break;
+            }
+            case 0x51: {
+                // Set Tempo
+                if (metaLength == 3) {
+                    unsigned char tempoBytes[3];
+                    file.read(reinterpret_cast<char*>(tempoBytes), 3);
+                    long int microsecondsPerQuarterNote = (tempoBytes[0] << 16) | (tempoBytes[1] << 8) | tempoBytes[2];
+                    track.tempoQuarterNote = microsecondsPerQuarterNote;
+                    if (track.firstTempoTicks < 0 && microsecondsPerQuarterNote > 0) {
+                        track.firstTempoTicks = currentTick;
+                        track.firstTempoQuarterNote = microsecondsPerQuarterNote;
+                    }
+                    LOG_INFO(PARSER, "Set Tempo: %ld microseconds per quarter note", microsecondsPerQuarterNote);
+                }
+                break;
+            }
+            case 0x58: {
+                // Time Signature
+                if (metaLength == 4) {
+                    char timeSignatureBytes[4];
+                    file.read(timeSignatureBytes, 4);
+                    int nn = timeSignatureBytes[0]; // Numerator
+                    int dd = timeSignatureBytes[1]; // Denominator
+                    int bb = static_cast<unsigned char>(timeSignatureBytes[3]); // Notated 32nd-notes per MIDI quarter note
+                    //std::cout << "Time Signature: " << nn << "/" << (1 << dd)
+                      //  << ", Notated 32nd-notes per MIDI quarter note: " << bb << std::endl;
+                    track.timeSignatureNumerator = nn;
+                    track.timeSignatureDenominator = 1 << (dd & 0x07);
+                    song_grid_offer(track.grid, currentTick, bb);
+                    if (timeSignatures != nullptr && timeSignatures->size() < timeSignatures->capacity()) {
+                        TimeSignature signature;
+                        signature.ticks = currentTick;
+                        signature.numerator = nn;
+                        signature.denominator = track.timeSignatureDenominator;
+                        signature.measures = 0;
+                        timeSignatures->push_back(signature);
+                    }
+                }
+                break;
+            }
+            case 0x59: {
+                // Key Signature
+                if (metaLength == 2) {
+                    char keySignatureBytes[2];
+                    file.read(keySignatureBytes, 2);
+                    int sf = keySignatureBytes[0]; // Key Signature
+                    int mi = keySignatureBytes[1]; // Minor Key
+                    track.keySignatureSharps = sf;
+                    track.keySignatureMinor = mi != 0;
+                    //std::cout << "Key Signature: " << sf << " " << (mi ? "Minor" : "Major") << std::endl;
+                }
+                break;
+            }
+                     // Handle other meta events as needed
+            default:
+                // Skip other meta events
+                file.ignore(metaLength);
+                break;
+            }
+
+        }
+        else if (statusByte == static_cast<char>(0xF0) || statusByte == static_cast<char>(0xF7)) {
+            // SysEx: length-prefixed, nothing we keep
+            file.ignore(ReadVariableLengthValue(file));
+        }
+        else {
+            // MIDI Event
+            runningStatus = statusByte;
+            int midiChannel = (statusByte & 0x0F) + 1; // Extract the channel bits (1-16)
+
+            switch (statusByte & 0xF0) {
+            case 0x80: // Note Off
+            case 0x90: // Note On
+            case 0xA0: // Aftertouch
+            case 0xB0: // Control Change
+            case 0xE0: // Pitch Bend
+                // These messages have two data bytes
+                char dataByte1, dataByte2;
+                file.read(&dataByte1, 1);
+                file.read(&dataByte2, 1);
+
+                // Process and store the MIDI event using the function
+                processMidiEvent(track, currentTick, midiChannel, statusByte, dataByte1, dataByte2, division);
+                break;
+            case 0xC0: // Program change
+            case 0xD0: // Channel pressure
+                file.read(&dataByte1, 1);
+                //Midi Event process 2
+                break;
+            default:
+                // Unrecognized MIDI event, ignore it
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Parse a song measureSong() has sized into midiData, from just after
+// "MThd". Every container is reserved from the arena up front; one that
+// still won't fit means the estimate was off, and the song is turned away
+// rather than half built.
+bool parseSong(std::istream& midiFile, const SongSizing& sizing, SongArena& arena, MidiData& midiData) {
+    unsigned char headerChunkSizeBuffer[4];
+    midiFile.read(reinterpret_cast<char*>(headerChunkSizeBuffer), 4);
+    unsigned int headerChunkSize = bigEndianToHost(headerChunkSizeBuffer, 4);
+    if (headerChunkSize < 6) {
+        LOG_ERROR(PARSER, "MIDI header is too short");
+        return false;
+    }
+
+    unsigned char formatTypeBuffer[2];
+    midiFile.read(reinterpret_cast<char*>(formatTypeBuffer), 2);
+    unsigned short formatType = bigEndianToHostShort(formatTypeBuffer);
+
+    unsigned char numTracksBuffer[2];
+    midiFile.read(reinterpret_cast<char*>(numTracksBuffer), 2);
+    unsigned short numTracks = bigEndianToHostShort(numTracksBuffer);
+
+    unsigned char divisionBuffer[2];
+    midiFile.read(reinterpret_cast<char*>(divisionBuffer), 2);
+    unsigned short division = bigEndianToHostShort(divisionBuffer);
+
+    LOG_INFO(PARSER, "Format Type: %u", formatType);
+    LOG_INFO(PARSER, "Number of Tracks: %u", numTracks);
+    LOG_INFO(PARSER, "Division: %u", division);
+    midiData.division = division;
+    midiFile.ignore(headerChunkSize - 6); // header fields newer than the three above
+
+    if (numTracks > MERGE_MAX_TRACKS) {
+        LOG_ERROR(PARSER, "%u tracks, only %d can be played", numTracks, MERGE_MAX_TRACKS);
+        return false;
+    }
+    if (numTracks != sizing.numTracks || !arena_reserve(midiData.tracks, numTracks) ||
+        !arena_reserve(midiData.timeSignatures, sizing.timeSignatures)) {
+        LOG_ERROR(PARSER, "Song doesn't fit in the arena after all");
+        return false;
+    }
+    for (int trackNumber = 0; trackNumber < numTracks; ++trackNumber) {
+        // Build the track in place in the MidiData structure
+        midiData.tracks.emplace_back(arena);
+        Track& track = midiData.tracks.back();
+        if (sizing.tracks[trackNumber].notes > MERGE_MAX_EVENTS || sizing.tracks[trackNumber].controlChanges > MERGE_MAX_EVENTS) {
+            LOG_ERROR(PARSER, "Track %d has too many events to play", trackNumber);
+            return false;
+        }
+        if (!arena_reserve(track.notes, sizing.tracks[trackNumber].notes) ||
+            !arena_reserve(track.controlChanges, sizing.tracks[trackNumber].controlChanges)) {
+            LOG_ERROR(PARSER, "Song doesn't fit in the arena after all");
+            return false;
+        }
+        if (!readTrackChunk(midiFile, track, division, &midiData.timeSignatures)) {
+            return false;
+        }
+    }
+
+    // The song's tempo is the earliest Set Tempo in any track, the first
+    // track's on a tie, as the frame stream and the catalog take it
+    int firstTempoTicks = -1;
+    for (const Track& track : midiData.tracks) {
+        if (track.firstTempoTicks >= 0 && (firstTempoTicks < 0 || track.firstTempoTicks < firstTempoTicks)) {
+            firstTempoTicks = track.firstTempoTicks;
+            midiData.usPerQuarter = track.firstTempoQuarterNote;
+        }
+    }
+    // The frame grid goes by the same rule (song_grid_offer())
+    for (const Track& track : midiData.tracks) {
+        song_grid_offer(midiData.grid, track.grid.tick, track.grid.thirtysecondNotes);
+    }
+    return true;
+}
+
+// Every track's notes and control changes as one stream in song order,
+// merged lazily: a min-heap holds the next Note On and the next control
+// change of each track, plus the Note Off of every note already started,
+// so pulling an event costs O(log k) and nothing is copied out of the
+// tracks. Ties on a tick go Note Offs, then control changes, then Note
+// Ons, then by track, then in the order the track stored them, so the
+// order never depends on the heap. A note with no Note Off ends on the
+// tick it starts.
+//
+// A heap entry is that whole order packed into one integer, so the heap
+// only ever compares numbers: tick, kind (2 bits), track (8 bits), then
+// the index into the track's notes or controlChanges (22 bits). Songs past
+// those limits are turned away rather than merged wrong.
+//
+// The heap lives in the song arena. A track never has more entries than
+// it has notes, plus its next control change: a Note Off for each note
+// started, and the next Note On while any are left.
+struct EventMerge {
+    const MidiData* song = nullptr;
+    SongVector<uint64_t> heap;
+
+    explicit EventMerge(SongArena& arena) : heap(ArenaAllocator<uint64_t>(arena)) {}
+};
+
+// Heap entries a song's merge can need at once
+static inline size_t event_merge_entries(size_t tracks, size_t notes) {
+    return notes + tracks;
+}
+
+static inline void merge_push(EventMerge& merge, int tick, uint8_t kind, uint8_t track, uint32_t index) {
+    merge.heap.push_back((uint64_t)tick << 32 | (uint32_t)kind << 30 | (uint32_t)track << MERGE_INDEX_BITS | index);
+    std::push_heap(merge.heap.begin(), merge.heap.end(), std::greater<uint64_t>());
+}
+
+// Start merging a song. Returns false if it has more tracks or events than
+// a heap entry can name, or its heap doesn't fit in the arena.
+bool event_merge_begin(EventMerge& merge, const MidiData& song) {
+    merge.song = &song;
+    merge.heap.clear();
+    if (song.tracks.size() > MERGE_MAX_TRACKS) {
+        return false;
+    }
+    size_t notes = 0;
+    for (const Track& track : song.tracks) {
+        if (track.notes.size() > MERGE_MAX_EVENTS || track.controlChanges.size() > MERGE_MAX_EVENTS) {
+            return false;
+        }
+        notes += track.notes.size();
+    }
+    if (!arena_reserve(merge.heap, event_merge_entries(song.tracks.size(), notes))) {
+        return false;
+    }
+    for (size_t t = 0; t < song.tracks.size(); t++) {
+        const Track& track = song.tracks[t];
+        if (!track.notes.empty()) {
+            merge_push(merge, track.notes[0].ticks, SONG_NOTE_ON, (uint8_t)t, 0);
+        }
+        if (!track.controlChanges.empty()) {
+            merge_push(merge, track.controlChanges[0].ticks, SONG_CONTROL, (uint8_t)t, 0);
+        }
+    }
+    return true;
+}
+
+// Next event in song order. Returns false once every track is used up.
+bool event_merge_next(EventMerge& merge, SongEvent& event) {
+    if (merge.heap.empty()) {
+        return false;
+    }
+    std::pop_heap(merge.heap.begin(), merge.heap.end(), std::greater<uint64_t>());
+    uint64_t next = merge.heap.back();
+    merge.heap.pop_back();
+    uint8_t kind = (next >> 30) & 3;
+    uint8_t t = next >> MERGE_INDEX_BITS;
+    uint32_t index = next & ((1u << MERGE_INDEX_BITS) - 1);
+
+    const Track& track = merge.song->tracks[t];
+    event.tick = (int)(next >> 32);
+    event.kind = kind;
+    event.track = t;
+    if (kind == SONG_CONTROL) {
+        const ControlChange& change = track.controlChanges[index];
+        event.channel = (change.channel - 1) & 0x0F;
+        event.number = change.number;
+        event.value = static_cast<uint8_t>(change.value);
+        if (index + 1 < track.controlChanges.size()) {
+            merge_push(merge, track.controlChanges[index + 1].ticks, SONG_CONTROL, t, index + 1);
+        }
+        return true;
+    }
+
+    const Note& note = track.notes[index];
+    event.channel = (note.channel - 1) & 0x0F;
+    event.number = note.midi;
+    event.value = static_cast<uint8_t>(note.velocity);
+    if (kind == SONG_NOTE_ON) {
+        merge_push(merge, note.ticks + (note.durationTicks > 0 ? note.durationTicks : 0), SONG_NOTE_OFF, t, index);
+        if (index + 1 < track.notes.size()) {
+            merge_push(merge, track.notes[index + 1].ticks, SONG_NOTE_ON, t, index + 1);
+        }
+    }
+    return true;
+}
+
+// Turn every track's notes and sustain pedal into one frame per grid step.
+// Events come from the merge in song order and snap to the nearest step; a
+// key is lit while any note holds it, while the pedal on its channel
+// sustains it, and for at least the step its note starts on. It stays at
+// the level its latest strike set, sustained or not. Returns false if the
+// frames don't fit in the song arena.
+bool buildFrames(MidiData& midiData) {
+    if (midiData.tracks.empty()) {
+        return true;
+    }
+    int step = song_grid_step(midiData.grid, midiData.division);
+    int half = step / 2;
+    midiData.step = step;
+
+    // Frames run to the step of the last note edge or pedal change
+    int lastTick = -1;
+    for (const Track& track : midiData.tracks) {
+        for (const Note& note : track.notes) {
+            if (ActiveKeyboard::hasNote(note.midi)) {
+                lastTick = std::max(lastTick, note.ticks + std::max(note.durationTicks, 0));
+            }
+        }
+        for (const ControlChange& change : track.controlChanges) {
+            if (change.number == 64) {
+                lastTick = std::max(lastTick, change.ticks);
+            }
+        }
+    }
+    if (lastTick < 0) {
+        return true;
+    }
+
+    uint8_t heldCount[88] = {0};      // notes currently holding each key
+    KeyFrame held;                    // keys with heldCount > 0
+    KeyFrame sustained[16];           // keys released under each channel's pedal
+    KeyFrame allSustained;
+    KeyFrame struck;                  // keys whose note started this step
+    uint16_t pedalDown = 0;           // one bit per channel
+    LedFrame levels;                  // level of each key's latest strike
+
+    size_t frames = (lastTick + half) / step + 1;
+    if (!arena_reserve(midiData.frames, frames)) {
+        LOG_ERROR(PARSER, "%lu frames don't fit in the song arena", static_cast<unsigned long>(frames));
+        return false;
+    }
+    midiData.frames.resize(frames);
+    EventMerge merge(*midiData.frames.get_allocator().arena);
+    if (!event_merge_begin(merge, midiData)) {
+        LOG_ERROR(PARSER, "The song's events can't be merged in the song arena");
+        return false;
+    }
+    SongEvent event;
+    bool more = event_merge_next(merge, event);
+    for (int frame = 0; frame < (int)midiData.frames.size(); frame++) {
+        for (; more && (event.tick + half) / step == frame; more = event_merge_next(merge, event)) {
+            if (event.kind == SONG_CONTROL) {
+                if (event.number != 64) { // only the sustain pedal shows
+                    continue;
+                }
+                if (event.value >= 64) {
+                    pedalDown |= 1 << event.channel;
+                    continue;
+                }
+                pedalDown &= ~(1 << event.channel);
+                sustained[event.channel].reset();
+                allSustained.reset();
+                for (int c = 0; c < 16; c++) {
+                    allSustained |= sustained[c];
+                }
+                continue;
+            }
+            if (!ActiveKeyboard::hasNote(event.number)) {
+                continue;
+            }
+            int key = ActiveKeyboard::keyIndex(event.number);
+            if (event.kind == SONG_NOTE_ON) {
+                if (heldCount[key]++ == 0) {
+                    held.set(key);
+                }
+                struck.set(key);
+                levels.set(key, velocity_level(event.value));
+            }
+            else if (heldCount[key] > 0 && --heldCount[key] == 0) {
+                held.reset(key);
+                if (pedalDown & (1 << event.channel)) {
+                    sustained[event.channel].set(key);
+                    allSustained.set(key);
+                }
+            }
+        }
+        midiData.frames[frame] = levels.masked(held | allSustained | struck);
+        struck.reset();
+    }
+    return true;
+}
+
+// Bar map of a parsed song (song_index.h), from the time signatures every
+// track gave readTrackChunk(). Call after buildFrames().
+void buildSongIndex(MidiData& midiData, SongIndex& index) {
+    std::stable_sort(midiData.timeSignatures.begin(), midiData.timeSignatures.end(), [](const TimeSignature& a, const TimeSignature& b) { return a.ticks < b.ticks; });
+    song_index_begin(index, midiData.division, midiData.step);
+    for (const TimeSignature& signature : midiData.timeSignatures) {
+        song_index_signature(index, signature.ticks, signature.numerator, signature.denominator);
+    }
+    index.frames = midiData.frames.size();
+}
+
+// Read a variable-length quantity from a raw buffer, advancing pos
+static unsigned int readVariableLength(const unsigned char* data, size_t end, size_t& pos) {
+    unsigned int value = 0;
+    unsigned char byte;
+    do {
+        if (pos >= end) {
+            return value;
+        }
+        byte = data[pos++];
+        value = (value << 7) | (byte & 0x7F);
+    } while (byte & 0x80);
+    return value;
+}
+
+// Count what one track chunk will store, mirroring readTrackChunk/processMidiEvent
+static void measureTrackEvents(const unsigned char* data, size_t pos, size_t end, TrackSizing& track) {
+    int currentTick = 0;
+    unsigned char runningStatus = 0;
+    while (pos < end) {
+        currentTick += readVariableLength(data, end, pos);
+        if (pos >= end) {
+            break;
+        }
+        unsigned char statusByte = data[pos++];
+        if (statusByte < 0x80) {
+            pos--; // running status
+            statusByte = runningStatus;
+        }
+        if (statusByte == 0xF0 || statusByte == 0xF7) {
+            pos += readVariableLength(data, end, pos);
+            continue;
+        }
+        if (statusByte == 0xFF) {
+            if (pos >= end) {
+                break;
+            }
+            unsigned char metaType = data[pos++];
+            unsigned int metaLength = readVariableLength(data, end, pos);
+            if (metaType == 0x03) {
+                track.nameLength += metaLength; // each name may need its own buffer
+            }
+            else if (metaType == 0x58 && metaLength == 4) {
+                track.timeSignatures++;
+                if (pos + 3 < end) {
+                    song_grid_offer(track.grid, currentTick, data[pos + 3]);
+                }
+            }
+            pos += metaLength;
+            continue;
+        }
+        runningStatus = statusByte;
+        switch (statusByte & 0xF0) {
+        case 0x90:
+            if (pos + 1 < end && data[pos + 1] != 0) {
+                track.notes++;
+            }
+            if (currentTick > track.maxTick) {
+                track.maxTick = currentTick;
+            }
+            pos += 2;
+            break;
+        case 0xB0:
+            track.controlChanges++;
+            if (currentTick > track.maxTick) {
+                track.maxTick = currentTick;
+            }
+            pos += 2;
+            break;
+        case 0x80:
+            if (currentTick > track.maxTick) {
+                track.maxTick = currentTick;
+            }
+            pos += 2;
+            break;
+        case 0xA0:
+        case 0xE0:
+            pos += 2;
+            break;
+        case 0xC0:
+        case 0xD0:
+            pos += 1;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// Walk the header and track chunks of a downloaded song and work out how much
+// arena it needs, without storing any events. The per-track counts are kept
+// in the arena so the loader can reserve each container to its final size.
+bool measureSong(const unsigned char* bytes, size_t size, SongArena& arena, SongSizing& sizing) {
+    arena_reset(arena);
+    if (size < 14 || memcmp(bytes, "MThd", 4) != 0) {
+        return false;
+    }
+    unsigned int headerChunkSize = bigEndianToHost(const_cast<unsigned char*>(bytes + 4), 4);
+    if (headerChunkSize < 6) {
+        return false;
+    }
+    sizing.numTracks = bigEndianToHostShort(const_cast<unsigned char*>(bytes + 10));
+    sizing.division = bigEndianToHostShort(const_cast<unsigned char*>(bytes + 12));
+
+    sizing.tracks = static_cast<TrackSizing*>(arena_alloc(arena, sizing.numTracks * sizeof(TrackSizing), alignof(TrackSizing)));
+    if (sizing.numTracks > 0 && sizing.tracks == nullptr) {
+        return false;
+    }
+
+    // Every container gets one allocation; allow for its alignment padding
+    const size_t slack = 2 * sizeof(double);
+    size_t total = sizing.numTracks * sizeof(Track) + slack;
+    sizing.timeSignatures = 0;
+    sizing.grid = SongGrid();
+    size_t notes = 0;
+    int maxTick = 0;
+    size_t pos = 8 + headerChunkSize;
+    for (int t = 0; t < sizing.numTracks; t++) {
+        TrackSizing& track = sizing.tracks[t];
+        track = TrackSizing();
+        if (pos + 8 > size || memcmp(bytes + pos, "MTrk", 4) != 0) {
+            return false;
+        }
+        size_t chunkSize = bigEndianToHost(const_cast<unsigned char*>(bytes + pos + 4), 4);
+        size_t chunkEnd = pos + 8 + chunkSize;
+        if (chunkEnd > size) {
+            chunkEnd = size;
+        }
+        measureTrackEvents(bytes, pos + 8, chunkEnd, track);
+        pos = chunkEnd;
+
+        total += track.notes * sizeof(Note) + slack;
+        notes += track.notes;
+        total += track.controlChanges * sizeof(ControlChange) + slack;
+        total += track.nameLength + 1 + slack;
+        sizing.timeSignatures += track.timeSignatures;
+        song_grid_offer(sizing.grid, track.grid.tick, track.grid.thirtysecondNotes);
+
+        if (track.maxTick > maxTick) {
+            maxTick = track.maxTick;
+        }
+    }
+
+    // One frame per grid step up to the last event (rounded up, plus a
+    // step for notes that never end)
+    int step = song_grid_step(sizing.grid, sizing.division);
+    total += (maxTick / step + 2) * sizeof(LedFrame) + slack;
+    total += sizing.timeSignatures * sizeof(TimeSignature) + slack;
+    // buildFrames() merges the tracks through a heap in the arena too
+    total += (event_merge_entries(sizing.numTracks, notes) + 1) * sizeof(uint64_t) + slack;
+    sizing.bytes = total;
+    return true;
+}
+
+bool measureSong(const std::string& data, SongArena& arena, SongSizing& sizing) {
+    return measureSong(reinterpret_cast<const unsigned char*>(data.data()), data.size(), arena, sizing);
+}
+
+// Walk one track chunk and hand every meta event to metaEvent(tick, type,
+// payload, length). Channel events and SysEx are skipped by their length,
+// so nothing is stored per note. Returns the tick the chunk ends on.
+template <typename MetaHandler>
+static int forEachMetaEvent(const unsigned char* data, size_t pos, size_t end, MetaHandler metaEvent) {
+    int currentTick = 0;
+    unsigned char runningStatus = 0;
+    while (pos < end) {
+        currentTick += readVariableLength(data, end, pos);
+        if (pos >= end) {
+            break;
+        }
+        unsigned char statusByte = data[pos++];
+        if (statusByte < 0x80) {
+            pos--; // running status
+            statusByte = runningStatus;
+        }
+        if (statusByte == 0xFF) {
+            if (pos >= end) {
+                break;
+            }
+            unsigned char metaType = data[pos++];
+            unsigned int metaLength = readVariableLength(data, end, pos);
+            if (pos + metaLength > end) {
+                break;
+            }
+            metaEvent(currentTick, metaType, data + pos, metaLength);
+            pos += metaLength;
+        }
+        else if (statusByte == 0xF0 || statusByte == 0xF7) {
+            pos += readVariableLength(data, end, pos);
+        }
+        else {
+            runningStatus = statusByte;
+            unsigned char kind = statusByte & 0xF0;
+            pos += (kind == 0xC0 || kind == 0xD0) ? 1 : (kind >= 0x80 ? 2 : 0);
+        }
+    }
+    return currentTick;
+}
+
+// Metadata-only parse for listing and previewing songs: track names, tempo
+// map, time and key signatures, and where each track ends. Notes and
+// control changes are never touched, so this costs one pass over the bytes
+// to count and one to fill, with a few hundred bytes of arena. Resets the
+// arena like measureSong().
+bool scanSong(const unsigned char* bytes, size_t size, SongArena& arena, MidiData& midiData) {
+    arena_reset(arena);
+    if (size < 14 || memcmp(bytes, "MThd", 4) != 0) {
+        return false;
+    }
+    unsigned int headerChunkSize = bigEndianToHost(const_cast<unsigned char*>(bytes + 4), 4);
+    unsigned short numTracks = bigEndianToHostShort(const_cast<unsigned char*>(bytes + 10));
+    midiData.division = bigEndianToHostShort(const_cast<unsigned char*>(bytes + 12));
+
+    // First pass: count, so every vector is reserved once
+    size_t tempos = 0, timeSignatures = 0, keySignatures = 0;
+    size_t pos = 8 + headerChunkSize;
+    int tracks = 0;
+    for (; tracks < numTracks && pos + 8 <= size && memcmp(bytes + pos, "MTrk", 4) == 0; tracks++) {
+        size_t chunkEnd = std::min(size, pos + 8 + bigEndianToHost(const_cast<unsigned char*>(bytes + pos + 4), 4));
+        forEachMetaEvent(bytes, pos + 8, chunkEnd, [&](int, unsigned char type, const unsigned char*, unsigned int length) {
+            tempos += type == 0x51 && length == 3;
+            timeSignatures += type == 0x58 && length == 4;
+            keySignatures += type == 0x59 && length == 2;
+        });
+        pos = chunkEnd;
+    }
+    if (!arena_reserve(midiData.tracks, tracks) || !arena_reserve(midiData.tempos, tempos) ||
+        !arena_reserve(midiData.timeSignatures, timeSignatures) || !arena_reserve(midiData.keySignatures, keySignatures)) {
+        return false;
+    }
+
+    // Second pass: fill
+    pos = 8 + headerChunkSize;
+    for (int t = 0; t < tracks; t++) {
+        size_t chunkEnd = std::min(size, pos + 8 + bigEndianToHost(const_cast<unsigned char*>(bytes + pos + 4), 4));
+        midiData.tracks.emplace_back(arena);
+        Track& track = midiData.tracks.back();
+        int lastTick = forEachMetaEvent(bytes, pos + 8, chunkEnd, [&](int tick, unsigned char type, const unsigned char* payload, unsigned int length) {
+            if (type == 0x03 && track.name.empty() && arena_reserve(track.name, length)) {
+                track.name.assign(reinterpret_cast<const char*>(payload), length);
+            }
+            else if (type == 0x51 && length == 3) {
+                Tempo tempo;
+                tempo.ticks = tick;
+                tempo.microsecondsPerQuarterNote = (payload[0] << 16) | (payload[1] << 8) | payload[2];
+                tempo.bpm = tempo.microsecondsPerQuarterNote > 0 ? 60000000 / tempo.microsecondsPerQuarterNote : 0;
+                track.tempoQuarterNote = tempo.microsecondsPerQuarterNote;
+                midiData.tempos.push_back(tempo);
+            }
+            else if (type == 0x58 && length == 4) {
+                TimeSignature signature;
+                signature.ticks = tick;
+                signature.numerator = payload[0];
+                signature.denominator = 1 << (payload[1] & 0x07);
+                signature.measures = 0;
+                track.timeSignatureNumerator = signature.numerator;
+                track.timeSignatureDenominator = signature.denominator;
+                song_grid_offer(track.grid, tick, payload[3]);
+                midiData.timeSignatures.push_back(signature);
+            }
+            else if (type == 0x59 && length == 2) {
+                KeySignature signature;
+                signature.key = static_cast<char>(payload[0]);
+                signature.scale = payload[1] ? "minor" : "major";
+                signature.ticks = tick;
+                track.keySignatureSharps = static_cast<signed char>(payload[0]);
+                track.keySignatureMinor = payload[1] != 0;
+                midiData.keySignatures.push_back(signature);
+            }
+            else if (type == 0x2F) {
+                track.endOfTrackTicks = tick;
+            }
+        });
+        track.maxTick = lastTick;
+        song_grid_offer(midiData.grid, track.grid.tick, track.grid.thirtysecondNotes);
+        pos = chunkEnd;
+    }
+
+    // Tracks are scanned one after another; put each map back in song order
+    std::stable_sort(midiData.tempos.begin(), midiData.tempos.end(), [](const Tempo& a, const Tempo& b) { return a.ticks < b.ticks; });
+    std::stable_sort(midiData.timeSignatures.begin(), midiData.timeSignatures.end(), [](const TimeSignature& a, const TimeSignature& b) { return a.ticks < b.ticks; });
+    std::stable_sort(midiData.keySignatures.begin(), midiData.keySignatures.end(), [](const KeySignature& a, const KeySignature& b) { return a.ticks < b.ticks; });
+    for (const Tempo& tempo : midiData.tempos) {
+        if (tempo.microsecondsPerQuarterNote > 0) {
+            midiData.usPerQuarter = tempo.microsecondsPerQuarterNote;
+            break;
+        }
+    }
+
+    // Bar number each time signature starts on (4/4 until the first one)
+    int measures = 0, lastTicks = 0, numerator = 4, denominator = 4;
+    for (TimeSignature& signature : midiData.timeSignatures) {
+        int ticksPerBar = midiData.division * 4 * numerator / denominator;
+        if (ticksPerBar > 0) {
+            measures += (signature.ticks - lastTicks + ticksPerBar - 1) / ticksPerBar;
+        }
+        signature.measures = measures;
+        lastTicks = signature.ticks;
+        numerator = signature.numerator > 0 ? signature.numerator : 4;
+        denominator = signature.denominator;
+    }
+    return tracks > 0;
+}
+
+// Song length in milliseconds as the player plays it: all at the first
+// tempo, since later tempo changes aren't followed yet
+unsigned long songDurationMs(const MidiData& midiData) {
+    int lastTick = 0;
+    for (const Track& track : midiData.tracks) {
+        lastTick = std::max(lastTick, std::max(track.endOfTrackTicks, track.maxTick));
+    }
+    if (midiData.division <= 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(lastTick) * midiData.usPerQuarter / midiData.division / 1000;
+}
+
+// One line about a scanned song: title, tempo, signatures and length
+template <typename Output>
+void printSongInfo(const MidiData& midiData, Output& out) {
+    out.print("Song: ");
+    for (const Track& track : midiData.tracks) {
+        if (!track.name.empty()) {
+            out.print(track.name.c_str());
+            break;
+        }
+    }
+    out.print(", ");
+    out.print(60000000 / midiData.usPerQuarter);
+    out.print(" bpm, ");
+    out.print(midiData.timeSignatures.empty() ? 4 : midiData.timeSignatures[0].numerator);
+    out.print("/");
+    out.print(midiData.timeSignatures.empty() ? 4 : midiData.timeSignatures[0].denominator);
+    if (!midiData.keySignatures.empty()) {
+        out.print(", ");
+        out.print(static_cast<int>(midiData.keySignatures[0].key));
+        out.print(" sharps ");
+        out.print(midiData.keySignatures[0].scale);
+    }
+    unsigned long seconds = songDurationMs(midiData) / 1000;
+    out.print(", ");
+    out.print(seconds / 60);
+    out.print(seconds % 60 < 10 ? ":0" : ":");
+    out.println(seconds % 60);
+}
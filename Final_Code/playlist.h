@@ -0,0 +1,149 @@
+#pragma once
+
+// Playlist mode: while one song is on the LEDs, the next one is fetched from
+// the server and primed on the other core, so lessons run back to back.
+//
+// Two slots alternate. The fetch task downloads a song into its slot's
+// SPIFFS file and opens a FrameStream on it, which decodes the first window
+// of frames. By the time the playing song ends the next one only has to
+// hand over its ring, well inside one frame period. Songs come over the
+// shared session (session.h); a NOT_FOUND reply or a lost session ends the
+// playlist.
+
+#include <stdint.h>
+#include <atomic>
+#include <WiFi.h>
+#include <SPIFFS.h>
+#include "frame_stream.h"
+#include "lz_stream.h"
+#include "session.h"
+
+#define PLAYLIST_SLOTS 2
+#define FETCH_TIMEOUT_MS 2000 // give up on a reply that stops arriving for this long
+
+enum SongSlotState {
+    SLOT_EMPTY = 0, // nothing queued
+    SLOT_LOADING,   // fetch task is downloading / priming
+    SLOT_READY,     // stream is open with its first frames decoded
+    SLOT_END        // server had no song for us: the playlist is over
+};
+
+struct SongSlot {
+    const char* path;
+    FrameStream stream;
+    std::atomic<int> state{SLOT_EMPTY};
+    uint32_t bytes = 0; // size of the last download
+};
+
+struct Playlist {
+    SongSlot slots[PLAYLIST_SLOTS];
+    int current = 0;    // slot that plays next
+    int fetching = 0;   // slot the fetch task is filling
+    Session* session = nullptr;
+    uint32_t songsPlayed = 0;
+    SongTransfer transfer; // only the fetch task uses it
+};
+
+// One download into a slot's file, as the session hands the reply over
+struct SongFetch {
+    File file;
+    SongTransfer* transfer;
+    uint32_t total;
+    bool ok;
+
+    // decoded song bytes, for song_transfer_feed()
+    void operator()(const uint8_t* bytes, size_t count)
+    {
+        file.write(bytes, count);
+        total += count;
+    }
+};
+
+static void fetch_song_store(void* context, const uint8_t* data, size_t length)
+{
+    SongFetch& fetch = *static_cast<SongFetch*>(context);
+    fetch.ok = song_transfer_feed(*fetch.transfer, data, length, fetch) && fetch.ok;
+}
+
+// GET the next song over the session into a SPIFFS file, decompressing it on
+// the way if the server sent it compressed. Returns its size, 0 if the
+// session is down, the server had nothing to send, or the stream was broken.
+static uint32_t fetch_song(Session& session, const char* path, SongTransfer& transfer)
+{
+    SongFetch fetch;
+    fetch.file = SPIFFS.open(path, "w");
+    if (!fetch.file)
+    {
+        return 0;
+    }
+    fetch.transfer = &transfer;
+    fetch.total = 0;
+    fetch.ok = true;
+    song_transfer_begin(transfer);
+    const uint8_t options = SESSION_GET_COMPRESSED;
+    int slot = session_request(session, SESSION_GET, &options, 1, fetch_song_store, &fetch);
+    uint8_t status = session_wait(session, slot, FETCH_TIMEOUT_MS);
+    fetch.ok = song_transfer_end(transfer, fetch) && fetch.ok;
+    fetch.file.close();
+    return status == SESSION_OK && fetch.ok ? fetch.total : 0;
+}
+
+static void playlist_fetch(Playlist& p, SongSlot& slot)
+{
+    slot.bytes = fetch_song(*p.session, slot.path, p.transfer);
+    if (slot.bytes > 0 && frame_stream_open(slot.stream, slot.path))
+    {
+        slot.state.store(SLOT_READY);
+    }
+    else
+    {
+        slot.state.store(SLOT_END);
+    }
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+static void playlist_fetch_task(void* arg)
+{
+    Playlist* p = static_cast<Playlist*>(arg);
+    playlist_fetch(*p, p->slots[p->fetching]);
+    vTaskDelete(NULL);
+}
+#endif
+
+// Remember where songs come from and name each slot's file. A fetch still
+// filling a slot is waited for first, so its slot is never reset under it.
+void playlist_init(Playlist& p, Session& session)
+{
+    for (int s = 0; s < PLAYLIST_SLOTS; s++)
+    {
+        while (p.slots[s].state.load() == SLOT_LOADING)
+        {
+            delay(1);
+        }
+    }
+    static const char* const paths[PLAYLIST_SLOTS] = { "/song0.mid", "/song1.mid" };
+    p.session = &session;
+    p.current = 0;
+    p.fetching = 0;
+    for (int s = 0; s < PLAYLIST_SLOTS; s++)
+    {
+        p.slots[s].path = paths[s];
+        p.slots[s].state.store(SLOT_EMPTY);
+    }
+}
+
+// Start fetching the next song into the given slot in the background
+void playlist_prefetch(Playlist& p, int slot)
+{
+    p.fetching = slot;
+    p.slots[slot].state.store(SLOT_LOADING);
+#if defined(ARDUINO_ARCH_ESP32)
+    // Core 0 does the networking and decoding; core 1 keeps the display going
+    if (xTaskCreatePinnedToCore(playlist_fetch_task, "fetch", 6144, &p, 1, NULL, 0) != pdPASS)
+    {
+        playlist_fetch(p, p.slots[slot]);
+    }
+#else
+    playlist_fetch(p, p.slots[slot]);
+#endif
+}
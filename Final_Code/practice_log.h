@@ -0,0 +1,410 @@
+#pragma once
+
+// Practice telemetry: how every note of a session was played, for the
+// server to keep per student. The records are in practice_record.h.
+//
+// The grader compares the keys pressed with the notes on the display: a
+// note starts wherever a key lights up or changes brightness (a strike
+// under the pedal at the same velocity doesn't show, so it isn't graded).
+// A note is due when its frame reaches the bottom LED row; a press of its
+// key within PRACTICE_WINDOW_MS of that is a hit, a note nobody plays in
+// time is a miss, and a press with no note waiting is an extra. Each becomes one
+// fixed 16-byte PracticeRecord, appended to a RAM ring with a few stores,
+// so grading never holds up a frame.
+//
+// The ring goes to a SPIFFS file a page (PRACTICE_LOG_BLOCK records) at a
+// time, written by a low-priority task on core 0 on the ESP32 and from
+// practice_log_poll() on the host build. While the player is idle,
+// practice_log_upload() sends the file as SESSION_LOG batches, LZ
+// compressed (lz_stream.h) when that makes them smaller, and deletes it
+// once the server has all of it. When the ring or the file is full,
+// records are dropped and counted, never waited for.
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <SPIFFS.h>
+#include "logger.h"
+#include "keyboard_geometry.h"
+#include "lz_stream.h"
+#include "session.h"
+#include "practice_record.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+#define PRACTICE_WINDOW_MS 250          // how far off a press can be and still play its note
+#define PRACTICE_LOG_SLOTS 128          // records the RAM ring holds, power of two
+#define PRACTICE_LOG_BLOCK 16           // records per SPIFFS write: one 256-byte page
+#define PRACTICE_LOG_FLUSH_MS 100       // how often the ESP32 flush task looks at the ring
+#define PRACTICE_LOG_MAX_BYTES (64 * 1024) // the file stops growing here until it is uploaded
+#define PRACTICE_UPLOAD_BATCH 2048      // record bytes per SESSION_LOG, before compression
+#define PRACTICE_UPLOAD_TIMEOUT_MS 2000
+#define PRACTICE_UPLOAD_RETRY_MS 10000  // wait after a failed batch
+#define PRACTICE_LOG_PATH "/practice.log"   // what the flush appends to
+#define PRACTICE_UPLOAD_PATH "/practice.up" // what is being uploaded
+
+static_assert(PRACTICE_UPLOAD_BATCH % sizeof(PracticeRecord) == 0 && PRACTICE_UPLOAD_BATCH <= LZ_WINDOW,
+              "a batch is whole records a match can reach across");
+
+// A note on its way down the display that hasn't been played yet
+struct PracticeNote {
+    uint32_t frame;
+    uint64_t dueUs;
+    uint8_t level;
+    uint8_t chord;
+};
+
+struct PracticeLog {
+    // grading, only the player touches it
+    PracticeNote notes[KeyFrame::keys];
+    KeyFrame waiting;              // keys with a note nobody has played yet
+    LedFrame shown;                // the last frame graded
+    uint32_t frame = 0;            // song frame on screen
+    uint64_t startUs = 0;          // when the song started
+    bool playing = false;
+
+    // the ring: the player appends, the flush takes whole blocks
+    PracticeRecord ring[PRACTICE_LOG_SLOTS];
+    std::atomic<uint32_t> head{0}; // records written, only the player moves it
+    std::atomic<uint32_t> tail{0}; // records flushed, only the flush moves it
+    std::atomic<bool> flushAll{false}; // write the last part block too
+    std::atomic<uint32_t> dropped{0};
+    std::atomic<bool> taskRunning{false};
+
+    std::mutex fileLock;           // the flush appends while an upload takes the file
+    uint32_t fileBytes = 0;        // whole records in PRACTICE_LOG_PATH
+    bool fileFull = false;         // a write came up short: no more until it is uploaded
+
+    // uploads, from the idle loop
+    int request = -1;              // session slot of the batch out, -1 when none
+    uint32_t uploadBytes = 0;      // in PRACTICE_UPLOAD_PATH, 0 when there is none
+    uint32_t uploaded = 0;         // of those, bytes the server has
+    uint32_t batchBytes = 0;       // record bytes in the batch out
+    unsigned long failedAt = 0;
+    bool failed = false;
+    uint32_t sentRecords = 0;
+    uint32_t sentBytes = 0;        // on the wire, after compression
+    LzEncoder encoder;
+    uint8_t batch[PRACTICE_UPLOAD_BATCH];
+    uint8_t packed[LZ_HEADER_BYTES + PRACTICE_UPLOAD_BATCH + PRACTICE_UPLOAD_BATCH / 8 + 1];
+};
+
+// One record into the ring, or counted as dropped if it is full
+static inline void practice_append(PracticeLog& log, uint8_t kind, uint32_t frame, uint32_t timeUs, int32_t deltaUs,
+                                   uint8_t key, uint8_t level, uint8_t chord)
+{
+    uint32_t head = log.head.load(std::memory_order_relaxed);
+    if (head - log.tail.load(std::memory_order_acquire) == PRACTICE_LOG_SLOTS)
+    {
+        log.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    log.ring[head & (PRACTICE_LOG_SLOTS - 1)] = PracticeRecord{ frame, timeUs, deltaUs, key, level, chord, kind };
+    log.head.store(head + 1, std::memory_order_release);
+}
+
+static inline uint32_t practice_since_start(const PracticeLog& log, uint64_t nowUs)
+{
+    return static_cast<uint32_t>(nowUs - log.startUs);
+}
+
+// Write whole blocks from the ring to the file, and the part block left
+// once a song has ended. Only one task may flush.
+static void practice_log_flush(PracticeLog& log)
+{
+    bool all = log.flushAll.exchange(false);
+    for (;;)
+    {
+        uint32_t tail = log.tail.load(std::memory_order_relaxed);
+        uint32_t count = log.head.load(std::memory_order_acquire) - tail;
+        if (count == 0 || (count < PRACTICE_LOG_BLOCK && !all))
+        {
+            return;
+        }
+        if (count > PRACTICE_LOG_BLOCK)
+        {
+            count = PRACTICE_LOG_BLOCK;
+        }
+        PracticeRecord block[PRACTICE_LOG_BLOCK];
+        for (uint32_t r = 0; r < count; r++)
+        {
+            block[r] = log.ring[(tail + r) & (PRACTICE_LOG_SLOTS - 1)];
+        }
+        log.tail.store(tail + count, std::memory_order_release); // the player can have the slots back
+
+        std::lock_guard<std::mutex> guard(log.fileLock);
+        size_t bytes = count * sizeof(PracticeRecord);
+        size_t wrote = 0;
+        if (!log.fileFull && log.fileBytes + bytes <= PRACTICE_LOG_MAX_BYTES)
+        {
+            File file = SPIFFS.open(PRACTICE_LOG_PATH, "a");
+            if (file)
+            {
+                wrote = file.write(reinterpret_cast<const uint8_t*>(block), bytes);
+                file.close();
+            }
+        }
+        // SPIFFS filled up mid-block: a part record ends the file, and the
+        // upload stops short of it
+        log.fileFull = log.fileFull || (wrote > 0 && wrote < bytes);
+        log.fileBytes += wrote - wrote % sizeof(PracticeRecord);
+        log.dropped.fetch_add(count - wrote / sizeof(PracticeRecord), std::memory_order_relaxed);
+    }
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+static void practice_log_task(void* arg)
+{
+    PracticeLog* log = static_cast<PracticeLog*>(arg);
+    for (;;)
+    {
+        practice_log_flush(*log); // SPIFFS writes wait here, never on core 1
+        vTaskDelay(pdMS_TO_TICKS(PRACTICE_LOG_FLUSH_MS));
+    }
+}
+#endif
+
+static inline uint32_t practice_file_size(const char* path)
+{
+    if (!SPIFFS.exists(path))
+    {
+        return 0;
+    }
+    File file = SPIFFS.open(path, "r");
+    uint32_t size = file ? file.size() : 0;
+    file.close();
+    return size - size % sizeof(PracticeRecord);
+}
+
+// Pick up whatever an earlier run left to upload and, on the ESP32, start
+// the flush task. Call after SPIFFS.begin().
+void practice_log_begin(PracticeLog& log)
+{
+    log.fileBytes = practice_file_size(PRACTICE_LOG_PATH);
+    log.uploadBytes = practice_file_size(PRACTICE_UPLOAD_PATH);
+    log.uploaded = 0; // a batch the server had already taken may go twice
+    if (log.fileBytes + log.uploadBytes > 0)
+    {
+        LOG_INFO(SESSION, "%lu bytes of practice log to upload", static_cast<unsigned long>(log.fileBytes + log.uploadBytes));
+    }
+#if defined(ARDUINO_ARCH_ESP32)
+    log.taskRunning.store(xTaskCreatePinnedToCore(practice_log_task, "practice", 3072, &log, tskIDLE_PRIORITY, NULL, 0) == pdPASS);
+#endif
+}
+
+// Flush the ring, unless the task does it
+void practice_log_poll(PracticeLog& log)
+{
+    if (!log.taskRunning.load(std::memory_order_relaxed))
+    {
+        practice_log_flush(log);
+    }
+}
+
+// A song starts: grading begins from its first frame
+void practice_song(PracticeLog& log, uint32_t frames, uint32_t usPerQuarter, int speedPercent, uint64_t nowUs)
+{
+    log.waiting.reset();
+    log.shown = LedFrame();
+    log.frame = 0;
+    log.startUs = nowUs;
+    log.playing = true;
+    practice_append(log, PRACTICE_SONG, frames, millis(), static_cast<int32_t>(usPerQuarter), speedPercent, 0, 0);
+}
+
+void practice_speed(PracticeLog& log, int speedPercent, uint64_t nowUs)
+{
+    if (log.playing)
+    {
+        practice_append(log, PRACTICE_SPEED, log.frame, practice_since_start(log, nowUs), 0, speedPercent, 0, 0);
+    }
+}
+
+static inline void practice_miss(PracticeLog& log, int key, uint64_t nowUs)
+{
+    const PracticeNote& note = log.notes[key];
+    practice_append(log, PRACTICE_MISS, note.frame, practice_since_start(log, nowUs), 0, key, note.level, note.chord);
+    log.waiting.reset(key);
+}
+
+// A frame goes up: the keys that light or change level in it are notes to
+// play, due when it reaches the bottom row at dueUs. A key still waiting from an earlier
+// note has missed that one.
+void practice_frame(PracticeLog& log, const LedFrame& frame, uint32_t songFrame, uint64_t dueUs, uint64_t nowUs)
+{
+    KeyFrame changed;
+    for (int b = 0; b < LED_LEVEL_BITS; b++)
+    {
+        changed |= frame.plane[b] ^ log.shown.plane[b];
+    }
+    KeyFrame struck = changed & frame.lit();
+    log.shown = frame;
+    log.frame = songFrame;
+    if (struck.none())
+    {
+        return;
+    }
+    uint8_t chord = static_cast<uint8_t>(struck.count());
+    for (int key : struck)
+    {
+        if (log.waiting.test(key))
+        {
+            practice_miss(log, key, nowUs);
+        }
+        log.notes[key] = PracticeNote{ songFrame, dueUs, static_cast<uint8_t>(frame.level(key)), chord };
+    }
+    log.waiting |= struck;
+}
+
+// Keys that went down at nowUs
+void practice_keys(PracticeLog& log, const KeyFrame& pressed, uint64_t nowUs)
+{
+    if (!log.playing)
+    {
+        return;
+    }
+    const uint64_t window = PRACTICE_WINDOW_MS * 1000ULL;
+    for (int key : pressed)
+    {
+        const PracticeNote& note = log.notes[key];
+        if (log.waiting.test(key) && nowUs + window >= note.dueUs && nowUs <= note.dueUs + window)
+        {
+            practice_append(log, PRACTICE_HIT, note.frame, practice_since_start(log, nowUs),
+                            static_cast<int32_t>(nowUs - note.dueUs), key, note.level, note.chord);
+            log.waiting.reset(key);
+        }
+        else
+        {
+            practice_append(log, PRACTICE_EXTRA, log.frame, practice_since_start(log, nowUs), 0, key, 0, 0);
+        }
+    }
+}
+
+// Give up on notes more than the window past due
+void practice_expire(PracticeLog& log, uint64_t nowUs)
+{
+    const uint64_t window = PRACTICE_WINDOW_MS * 1000ULL;
+    for (int key : log.waiting)
+    {
+        if (nowUs > log.notes[key].dueUs + window)
+        {
+            practice_miss(log, key, nowUs);
+        }
+    }
+}
+
+// The song is over: whatever is still waiting was missed, and the flush
+// writes out the rest of the ring
+void practice_song_end(PracticeLog& log, uint64_t nowUs)
+{
+    if (!log.playing)
+    {
+        return;
+    }
+    for (int key : log.waiting)
+    {
+        practice_miss(log, key, nowUs);
+    }
+    log.playing = false;
+    log.flushAll.store(true);
+}
+
+static inline void practice_upload_done(PracticeLog& log)
+{
+    SPIFFS.remove(PRACTICE_UPLOAD_PATH);
+    log.uploadBytes = 0;
+    log.uploaded = 0;
+}
+
+// Send the next batch of the log, or collect the answer to the last one.
+// Call while idle: it never waits, and only one batch is out at a time.
+void practice_log_upload(PracticeLog& log, Session& session)
+{
+    if (log.request >= 0)
+    {
+        if (!session_done(session, log.request, PRACTICE_UPLOAD_TIMEOUT_MS))
+        {
+            return;
+        }
+        uint8_t status = session_finish(session, log.request);
+        log.request = -1;
+        if (status != SESSION_OK)
+        {
+            LOG_WARN(SESSION, "Practice log upload failed, retrying in %d s", PRACTICE_UPLOAD_RETRY_MS / 1000);
+            log.failed = true;
+            log.failedAt = millis();
+            return;
+        }
+        log.uploaded += log.batchBytes;
+        log.sentRecords += log.batchBytes / sizeof(PracticeRecord);
+        if (log.uploaded >= log.uploadBytes)
+        {
+            practice_upload_done(log);
+        }
+        return;
+    }
+    if (!session.connected.load() || (log.failed && millis() - log.failedAt < PRACTICE_UPLOAD_RETRY_MS))
+    {
+        return;
+    }
+    log.failed = false;
+    if (log.uploadBytes == 0)
+    {
+        // take what has been logged so far; the flush starts a new file
+        std::lock_guard<std::mutex> guard(log.fileLock);
+        if (log.fileBytes == 0 || !SPIFFS.rename(PRACTICE_LOG_PATH, PRACTICE_UPLOAD_PATH))
+        {
+            return;
+        }
+        log.uploadBytes = log.fileBytes;
+        log.uploaded = 0;
+        log.fileBytes = 0;
+        log.fileFull = false;
+    }
+
+    File file = SPIFFS.open(PRACTICE_UPLOAD_PATH, "r");
+    uint32_t length = log.uploadBytes - log.uploaded;
+    if (length > PRACTICE_UPLOAD_BATCH)
+    {
+        length = PRACTICE_UPLOAD_BATCH;
+    }
+    if (!file || !file.seek(log.uploaded) || file.read(log.batch, length) != length)
+    {
+        LOG_WARN(SESSION, "Practice log on SPIFFS is unreadable, dropping it");
+        file.close();
+        practice_upload_done(log);
+        return;
+    }
+    file.close();
+
+    // records are mostly small numbers and repeated keys: they squeeze well
+    size_t packed = lz_compress(log.encoder, log.batch, length, log.packed, sizeof(log.packed));
+    bool squeezed = packed > 0 && packed < length;
+    const uint8_t* payload = squeezed ? log.packed : log.batch;
+    size_t bytes = squeezed ? packed : length;
+    log.request = session_request(session, SESSION_LOG, payload, bytes, nullptr, nullptr);
+    if (log.request >= 0)
+    {
+        log.batchBytes = length;
+        log.sentBytes += bytes;
+    }
+}
+
+// Records kept and sent, for STAT
+template <typename Output>
+void practice_log_report(PracticeLog& log, Output& out)
+{
+    out.print("practice log: ");
+    out.print(static_cast<unsigned long>(log.sentRecords));
+    out.print(" records sent in ");
+    out.print(static_cast<unsigned long>(log.sentBytes));
+    out.print(" bytes, ");
+    out.print(static_cast<unsigned long>((log.fileBytes + log.uploadBytes - log.uploaded) / sizeof(PracticeRecord)));
+    out.print(" waiting, ");
+    out.print(static_cast<unsigned long>(log.dropped.load(std::memory_order_relaxed)));
+    out.println(" dropped");
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+// One practice telemetry record: how a note was played. The device logs
+// them (practice_log.h) and uploads them in SESSION_LOG batches;
+// tools/session_server.cpp and song_server.py store them.
+//
+// Records are fixed size and little-endian (which both the ESP32 and the
+// host are). What the fields hold depends on the kind:
+//
+//   kind            frame               timeUs                   deltaUs         key      level, chord
+//   PRACTICE_SONG   frames in the song  millis() at its start    us per quarter  speed %  0, 0
+//   PRACTICE_SPEED  frame on screen     us since the song start  0               speed %  0, 0
+//   PRACTICE_HIT    frame of the note   when the key went down   press - due     key      note's level, keys
+//   PRACTICE_MISS   frame of the note   when it was given up     0               key      struck on that frame
+//   PRACTICE_EXTRA  frame on screen     when the key went down   0               key      0, 0
+//
+// A key is a frame index (keyboard_geometry.h), not a MIDI note. A missed
+// chord is the misses that share a frame whose chord is above 1.
+
+#include <stdint.h>
+
+enum PracticeRecordKind {
+    PRACTICE_SONG = 1,
+    PRACTICE_SPEED,
+    PRACTICE_HIT,
+    PRACTICE_MISS,
+    PRACTICE_EXTRA
+};
+
+struct PracticeRecord {
+    uint32_t frame;
+    uint32_t timeUs;
+    int32_t deltaUs;
+    uint8_t key;
+    uint8_t level;
+    uint8_t chord;
+    uint8_t kind;  // PRACTICE_*
+};
+
+static_assert(sizeof(PracticeRecord) == 16, "records are sent as raw bytes");
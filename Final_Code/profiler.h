@@ -0,0 +1,253 @@
+#pragma once
+
+// Hot-path probes for the playback firmware.
+//
+// Each probe keeps a count, min, max, sum and a log-linear histogram of
+// CPU cycles in fixed RAM, so recording a sample is a handful of integer ops
+// and never touches Serial. Results are only formatted when someone asks
+// for them (the 'p' serial command, or a STAT request over the session).
+//
+// Define PIANOHERO_PROFILE to 0 before including this file to compile every
+// PROFILE_* macro down to nothing.
+
+#ifndef PIANOHERO_PROFILE
+#define PIANOHERO_PROFILE 1
+#endif
+
+#include <stdint.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <Arduino.h>
+#else
+#include <chrono>
+#endif
+
+enum ProfileProbe {
+    PROBE_DOWNLOAD = 0,  // whole song transfer from the server
+    PROBE_PARSE,         // header + track chunks into MidiData
+    PROBE_BITMAP,        // note/pedal sweep into frames
+    PROBE_DISPLAY,       // one waterfall_display() refresh
+    PROBE_CYCLE,         // one cycle() row advance
+    PROBE_READSR,        // one readSR() keyboard scan
+    PROBE_FRAME_JITTER,  // how late a frame advanced past its deadline
+    PROBE_KEY_LATENCY,   // key seen by readSR() until the next LED latch
+    PROBE_COUNT
+};
+
+#if PIANOHERO_PROFILE
+
+// 2 sub-bucket bits: every power of two is split in 4, so a percentile read
+// back from the histogram is within 25% of the real sample.
+#define PROFILE_SUB_BITS 2
+#define PROFILE_SUB_COUNT (1 << PROFILE_SUB_BITS)
+#define PROFILE_BUCKETS ((32 - PROFILE_SUB_BITS + 1) * PROFILE_SUB_COUNT)
+
+struct ProfileHistogram {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[PROFILE_BUCKETS];
+};
+
+static ProfileHistogram profileData[PROBE_COUNT];
+static uint32_t keyPressStamp = 0;   // cycle count of the oldest unanswered key press
+static bool keyPressPending = false;
+
+static const char* const profileNames[PROBE_COUNT] = {
+    "download", "parse", "bitmap", "display", "cycle", "readSR", "frame jitter", "key->LED"
+};
+
+// Read the free running CPU cycle counter
+static inline uint32_t profile_cycles()
+{
+#if defined(ARDUINO_ARCH_ESP32)
+    return ESP.getCycleCount();
+#else
+    // Host builds: count nanoseconds and pretend the CPU runs at 1 GHz
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+static inline uint32_t profile_cycles_per_us()
+{
+#if defined(ARDUINO_ARCH_ESP32)
+    return ESP.getCpuFreqMHz();
+#else
+    return 1000;
+#endif
+}
+
+// Map a sample to its histogram bucket: values below 4 get their own bucket,
+// everything else is (power of two, top 2 bits below the leading one)
+static inline int profile_bucket(uint32_t value)
+{
+    if (value < PROFILE_SUB_COUNT)
+    {
+        return value;
+    }
+    int msb = 31 - __builtin_clz(value);
+    int exponent = msb - PROFILE_SUB_BITS + 1;
+    return exponent * PROFILE_SUB_COUNT + ((value >> (exponent - 1)) & (PROFILE_SUB_COUNT - 1));
+}
+
+// Smallest value that lands in the given bucket
+static inline uint32_t profile_bucket_floor(int bucket)
+{
+    int exponent = bucket / PROFILE_SUB_COUNT;
+    uint32_t mantissa = bucket % PROFILE_SUB_COUNT;
+    if (exponent == 0)
+    {
+        return mantissa;
+    }
+    return (PROFILE_SUB_COUNT + mantissa) << (exponent - 1);
+}
+
+static inline void profile_record(int probe, uint32_t cycles)
+{
+    ProfileHistogram& h = profileData[probe];
+    if (h.count == 0 || cycles < h.min) h.min = cycles;
+    if (cycles > h.max) h.max = cycles;
+    h.count++;
+    h.sum += cycles;
+    h.buckets[profile_bucket(cycles)]++;
+}
+
+// Probes timed in microseconds. Long ones (a slow download is seconds)
+// would wrap 32 bits of cycles, so they stick at the top bucket instead.
+static inline void profile_record_us(int probe, uint32_t us)
+{
+    uint64_t cycles = static_cast<uint64_t>(us) * profile_cycles_per_us();
+    profile_record(probe, cycles > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(cycles));
+}
+
+// A new key went down: remember when, unless an earlier press is still waiting
+static inline void profile_key_pressed()
+{
+    if (!keyPressPending)
+    {
+        keyPressStamp = profile_cycles();
+        keyPressPending = true;
+    }
+}
+
+// The LED rows were just latched: close out a pending key press
+static inline void profile_led_latched()
+{
+    if (keyPressPending)
+    {
+        profile_record(PROBE_KEY_LATENCY, profile_cycles() - keyPressStamp);
+        keyPressPending = false;
+    }
+}
+
+static inline void profile_reset()
+{
+    for (int p = 0; p < PROBE_COUNT; p++)
+    {
+        profileData[p] = ProfileHistogram();
+    }
+    keyPressPending = false;
+}
+
+// Value (in cycles) below which the given fraction (0-1000 per mille) of samples fall
+static inline uint32_t profile_percentile(const ProfileHistogram& h, uint32_t perMille)
+{
+    uint64_t target = (static_cast<uint64_t>(h.count) * perMille + 999) / 1000;
+    uint64_t seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++)
+    {
+        seen += h.buckets[b];
+        if (seen >= target && h.buckets[b] != 0)
+        {
+            uint32_t floor = profile_bucket_floor(b);
+            return floor < h.min ? h.min : (floor > h.max ? h.max : floor);
+        }
+    }
+    return h.max;
+}
+
+// Write one line per probe, all times in microseconds. Works with Serial or a
+// WiFiClient since both are a Print.
+template <typename Output>
+void profile_dump(Output& out)
+{
+    uint32_t perUs = profile_cycles_per_us();
+    out.println("probe count min p50 p90 p99 max mean (us)");
+    for (int p = 0; p < PROBE_COUNT; p++)
+    {
+        const ProfileHistogram& h = profileData[p];
+        out.print(profileNames[p]);
+        out.print(" ");
+        out.print(static_cast<unsigned long>(h.count));
+        if (h.count == 0)
+        {
+            out.println();
+            continue;
+        }
+        uint32_t values[] = {
+            h.min,
+            profile_percentile(h, 500),
+            profile_percentile(h, 900),
+            profile_percentile(h, 990),
+            h.max,
+            static_cast<uint32_t>(h.sum / h.count)
+        };
+        for (uint32_t value : values)
+        {
+            out.print(" ");
+            out.print(static_cast<unsigned long>(value / perUs));
+        }
+        out.println();
+    }
+}
+
+// Serial commands: 'p' prints the probes, 'r' clears them. Returns false
+// for anything else so the caller can handle its own commands.
+template <typename Output>
+bool profile_command(int command, Output& out)
+{
+    if (command == 'p') profile_dump(out);
+    else if (command == 'r') profile_reset();
+    else return false;
+    return true;
+}
+
+struct ProfileScope {
+    int probe;
+    uint32_t start;
+    explicit ProfileScope(int p) : probe(p), start(profile_cycles()) {}
+    ~ProfileScope() { profile_record(probe, profile_cycles() - start); }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(probe) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(probe)
+#define PROFILE_BEGIN(name) uint32_t profileStart_##name = profile_cycles()
+#define PROFILE_END(name, probe) profile_record(probe, profile_cycles() - profileStart_##name)
+#define PROFILE_RECORD_US(probe, us) profile_record_us(probe, us)
+#define PROFILE_KEY_PRESSED() profile_key_pressed()
+#define PROFILE_LED_LATCHED() profile_led_latched()
+#define PROFILE_COMMAND(command, out) profile_command(command, out)
+#define PROFILE_DUMP(out) profile_dump(out)
+
+#else
+
+// Nothing is a profiler command, and a discarded call stays quiet
+template <typename Output>
+static inline bool profile_command(int, Output&)
+{
+    return false;
+}
+
+#define PROFILE_SCOPE(probe) do {} while (0)
+#define PROFILE_BEGIN(name) do {} while (0)
+#define PROFILE_END(name, probe) do {} while (0)
+#define PROFILE_RECORD_US(probe, us) do {} while (0)
+#define PROFILE_KEY_PRESSED() do {} while (0)
+#define PROFILE_LED_LATCHED() do {} while (0)
+#define PROFILE_COMMAND(command, out) profile_command(command, out)
+#define PROFILE_DUMP(out) (out).println("profiling disabled")
+
+#endif
@@ -0,0 +1,485 @@
+#pragma once
+
+// One long-lived connection to the server, shared by every request.
+//
+// The frame format and commands are in session_protocol.h. Either side may
+// send requests at any time and answers come back tagged with the request's
+// id, so several requests can be in flight at once.
+//
+// Reply payloads go straight to the requester's sink as they arrive. On the
+// ESP32 a task on core 0 does all the receiving, so sinks run there.
+//
+// Getting connected is a state machine polled along with everything else,
+// so nothing on core 1 ever waits on the network:
+//
+//   LINK_WIFI     waiting for the access point (WiFi.begin() was called once)
+//   LINK_CONNECT  due to try the server
+//   LINK_BACKOFF  the last try failed; the wait doubles each time, up to
+//                 SESSION_RETRY_MAX_MS, and resets once a connect works
+//   LINK_UP       connected; a drop goes back to LINK_BACKOFF
+//
+// The connect itself is the one step that can block (for up to
+// SESSION_CONNECT_TIMEOUT_MS), which is why it happens on core 0.
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <WiFi.h>
+#include "logger.h"
+#include "session_protocol.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+#define SESSION_MAX_PENDING 4        // requests this side can have in flight
+#define SESSION_MAX_INCOMING 64      // payload kept from the other side's requests
+#define SESSION_RETRY_MS 1000         // first wait after a failed connect
+#define SESSION_RETRY_MAX_MS 16000    // the wait stops doubling here
+#define SESSION_CONNECT_TIMEOUT_MS 1000
+
+enum SessionLinkState {
+    LINK_WIFI = 0,
+    LINK_CONNECT,
+    LINK_BACKOFF,
+    LINK_UP
+};
+
+enum SessionRequestState {
+    REQUEST_FREE = 0,
+    REQUEST_WAITING,
+    REQUEST_DONE
+};
+
+// Where reply bytes go, called once per received piece
+typedef void (*SessionSink)(void* context, const uint8_t* data, size_t length);
+
+struct Session;
+// Requests from the server other than PING; answer with session_reply()
+typedef void (*SessionHandler)(Session& s, uint16_t id, uint8_t command, const uint8_t* payload, size_t length);
+
+struct SessionRequest {
+    uint16_t id = 0;
+    uint8_t status = SESSION_OK;
+    std::atomic<uint8_t> state{REQUEST_FREE};
+    SessionSink sink = nullptr;
+    void* context = nullptr;
+    uint32_t bytes = 0; // reply payload received so far
+    std::atomic<unsigned long> lastHeard{0}; // when it was sent or last got bytes
+};
+
+struct Session {
+    WiFiClient client;
+    const char* host = nullptr;
+    uint16_t port = 0;
+    std::atomic<bool> connected{false};
+    std::atomic<int> link{LINK_WIFI};
+    std::recursive_mutex lock; // frames go out whole; the receiver runs under it too
+    uint16_t nextId = 1;
+    SessionRequest pending[SESSION_MAX_PENDING];
+    SessionHandler handler = nullptr;
+
+    // receive side: the frame being read
+    uint8_t header[SESSION_HEADER_BYTES];
+    uint8_t headerLen = 0;
+    uint32_t payloadLeft = 0;
+    uint16_t frameId = 0;
+    uint8_t frameCommand = 0;
+    uint8_t frameStatus = 0;
+    SessionRequest* frameTarget = nullptr; // reply being filled, if we asked for it
+    uint8_t incoming[SESSION_MAX_INCOMING];
+    size_t incomingLen = 0;
+
+    unsigned long lastSent = 0;
+    unsigned long lastReceived = 0;
+    unsigned long lastAttempt = 0;
+    unsigned long retryMs = SESSION_RETRY_MS; // current backoff
+    uint32_t connects = 0;
+    bool background = false; // a task is polling, waiters just wait
+};
+
+// Text for a STAT message, built with the usual print calls
+struct SessionText : public Print {
+    std::string text;
+    size_t write(uint8_t c) override
+    {
+        text.push_back(static_cast<char>(c));
+        return 1;
+    }
+};
+
+static inline void session_put_le(uint8_t* p, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        p[i] = value >> (8 * i);
+    }
+}
+
+// Give up on the connection: every waiting request finishes as SESSION_LOST
+static void session_drop(Session& s)
+{
+    std::lock_guard<std::recursive_mutex> guard(s.lock);
+    if (s.connected.load())
+    {
+        LOG_WARN(SESSION, "Session lost");
+    }
+    s.client.stop();
+    s.connected.store(false);
+    s.link.store(LINK_BACKOFF);
+    s.headerLen = 0;
+    s.payloadLeft = 0;
+    s.frameTarget = nullptr;
+    for (int r = 0; r < SESSION_MAX_PENDING; r++)
+    {
+        if (s.pending[r].state.load() == REQUEST_WAITING)
+        {
+            s.pending[r].status = SESSION_LOST;
+            s.pending[r].state.store(REQUEST_DONE);
+        }
+    }
+}
+
+// Send one whole message, split into frames of at most SESSION_MAX_CHUNK
+static bool session_send(Session& s, uint16_t id, uint8_t command, uint8_t status, const uint8_t* payload, size_t length)
+{
+    std::lock_guard<std::recursive_mutex> guard(s.lock);
+    if (!s.connected.load())
+    {
+        return false;
+    }
+    size_t sent = 0;
+    do
+    {
+        size_t chunk = length - sent > SESSION_MAX_CHUNK ? SESSION_MAX_CHUNK : length - sent;
+        bool more = sent + chunk < length;
+        uint8_t header[SESSION_HEADER_BYTES];
+        session_put_le(header, 4 + chunk, 4);
+        session_put_le(header + 4, id, 2);
+        header[6] = command | (more ? SESSION_MORE : 0);
+        header[7] = status;
+        if (s.client.write(header, sizeof(header)) != sizeof(header) ||
+            (chunk > 0 && s.client.write(payload + sent, chunk) != chunk))
+        {
+            session_drop(s);
+            return false;
+        }
+        sent += chunk;
+    } while (sent < length);
+    s.lastSent = millis();
+    return true;
+}
+
+// Answer a request the server sent us
+static inline bool session_reply(Session& s, uint16_t id, uint8_t command, uint8_t status, const uint8_t* payload, size_t length)
+{
+    return session_send(s, id, (command & SESSION_COMMAND_MASK) | SESSION_REPLY, status, payload, length);
+}
+
+// A whole frame has been read
+static void session_frame_done(Session& s)
+{
+    s.headerLen = 0;
+    bool more = s.frameCommand & SESSION_MORE;
+    if (s.frameCommand & SESSION_REPLY)
+    {
+        if (s.frameTarget != nullptr && !more)
+        {
+            s.frameTarget->status = s.frameStatus;
+            s.frameTarget->state.store(REQUEST_DONE);
+        }
+        s.frameTarget = nullptr;
+        return;
+    }
+    if (more)
+    {
+        return; // keep collecting the request
+    }
+    uint8_t command = s.frameCommand & SESSION_COMMAND_MASK;
+    if (command == SESSION_PING)
+    {
+        session_reply(s, s.frameId, command, SESSION_OK, s.incoming, s.incomingLen);
+    }
+    else if (s.handler != nullptr)
+    {
+        s.handler(s, s.frameId, command, s.incoming, s.incomingLen);
+    }
+    else
+    {
+        session_reply(s, s.frameId, command, SESSION_BAD_REQUEST, nullptr, 0);
+    }
+    s.incomingLen = 0;
+}
+
+static void session_frame_start(Session& s)
+{
+    uint32_t length = s.header[0] | (s.header[1] << 8) | (s.header[2] << 16) | (static_cast<uint32_t>(s.header[3]) << 24);
+    s.frameId = s.header[4] | (s.header[5] << 8);
+    s.frameCommand = s.header[6];
+    s.frameStatus = s.header[7];
+    s.payloadLeft = length >= 4 ? length - 4 : 0;
+    s.frameTarget = nullptr;
+    if (s.frameCommand & SESSION_REPLY)
+    {
+        for (int r = 0; r < SESSION_MAX_PENDING; r++)
+        {
+            if (s.pending[r].state.load() == REQUEST_WAITING && s.pending[r].id == s.frameId)
+            {
+                s.frameTarget = &s.pending[r];
+            }
+        }
+    }
+    if (s.payloadLeft == 0)
+    {
+        session_frame_done(s);
+    }
+}
+
+static bool session_connect(Session& s)
+{
+    s.lastAttempt = millis();
+    LOG_INFO(SESSION, "Connecting to host machine %s", s.host);
+    if (!s.client.connect(s.host, s.port, SESSION_CONNECT_TIMEOUT_MS))
+    {
+        LOG_WARN(SESSION, "Connection to host failed, retrying in %lu s", static_cast<unsigned long>(s.retryMs / 1000));
+        s.link.store(LINK_BACKOFF);
+        return false;
+    }
+    s.client.setNoDelay(true); // frames are small and somebody is waiting on each one
+    std::lock_guard<std::recursive_mutex> guard(s.lock);
+    s.headerLen = 0;
+    s.payloadLeft = 0;
+    s.incomingLen = 0;
+    s.lastSent = s.lastReceived = millis();
+    s.retryMs = SESSION_RETRY_MS;
+    s.connects++;
+    s.connected.store(true);
+    s.link.store(LINK_UP);
+    return true;
+}
+
+// One step towards a connection; returns straight away unless a connect is due
+static void session_link(Session& s)
+{
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        s.link.store(LINK_WIFI);
+        return;
+    }
+    switch (s.link.load())
+    {
+    case LINK_WIFI:
+        LOG_INFO(SESSION, "WiFi connected, IP address: %s", WiFi.localIP().toString().c_str());
+        s.link.store(LINK_CONNECT);
+        break;
+    case LINK_BACKOFF:
+        if (millis() - s.lastAttempt < s.retryMs)
+        {
+            break;
+        }
+        s.retryMs = s.retryMs * 2 > SESSION_RETRY_MAX_MS ? SESSION_RETRY_MAX_MS : s.retryMs * 2;
+        s.link.store(LINK_CONNECT);
+        break;
+    case LINK_CONNECT:
+        if (s.host != nullptr)
+        {
+            session_connect(s);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Read whatever has arrived, hand it out, keep the line alive. Never blocks.
+void session_poll(Session& s)
+{
+    if (!s.connected.load())
+    {
+        // not under the lock, so a slow connect never holds up core 1
+        session_link(s);
+        return;
+    }
+    std::lock_guard<std::recursive_mutex> guard(s.lock);
+
+    uint8_t buffer[256];
+    while (s.connected.load() && s.client.available() > 0)
+    {
+        s.lastReceived = millis();
+        if (s.headerLen < SESSION_HEADER_BYTES)
+        {
+            int got = s.client.read(s.header + s.headerLen, SESSION_HEADER_BYTES - s.headerLen);
+            if (got <= 0)
+            {
+                break;
+            }
+            s.headerLen += got;
+            if (s.headerLen == SESSION_HEADER_BYTES)
+            {
+                session_frame_start(s);
+            }
+            continue;
+        }
+        int got = s.client.read(buffer, s.payloadLeft < sizeof(buffer) ? s.payloadLeft : sizeof(buffer));
+        if (got <= 0)
+        {
+            break;
+        }
+        s.payloadLeft -= got;
+        if (s.frameTarget != nullptr)
+        {
+            s.frameTarget->bytes += got;
+            s.frameTarget->lastHeard.store(millis());
+            if (s.frameTarget->sink != nullptr)
+            {
+                s.frameTarget->sink(s.frameTarget->context, buffer, got);
+            }
+        }
+        else if (!(s.frameCommand & SESSION_REPLY))
+        {
+            size_t room = SESSION_MAX_INCOMING - s.incomingLen;
+            size_t keep = static_cast<size_t>(got) < room ? got : room;
+            memcpy(s.incoming + s.incomingLen, buffer, keep);
+            s.incomingLen += keep;
+        }
+        if (s.payloadLeft == 0)
+        {
+            session_frame_done(s);
+        }
+    }
+
+    if (!s.connected.load())
+    {
+        return;
+    }
+    unsigned long now = millis();
+    if (!s.client.connected() || now - s.lastReceived >= SESSION_TIMEOUT_MS)
+    {
+        session_drop(s);
+    }
+    else if (now - s.lastSent >= SESSION_KEEPALIVE_MS)
+    {
+        // nobody waits for the answer: any reply at all proves the line is up
+        session_send(s, s.nextId++, SESSION_PING, SESSION_OK, nullptr, 0);
+    }
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+static void session_task(void* arg)
+{
+    Session* s = static_cast<Session*>(arg);
+    for (;;)
+    {
+        session_poll(*s);
+        vTaskDelay(1);
+    }
+}
+#endif
+
+// Say where the server is and start connecting in the background. Cheap to
+// call every loop: returns whether the session is up right now.
+bool session_open(Session& s, const char* host, uint16_t port)
+{
+    s.host = host;
+    s.port = port;
+#if defined(ARDUINO_ARCH_ESP32)
+    if (!s.background)
+    {
+        // Core 0 does the networking; core 1 keeps the display going
+        s.background = xTaskCreatePinnedToCore(session_task, "session", 4096, &s, 1, NULL, 0) == pdPASS;
+    }
+#endif
+    if (!s.background)
+    {
+        session_poll(s);
+    }
+    return s.connected.load();
+}
+
+// Start a request. Returns its slot for session_wait(), -1 if every slot is
+// busy or the connection is down.
+int session_request(Session& s, uint8_t command, const uint8_t* payload, size_t length, SessionSink sink, void* context)
+{
+    if (!s.connected.load())
+    {
+        return -1; // checked first: while a connect is under way the lock isn't ours to wait on
+    }
+    std::lock_guard<std::recursive_mutex> guard(s.lock);
+    for (int r = 0; r < SESSION_MAX_PENDING; r++)
+    {
+        SessionRequest& request = s.pending[r];
+        if (request.state.load() != REQUEST_FREE)
+        {
+            continue;
+        }
+        request.id = s.nextId++;
+        if (s.nextId == 0)
+        {
+            s.nextId = 1;
+        }
+        request.sink = sink;
+        request.context = context;
+        request.bytes = 0;
+        request.status = SESSION_OK;
+        request.lastHeard.store(millis());
+        request.state.store(REQUEST_WAITING);
+        if (!session_send(s, request.id, command, SESSION_OK, payload, length))
+        {
+            request.state.store(REQUEST_FREE);
+            return -1;
+        }
+        return r;
+    }
+    return -1;
+}
+
+// Has a request been answered, or gone quiet for timeoutMs? Never blocks, so
+// the caller can keep the display going; session_finish() collects it.
+bool session_done(Session& s, int slot, unsigned long timeoutMs)
+{
+    if (slot < 0)
+    {
+        return true;
+    }
+    if (!s.background)
+    {
+        session_poll(s);
+    }
+    const SessionRequest& request = s.pending[slot];
+    return request.state.load() != REQUEST_WAITING || millis() - request.lastHeard.load() >= timeoutMs;
+}
+
+// Free a request's slot. Returns its status, SESSION_LOST if it never finished.
+uint8_t session_finish(Session& s, int slot)
+{
+    if (slot < 0)
+    {
+        return SESSION_LOST;
+    }
+    SessionRequest& request = s.pending[slot];
+    std::lock_guard<std::recursive_mutex> guard(s.lock);
+    uint8_t status = request.state.load() == REQUEST_DONE ? request.status : static_cast<uint8_t>(SESSION_LOST);
+    if (s.frameTarget == &request)
+    {
+        s.frameTarget = nullptr;
+    }
+    request.state.store(REQUEST_FREE); // a late reply is skipped: its id is no longer pending
+    return status;
+}
+
+// Wait for a request to be answered and free its slot. Returns its status.
+// The timeout restarts whenever part of the reply arrives.
+uint8_t session_wait(Session& s, int slot, unsigned long timeoutMs)
+{
+    while (!session_done(s, slot, timeoutMs))
+    {
+        if (s.background)
+        {
+            delay(1);
+        }
+    }
+    return session_finish(s, slot);
+}
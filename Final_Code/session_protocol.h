@@ -0,0 +1,61 @@
+#pragma once
+
+// The session wire format, shared by the device (session.h) and the host
+// tools (tools/session_server.cpp).
+//
+// Each message is a frame:
+//
+//   uint32 length   bytes after this field (4 + payload), little-endian
+//   uint16 id       request id, chosen by the side that sent the request
+//   uint8  command  SESSION_GET ... | SESSION_REPLY on answers
+//                                   | SESSION_MORE if another frame of the
+//                                     same message follows
+//   uint8  status   SESSION_OK ... on the last frame of a reply
+//   payload         at most SESSION_MAX_CHUNK bytes
+//
+// Either side may send requests at any time and answers come back tagged
+// with the request's id, so several requests can be in flight at once and
+// a big reply can be interleaved with small ones. Nothing is matched by
+// comparing raw buffers, and both sides sending at once is normal.
+//
+// Commands:
+//   GET   payload: option byte (SESSION_GET_COMPRESSED), then a song name or
+//         nothing for the next song in the playlist. Reply: the song, maybe
+//         LZ compressed (lz_stream.h tells). SESSION_NOT_FOUND ends a playlist.
+//   PUT   payload: a recording. Reply: status only.
+//   LIST  reply: the song catalog (song_catalog.h).
+//   STAT  device -> server: probe dump text. server -> device: reply is the dump.
+//   PING  reply echoes the payload. Sent when the line has been quiet for
+//         SESSION_KEEPALIVE_MS; a session that hears nothing for
+//         SESSION_TIMEOUT_MS is dropped and reconnected.
+//   LOG   device -> server: a batch of practice records (practice_record.h),
+//         maybe LZ compressed, told apart like songs. Reply: status only.
+
+#include <stdint.h>
+
+#define SESSION_HEADER_BYTES 8
+#define SESSION_MAX_CHUNK 1024       // payload bytes per frame
+#define SESSION_KEEPALIVE_MS 5000
+#define SESSION_TIMEOUT_MS 15000
+
+enum SessionCommand {
+    SESSION_GET = 1,
+    SESSION_PUT = 2,
+    SESSION_LIST = 3,
+    SESSION_STAT = 4,
+    SESSION_PING = 5,
+    SESSION_LOG = 6,
+    SESSION_MORE = 0x40,
+    SESSION_REPLY = 0x80
+};
+#define SESSION_COMMAND_MASK 0x3F
+
+enum SessionStatus {
+    SESSION_OK = 0,
+    SESSION_NOT_FOUND,
+    SESSION_BAD_REQUEST,
+    SESSION_FAILED,
+    SESSION_LOST // not on the wire: the connection went away first
+};
+
+#define SESSION_GET_COMPRESSED 0x01 // GET option: LZ replies are welcome
@@ -0,0 +1,136 @@
+#pragma once
+
+// One contiguous block that holds everything belonging to the current song
+// (tracks, notes, control changes, names, frames).
+//
+// The block is allocated once and never freed, so loading song after song
+// can't fragment the heap. Allocation is a pointer bump; freeing a single
+// object does nothing, and the whole song is dropped with arena_reset().
+// Because vectors can't grow in place here, every container is reserved to
+// its final size before it is filled (see measureSong()).
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <vector>
+#include <map>
+
+// Bytes set aside for one parsed song. Override before including this file.
+#ifndef SONG_ARENA_BUDGET
+#define SONG_ARENA_BUDGET (128 * 1024)
+#endif
+
+struct SongArena {
+    uint8_t* base = nullptr;
+    size_t capacity = 0;  // bytes reserved in base
+    size_t used = 0;      // bytes handed out for the current song
+    size_t highWater = 0; // most bytes any song has needed since boot
+};
+
+// Grab the block. Call once at boot, before the heap has been chopped up.
+inline bool arena_init(SongArena& arena, size_t budget)
+{
+    arena.base = static_cast<uint8_t*>(malloc(budget));
+    arena.capacity = arena.base ? budget : 0;
+    arena.used = 0;
+    return arena.base != nullptr;
+}
+
+// Drop everything from the previous song in O(1)
+inline void arena_reset(SongArena& arena)
+{
+    arena.used = 0;
+}
+
+inline size_t arena_remaining(const SongArena& arena)
+{
+    return arena.capacity - arena.used;
+}
+
+// Whether bytes at this alignment would still fit
+inline bool arena_fits(const SongArena& arena, size_t bytes, size_t align)
+{
+    size_t start = (arena.used + align - 1) & ~(align - 1);
+    return start <= arena.capacity && bytes <= arena.capacity - start;
+}
+
+inline void* arena_alloc(SongArena& arena, size_t bytes, size_t align)
+{
+    size_t start = (arena.used + align - 1) & ~(align - 1);
+    if (start + bytes > arena.capacity)
+    {
+        return nullptr;
+    }
+    arena.used = start + bytes;
+    if (arena.used > arena.highWater)
+    {
+        arena.highWater = arena.used;
+    }
+    return arena.base + start;
+}
+
+template <typename Output>
+void arena_report(const SongArena& arena, Output& out)
+{
+    out.print("Song arena: ");
+    out.print(static_cast<unsigned long>(arena.used));
+    out.print(" of ");
+    out.print(static_cast<unsigned long>(arena.capacity));
+    out.print(" bytes used, high water ");
+    out.println(static_cast<unsigned long>(arena.highWater));
+}
+
+// Standard allocator that carves from a SongArena. The song's size checks
+// happen before parsing, and every container is sized with arena_reserve(),
+// which refuses what won't fit, so the throw is never reached.
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+    SongArena* arena;
+
+    explicit ArenaAllocator(SongArena& a) : arena(&a) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n)
+    {
+        void* p = arena_alloc(*arena, n * sizeof(T), alignof(T));
+        if (p == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T*, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena == b.arena; }
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena != b.arena; }
+
+template <typename T>
+using SongVector = std::vector<T, ArenaAllocator<T>>;
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> SongString;
+template <typename K, typename V>
+using SongMap = std::map<K, V, std::less<K>, ArenaAllocator<std::pair<const K, V>>>;
+
+// Reserve a SongVector or SongString to its final size. Returns false,
+// reserving nothing, if the arena can't hold it: a wrong estimate rejects
+// the song instead of throwing out of the parser.
+template <typename Container>
+inline bool arena_reserve(Container& container, size_t count)
+{
+    typedef typename Container::value_type T;
+    // one more element covers a string's terminator
+    if (count > container.capacity() &&
+        !arena_fits(*container.get_allocator().arena, (count + 1) * sizeof(T), alignof(T)))
+    {
+        return false;
+    }
+    container.reserve(count);
+    return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// The song catalog: one small file describing every song in the library,
+// so the device can show a song list after a single transfer instead of
+// downloading songs to find out what they are. tools/indexer.cpp builds it.
+//
+// Layout (little-endian, which both the ESP32 and the host are):
+//
+//   CatalogHeader
+//   CatalogEntry[count]           sorted by path
+//   char strings[stringBytes]     NUL-terminated, referenced by offset
+//
+// Entries are fixed size so the device can seek straight to entry i.
+
+#include <stdint.h>
+
+#define CATALOG_MAGIC "PHC1"
+#define CATALOG_NAME_SEPARATOR '\n' // between track names in CatalogEntry::names
+
+struct CatalogHeader {
+    char magic[4];        // CATALOG_MAGIC
+    uint32_t count;       // entries
+    uint32_t stringBytes; // size of the string table after them
+};
+
+struct CatalogEntry {
+    uint32_t path;           // string offset: file name relative to the library
+    uint32_t names;          // string offset: every track name, separator joined
+    uint32_t durationMs;     // played through at usPerQuarter, as the device does
+    uint32_t usPerQuarter;   // first Set Tempo, 500000 if there is none
+    uint32_t notes;
+    uint16_t division;       // ticks per quarter note
+    uint8_t tracks;
+    uint8_t lowestNote;      // MIDI note range actually played
+    uint8_t highestNote;
+    uint8_t polyphony;       // most notes sounding at once
+    uint8_t timeNumerator;
+    uint8_t timeDenominator;
+    int8_t keySharps;        // negative for flats
+    uint8_t keyMinor;
+    uint8_t reserved[2];
+};
+
+static_assert(sizeof(CatalogHeader) == 12, "catalog header is sent as raw bytes");
+static_assert(sizeof(CatalogEntry) == 32, "catalog entries are sent as raw bytes");
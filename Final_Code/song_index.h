@@ -0,0 +1,234 @@
+#pragma once
+
+// Where each bar of a song starts, for jumping to a bar and looping a
+// passage while practicing.
+//
+// Bars come from the song's time signatures: numerator beats of a
+// 1/denominator note, 4/4 until the first signature, and a signature that
+// lands mid-bar starts a new bar there (scanSong() numbers them the same
+// way). Each signature change begins a span of equal bars, so finding a bar
+// is a binary search over the spans and a multiply. The index only maps bars
+// to frames; the RAM player jumps straight to a frame, and FrameStream
+// (frame_stream.h) keeps checkpoints of its decoder to get there.
+//
+// Bars are numbered from 1, as on the score. Practice requests come in as
+// typed commands:
+//
+//   b17      jump to bar 17, ending any loop
+//   l17-24   loop bars 17 to 24, starting at bar 17
+//   l17      loop bar 17 on its own
+//   l        end the loop and play on
+
+#include <stdint.h>
+#include <algorithm>
+#include "logger.h"
+
+#define SONG_INDEX_SPANS 16 // time signature changes kept; later ones are ignored
+
+struct BarSpan {
+    uint32_t tick;        // where the signature takes over
+    uint32_t ticksPerBar;
+    uint32_t firstBar;    // bars before the span
+};
+
+struct SongIndex {
+    uint32_t step = 1;    // ticks per frame
+    uint32_t frames = 0;  // frames in the song
+    uint32_t division = 480;
+    BarSpan spans[SONG_INDEX_SPANS];
+    int spanCount = 0;
+};
+
+static inline uint32_t song_index_ticks_per_bar(uint32_t division, int numerator, int denominator)
+{
+    uint32_t ticks = division * 4 * numerator / denominator;
+    return ticks > 0 ? ticks : 1;
+}
+
+// The frame grid, which measureSong(), the RAM player and the stream all
+// have to agree on: one notated 32nd note, from the song's first time signature
+// that gives a count (bb 0 is no answer), the earliest tick and the first
+// track's on a tie. 8 to the quarter without one. The grid never changes
+// mid-song.
+struct SongGrid {
+    int32_t tick = -1;       // of the time signature that set it, -1 for none yet
+    int thirtysecondNotes = 8;
+};
+
+// Offer a time signature. Offer them track by track, or in song order,
+// and the first one wins.
+static inline void song_grid_offer(SongGrid& grid, int32_t tick, int thirtysecondNotes)
+{
+    if (tick >= 0 && thirtysecondNotes > 0 && (grid.tick < 0 || tick < grid.tick))
+    {
+        grid.tick = tick;
+        grid.thirtysecondNotes = thirtysecondNotes;
+    }
+}
+
+// Ticks per frame
+static inline int song_grid_step(const SongGrid& grid, int division)
+{
+    int step = grid.thirtysecondNotes > 0 ? division / grid.thirtysecondNotes : 0;
+    return step > 0 ? step : 1;
+}
+
+// Start a song's index: 4/4 from its first tick
+void song_index_begin(SongIndex& index, uint32_t division, uint32_t step)
+{
+    index.division = division > 0 ? division : 480;
+    index.step = step > 0 ? step : 1;
+    index.frames = 0;
+    index.spans[0] = BarSpan{ 0, song_index_ticks_per_bar(index.division, 4, 4), 0 };
+    index.spanCount = 1;
+}
+
+// Add a time signature; they must come in song order
+void song_index_signature(SongIndex& index, uint32_t tick, int numerator, int denominator)
+{
+    if (numerator <= 0 || denominator <= 0 || index.spanCount == 0)
+    {
+        return;
+    }
+    BarSpan& last = index.spans[index.spanCount - 1];
+    uint32_t ticksPerBar = song_index_ticks_per_bar(index.division, numerator, denominator);
+    if (tick <= last.tick)
+    {
+        // another track's signature on the same tick: the later one wins
+        last.ticksPerBar = ticksPerBar;
+        return;
+    }
+    uint32_t bars = (tick - last.tick + last.ticksPerBar - 1) / last.ticksPerBar;
+    if (ticksPerBar == last.ticksPerBar && (tick - last.tick) % last.ticksPerBar == 0)
+    {
+        return; // same bars carrying on
+    }
+    if (index.spanCount == SONG_INDEX_SPANS)
+    {
+        LOG_WARN(PLAYER, "Only the first %d time signatures are indexed", SONG_INDEX_SPANS);
+        return;
+    }
+    index.spans[index.spanCount++] = BarSpan{ tick, ticksPerBar, last.firstBar + bars };
+}
+
+// Frame a bar starts on, or index.frames if the song is over by then
+uint32_t song_index_bar_frame(const SongIndex& index, uint32_t bar)
+{
+    uint32_t before = bar > 0 ? bar - 1 : 0;
+    const BarSpan* span = std::upper_bound(index.spans, index.spans + index.spanCount, before,
+                                           [](uint32_t b, const BarSpan& s) { return b < s.firstBar; }) - 1;
+    uint64_t tick = span->tick + static_cast<uint64_t>(before - span->firstBar) * span->ticksPerBar;
+    uint64_t frame = (tick + index.step / 2) / index.step;
+    return frame < index.frames ? static_cast<uint32_t>(frame) : index.frames;
+}
+
+// Bar a frame belongs to: the last one starting on or before it
+uint32_t song_index_frame_bar(const SongIndex& index, uint32_t frame)
+{
+    // the last tick that still rounds to this frame
+    uint64_t tick = static_cast<uint64_t>(frame) * index.step + (index.step - index.step / 2 - 1);
+    const BarSpan* span = std::upper_bound(index.spans, index.spans + index.spanCount, tick,
+                                           [](uint64_t t, const BarSpan& s) { return t < s.tick; }) - 1;
+    return span->firstBar + static_cast<uint32_t>((tick - span->tick) / span->ticksPerBar) + 1;
+}
+
+static inline uint32_t song_index_bars(const SongIndex& index)
+{
+    return index.frames > 0 ? song_index_frame_bar(index, index.frames - 1) : 0;
+}
+
+// A practice command being typed, and the last whole one
+struct PracticeRequest {
+    char command = 0;      // 'b' or 'l' while one is being typed
+    uint32_t numbers[2] = { 0, 0 };
+    int count = 0;         // numbers started
+    bool ready = false;    // a whole command is waiting for the player
+};
+
+// What the player should do about a request: go to a frame, then loop
+// [loopStart, loopEnd)
+struct PracticeMove {
+    int32_t seekFrame = -1; // -1 to play on from where it is
+    uint32_t loopStart = 0;
+    uint32_t loopEnd = 0;   // 0 for no loop
+};
+
+// Feed one typed character. Returns false if it isn't part of a practice
+// command, so the caller can use it for something else.
+bool practice_input(PracticeRequest& request, int c)
+{
+    if (c == 'b' || c == 'l')
+    {
+        request.command = static_cast<char>(c);
+        request.numbers[0] = request.numbers[1] = 0;
+        request.count = 0;
+        return true;
+    }
+    if (request.command == 0)
+    {
+        return false;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        if (request.count == 0)
+        {
+            request.count = 1;
+        }
+        uint32_t& number = request.numbers[request.count - 1];
+        number = number * 10 + (c - '0');
+        return true;
+    }
+    if (c == '-' && request.count == 1)
+    {
+        request.count = 2;
+        return true;
+    }
+    // anything else ends the command
+    request.ready = request.command == 'l' || request.count > 0;
+    if (!request.ready)
+    {
+        request.command = 0;
+    }
+    return c == '\r' || c == '\n' || c == ' ';
+}
+
+// Turn a waiting request into a move for a song with this index. Returns
+// false, leaving move alone, if there is none or it asks for bars the song
+// doesn't have.
+bool practice_take(PracticeRequest& request, const SongIndex& index, PracticeMove& move)
+{
+    if (!request.ready)
+    {
+        return false;
+    }
+    char command = request.command;
+    uint32_t first = request.numbers[0] > 0 ? request.numbers[0] : 1;
+    uint32_t last = request.count > 1 ? request.numbers[1] : first;
+    int count = request.count;
+    request.ready = false;
+    request.command = 0;
+
+    if (command == 'l' && count == 0)
+    {
+        move = PracticeMove();
+        LOG_INFO(PLAYER, "Loop off");
+        return true;
+    }
+    uint32_t start = song_index_bar_frame(index, first);
+    if (start >= index.frames || last < first)
+    {
+        LOG_WARN(PLAYER, "The song has bars 1-%lu", static_cast<unsigned long>(song_index_bars(index)));
+        return false;
+    }
+    move = PracticeMove();
+    move.seekFrame = static_cast<int32_t>(start);
+    if (command == 'b')
+    {
+        LOG_INFO(PLAYER, "Bar %lu", static_cast<unsigned long>(first));
+        return true;
+    }
+    move.loopStart = start;
+    move.loopEnd = song_index_bar_frame(index, last + 1);
+    LOG_INFO(PLAYER, "Looping bars %lu-%lu", static_cast<unsigned long>(first), static_cast<unsigned long>(last));
+    return true;
+}
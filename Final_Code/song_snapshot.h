@@ -0,0 +1,347 @@
+#pragma once
+
+// Warm boot: the last song parsed in RAM, kept on SPIFFS ready to play.
+//
+// Parsing a song and building its frames takes far longer than showing
+// the first one, so the frames the RAM path built are written out as they
+// are, along with the clock and the bar index. At the next boot the
+// sketch opens the snapshot and starts the song before WiFi is up.
+// Opening it reads only the header, the bar spans and the first block
+// of frames, so the first frame goes up quickly however long the song
+// is. Each later block is read as playback reaches it. SPIFFS can't be
+// memory-mapped, and this is the nearest thing to it.
+//
+//   SnapshotHeader                   magic "PHS1", geometry, clock, title
+//   BarSpan spans[spanCount]         the song's bar index (song_index.h)
+//   uint32_t blockSums[blocks]       CRC-32 of each block of frames
+//   LedFrame frames[frames]          SNAPSHOT_BLOCK_FRAMES to a block
+//
+// Everything is in the ESP32's own byte order. The header's CRC-32 covers
+// the header, the spans and the block CRCs. A snapshot built for other
+// wiring or another LED depth is refused, and so is one that fails its
+// check. Saving writes a new file and renames it over the old one, so
+// pulling the plug mid-save leaves the last good snapshot behind. The
+// save runs on core 0 on the ESP32 while the song plays, and inline on the
+// host build. The frames it reads live in the song arena, so
+// song_snapshot_wait() must be called before the arena is reset.
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <algorithm>
+#include <SPIFFS.h>
+#include "logger.h"
+#include "keyboard_geometry.h"
+#include "song_index.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+#define SNAPSHOT_PATH "/song.snap"
+#define SNAPSHOT_NEW_PATH "/song.snap.new" // the save in progress
+#define SNAPSHOT_BLOCK_FRAMES 64           // frames read and checked at a time
+#define SNAPSHOT_MAX_BLOCKS 256            // 16384 frames, more than the arena holds
+#define SNAPSHOT_TITLE_BYTES 64
+
+struct SnapshotHeader {
+    char magic[4];          // "PHS1"
+    uint8_t keys;           // geometry the frames were built for
+    uint8_t lowestNote;
+    uint8_t levelBits;
+    uint8_t frameBytes;     // sizeof(LedFrame)
+    uint32_t source;        // FNV-1a of the MIDI file, so the same song isn't saved twice
+    uint32_t frames;
+    uint32_t step;          // ticks per frame
+    uint32_t division;
+    uint32_t usPerQuarter;
+    uint32_t spanCount;
+    char title[SNAPSHOT_TITLE_BYTES]; // the song's info line, for the log
+    uint32_t checksum;      // CRC-32 up to here with this field as 0, then spans and block CRCs
+};
+
+// An open snapshot and the block of frames last read from it
+struct SongSnapshot {
+    File file;
+    const char* path = nullptr;
+    SnapshotHeader header;
+    SongIndex index;
+    uint32_t blockSums[SNAPSHOT_MAX_BLOCKS];
+    uint32_t dataStart = 0; // file offset of frame 0
+    int32_t block = -1;     // block held in frames, -1 for none
+    LedFrame frames[SNAPSHOT_BLOCK_FRAMES];
+};
+
+// A save waiting for, or running on, core 0
+struct SnapshotSave {
+    const LedFrame* frames;
+    SongIndex index;
+    SnapshotHeader header;
+    std::atomic<bool> busy{false};
+};
+
+static SnapshotSave snapshotSave;
+
+static uint32_t snapshot_crc(uint32_t crc, const void* data, size_t length)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    while (length--)
+    {
+        crc ^= *bytes++;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+// Tells songs apart, to skip saving the one already in the snapshot
+uint32_t song_snapshot_source(const std::string& midi)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : midi)
+    {
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+static inline uint32_t snapshot_blocks(uint32_t frames)
+{
+    return (frames + SNAPSHOT_BLOCK_FRAMES - 1) / SNAPSHOT_BLOCK_FRAMES;
+}
+
+// Whether a snapshot's frames were built for this keyboard
+static inline bool snapshot_fits(const SnapshotHeader& header)
+{
+    return header.keys == ActiveKeyboard::keys && header.lowestNote == ActiveKeyboard::lowestNote &&
+           header.levelBits == LED_LEVEL_BITS && header.frameBytes == sizeof(LedFrame);
+}
+
+static uint32_t snapshot_header_sum(const SnapshotHeader& header, const BarSpan* spans, const uint32_t* blockSums)
+{
+    SnapshotHeader unsummed = header;
+    unsummed.checksum = 0;
+    uint32_t crc = snapshot_crc(0, &unsummed, sizeof(unsummed));
+    crc = snapshot_crc(crc, spans, header.spanCount * sizeof(BarSpan));
+    return snapshot_crc(crc, blockSums, snapshot_blocks(header.frames) * sizeof(uint32_t));
+}
+
+// Close a snapshot that failed a check and delete it, so the next song
+// parsed replaces it even if it is the same song
+static bool snapshot_drop(SongSnapshot& s)
+{
+    s.file.close();
+    s.block = -1;
+    SPIFFS.remove(s.path);
+    return false;
+}
+
+// Read one block of frames into s.frames and check it
+static bool snapshot_load_block(SongSnapshot& s, uint32_t block)
+{
+    uint32_t first = block * SNAPSHOT_BLOCK_FRAMES;
+    uint32_t count = std::min<uint32_t>(SNAPSHOT_BLOCK_FRAMES, s.header.frames - first);
+    size_t bytes = count * sizeof(LedFrame);
+    s.block = -1;
+    if (!s.file.seek(s.dataStart + first * sizeof(LedFrame)) ||
+        s.file.read(reinterpret_cast<uint8_t*>(s.frames), bytes) != bytes)
+    {
+        LOG_ERROR(PLAYER, "Snapshot is cut short at frame %lu", static_cast<unsigned long>(first));
+        return snapshot_drop(s);
+    }
+    if (snapshot_crc(0, s.frames, bytes) != s.blockSums[block])
+    {
+        LOG_ERROR(PLAYER, "Snapshot frames %lu-%lu are corrupt", static_cast<unsigned long>(first),
+                  static_cast<unsigned long>(first + count - 1));
+        return snapshot_drop(s);
+    }
+    s.block = block;
+    return true;
+}
+
+// Open a snapshot and read its first block. Returns false, with the file
+// closed, if there is none or it can't be trusted; one that fails its
+// check is deleted.
+bool song_snapshot_open(SongSnapshot& s, const char* path)
+{
+    if (!SPIFFS.exists(path))
+    {
+        return false;
+    }
+    s.file = SPIFFS.open(path, "r");
+    s.path = path;
+    s.block = -1;
+    SnapshotHeader& h = s.header;
+    if (!s.file || s.file.read(reinterpret_cast<uint8_t*>(&h), sizeof(h)) != sizeof(h) ||
+        memcmp(h.magic, "PHS1", 4) != 0)
+    {
+        LOG_WARN(PLAYER, "No usable song snapshot");
+        s.file.close();
+        return false;
+    }
+    if (!snapshot_fits(h))
+    {
+        LOG_WARN(PLAYER, "Song snapshot is for another keyboard");
+        s.file.close();
+        return false;
+    }
+    uint32_t blocks = snapshot_blocks(h.frames);
+    if (h.frames == 0 || blocks > SNAPSHOT_MAX_BLOCKS || h.spanCount == 0 || h.spanCount > SONG_INDEX_SPANS ||
+        s.file.read(reinterpret_cast<uint8_t*>(s.index.spans), h.spanCount * sizeof(BarSpan)) != h.spanCount * sizeof(BarSpan) ||
+        s.file.read(reinterpret_cast<uint8_t*>(s.blockSums), blocks * sizeof(uint32_t)) != blocks * sizeof(uint32_t) ||
+        snapshot_header_sum(h, s.index.spans, s.blockSums) != h.checksum)
+    {
+        LOG_ERROR(PLAYER, "Song snapshot failed its check");
+        return snapshot_drop(s);
+    }
+    h.title[SNAPSHOT_TITLE_BYTES - 1] = '\0';
+    s.index.step = h.step;
+    s.index.frames = h.frames;
+    s.index.division = h.division;
+    s.index.spanCount = h.spanCount;
+    s.dataStart = s.file.position();
+    return snapshot_load_block(s, 0);
+}
+
+// Copy out one frame, reading its block if it isn't the one in RAM.
+// Returns false past the end or if the block is damaged, which deletes
+// the snapshot.
+bool song_snapshot_frame(SongSnapshot& s, uint32_t frame, LedFrame& out)
+{
+    if (frame >= s.header.frames)
+    {
+        return false;
+    }
+    uint32_t block = frame / SNAPSHOT_BLOCK_FRAMES;
+    if (static_cast<int32_t>(block) != s.block && !snapshot_load_block(s, block))
+    {
+        return false;
+    }
+    out = s.frames[frame % SNAPSHOT_BLOCK_FRAMES];
+    return true;
+}
+
+void song_snapshot_close(SongSnapshot& s)
+{
+    s.file.close();
+    s.block = -1;
+}
+
+static bool snapshot_write(const SnapshotSave& save)
+{
+    const SnapshotHeader& h = save.header;
+    uint32_t blocks = snapshot_blocks(h.frames);
+    static uint32_t blockSums[SNAPSHOT_MAX_BLOCKS]; // only the one save at a time uses it
+    for (uint32_t b = 0; b < blocks; b++)
+    {
+        uint32_t first = b * SNAPSHOT_BLOCK_FRAMES;
+        uint32_t count = std::min<uint32_t>(SNAPSHOT_BLOCK_FRAMES, h.frames - first);
+        blockSums[b] = snapshot_crc(0, save.frames + first, count * sizeof(LedFrame));
+    }
+    SnapshotHeader header = h;
+    header.checksum = snapshot_header_sum(header, save.index.spans, blockSums);
+
+    File file = SPIFFS.open(SNAPSHOT_NEW_PATH, "w");
+    if (!file)
+    {
+        return false;
+    }
+    size_t spanBytes = h.spanCount * sizeof(BarSpan);
+    size_t frameBytes = h.frames * sizeof(LedFrame);
+    bool ok = file.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header)) == sizeof(header) &&
+              file.write(reinterpret_cast<const uint8_t*>(save.index.spans), spanBytes) == spanBytes &&
+              file.write(reinterpret_cast<const uint8_t*>(blockSums), blocks * sizeof(uint32_t)) == blocks * sizeof(uint32_t) &&
+              file.write(reinterpret_cast<const uint8_t*>(save.frames), frameBytes) == frameBytes;
+    file.close();
+    // SPIFFS won't rename over a file
+    ok = ok && (!SPIFFS.exists(SNAPSHOT_PATH) || SPIFFS.remove(SNAPSHOT_PATH)) && SPIFFS.rename(SNAPSHOT_NEW_PATH, SNAPSHOT_PATH);
+    if (!ok)
+    {
+        SPIFFS.remove(SNAPSHOT_NEW_PATH);
+    }
+    return ok;
+}
+
+static void snapshot_save_run(SnapshotSave& save)
+{
+    if (snapshot_write(save))
+    {
+        LOG_INFO(PLAYER, "Saved %lu frames for the next boot", static_cast<unsigned long>(save.header.frames));
+    }
+    else
+    {
+        LOG_WARN(PLAYER, "Could not save the song snapshot");
+    }
+    save.busy.store(false);
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+static void snapshot_save_task(void* arg)
+{
+    snapshot_save_run(*static_cast<SnapshotSave*>(arg));
+    vTaskDelete(NULL);
+}
+#endif
+
+// Whether the snapshot on SPIFFS already holds this song
+static bool snapshot_holds(uint32_t source)
+{
+    File file = SPIFFS.exists(SNAPSHOT_PATH) ? SPIFFS.open(SNAPSHOT_PATH, "r") : File();
+    SnapshotHeader header;
+    return file && file.read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) == sizeof(header) &&
+           memcmp(header.magic, "PHS1", 4) == 0 && header.source == source && snapshot_fits(header);
+}
+
+// Start saving a parsed song as the snapshot, unless it is already the one
+// saved. The frames must stay put until song_snapshot_wait() returns.
+void song_snapshot_save(const LedFrame* frames, const SongIndex& index, uint32_t usPerQuarter,
+                        uint32_t source, const std::string& title)
+{
+    if (snapshotSave.busy.load() || index.frames == 0 || snapshot_blocks(index.frames) > SNAPSHOT_MAX_BLOCKS ||
+        snapshot_holds(source))
+    {
+        return;
+    }
+    SnapshotHeader& h = snapshotSave.header;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "PHS1", 4);
+    h.keys = ActiveKeyboard::keys;
+    h.lowestNote = ActiveKeyboard::lowestNote;
+    h.levelBits = LED_LEVEL_BITS;
+    h.frameBytes = sizeof(LedFrame);
+    h.source = source;
+    h.frames = index.frames;
+    h.step = index.step;
+    h.division = index.division;
+    h.usPerQuarter = usPerQuarter;
+    h.spanCount = index.spanCount;
+    // just the first line, without its line ending
+    size_t length = std::min(title.find_first_of("\r\n"), static_cast<size_t>(SNAPSHOT_TITLE_BYTES - 1));
+    memcpy(h.title, title.data(), std::min(length, title.size()));
+    snapshotSave.frames = frames;
+    snapshotSave.index = index;
+    snapshotSave.busy.store(true);
+#if defined(ARDUINO_ARCH_ESP32)
+    // Core 0 does the flash writes; core 1 starts playing straight away
+    if (xTaskCreatePinnedToCore(snapshot_save_task, "snapshot", 3072, &snapshotSave, 1, NULL, 0) != pdPASS)
+    {
+        snapshot_save_run(snapshotSave);
+    }
+#else
+    snapshot_save_run(snapshotSave);
+#endif
+}
+
+// Wait for a save still reading the song arena
+void song_snapshot_wait()
+{
+    while (snapshotSave.busy.load())
+    {
+        delay(1);
+    }
+}
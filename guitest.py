@@ -1,52 +1,25 @@
-import socket
 import appJar as aj
 import subprocess
+import song_server
 
 def start_server():
-    global done
-    done = False
-    
-    midi_file = app.getEntry("midi_file_entry")
-    try:
-        f = open(midi_file, mode="rb")
-        data = f.read()
-        f.close()
-    except FileNotFoundError:
-        print("MIDI file not found!")
+    # a comma separated list of files is played as a playlist, one per GET
+    midi_files = [name.strip() for name in app.getEntry("midi_file_entry").split(",") if name.strip()]
+    songs = []
+    for midi_file in midi_files:
+        try:
+            f = open(midi_file, mode="rb")
+            songs.append(f.read())
+            f.close()
+        except FileNotFoundError:
+            print("MIDI file not found: " + midi_file)
+            return
+    if not songs:
+        print("No MIDI file given!")
         return
 
-    print("Running TCP Socket server...")
-    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-    s.bind(('0.0.0.0', 1235))
-    s.listen(0)
-
-    while True:
-        client, addr = s.accept()
-        print(f"Connection from {addr} has been established!")
-        client.settimeout(5)
-        while True:
-            content = client.recv(1024)
-            if len(content) == 0:
-                break
-            if str(content, 'utf-8') == '\r\n':
-                continue
-            elif str(content, 'utf-8') == 'GET\n\n':
-                print(str(content, 'utf-8'))
-                client.send(data)
-                done = True
-                continue
-            elif str(content, 'utf-8') == 'PUT\n\n':
-                print(str(content, 'utf-8'))
-                with open("received_recording.mid", "wb") as received:
-                    while True:
-                        content = client.recv(1024)
-                        if not content:
-                            break
-                        received.write(content)
-        client.close()
-        if done:
-            s.close()
-        break
+    # songs go out compressed to devices that set GET_COMPRESSED (SESSION_GET_COMPRESSED) on a GET
+    song_server.serve(songs, stats=app.getCheckBox("Ask for timing stats"))
 
 def convert_to_midi():
     midi_file = app.getEntry("midi_file_entry")
@@ -69,8 +42,9 @@ app.addImage("logo","logo.gif")
 app.zoomImage("logo",-4)
 
 # Add widgets
-app.addLabel("title", "Enter MIDI file (skip.mid to skip):")
+app.addLabel("title", "Enter MIDI file(s), comma separated for a playlist\n(skip.mid to skip):")
 app.addEntry("midi_file_entry")
+app.addCheckBox("Ask for timing stats")
 app.addButton("Start Server", start_server)
 app.addButton("Convert to MIDI", convert_to_midi)
 
@@ -0,0 +1,123 @@
+#pragma once
+
+// The parts of the Arduino core the sketch uses, for the host build.
+// Everything that touches hardware is in hal.cpp.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include "hal.h"
+
+#define PIANO_HOST 1 // sketch headers check this for host-only paths
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+#define IRAM_ATTR
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+class Print;
+
+class Printable {
+public:
+    virtual ~Printable() {}
+    virtual size_t printTo(Print& p) const = 0;
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size)
+    {
+        size_t n = 0;
+        while (size--)
+        {
+            n += write(*buffer++);
+        }
+        return n;
+    }
+    size_t write(const char* text) { return write(reinterpret_cast<const uint8_t*>(text), strlen(text)); }
+    virtual void flush() {}
+
+    size_t print(const char* text) { return write(text); }
+    size_t print(const std::string& text) { return write(reinterpret_cast<const uint8_t*>(text.data()), text.size()); }
+    size_t print(char c) { return write(static_cast<uint8_t>(c)); }
+    size_t print(unsigned char value, int base = DEC) { return printNumber(value, base); }
+    size_t print(int value, int base = DEC) { return printSigned(value, base); }
+    size_t print(unsigned int value, int base = DEC) { return printNumber(value, base); }
+    size_t print(long value, int base = DEC) { return printSigned(value, base); }
+    size_t print(unsigned long value, int base = DEC) { return printNumber(value, base); }
+    size_t print(long long value, int base = DEC) { return printSigned(value, base); }
+    size_t print(unsigned long long value, int base = DEC) { return printNumber(value, base); }
+    size_t print(double value, int digits = 2);
+    size_t print(const Printable& value) { return value.printTo(*this); }
+
+    template <typename T>
+    size_t println(const T& value) { return print(value) + println(); }
+    template <typename T>
+    size_t println(const T& value, int format) { return print(value, format) + println(); }
+    size_t println() { return write("\r\n"); }
+
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+private:
+    size_t printNumber(unsigned long long value, int base);
+    size_t printSigned(long long value, int base);
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() { return -1; }
+    size_t readBytes(uint8_t* buffer, size_t length)
+    {
+        size_t n = 0;
+        int c;
+        while (n < length && (c = read()) >= 0)
+        {
+            buffer[n++] = static_cast<uint8_t>(c);
+        }
+        return n;
+    }
+    size_t readBytes(char* buffer, size_t length) { return readBytes(reinterpret_cast<uint8_t*>(buffer), length); }
+};
+
+// Serial: stdout (unless the run is quiet) and stdin, at the baud rate's pace
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long baud);
+    size_t write(uint8_t c) override;
+    using Print::write;
+    int available() override;
+    int read() override;
+    int availableForWrite(); // room left in the FIFO
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+    uint32_t getCycleCount();
+    uint32_t getCpuFreqMHz() { return 240; }
+    uint32_t getFreeHeap() { return 200 * 1024; }
+    uint32_t getMaxAllocHeap() { return 110 * 1024; }
+};
+extern EspClass ESP;
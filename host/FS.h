@@ -0,0 +1,76 @@
+#pragma once
+
+// Files for the host build: SPIFFS paths live under a directory on the host
+// (HalOptions::spiffsDir)
+
+#include <stdio.h>
+#include <memory>
+#include "Arduino.h"
+
+namespace fs {
+
+class File : public Stream {
+public:
+    File() {}
+    explicit File(FILE* f) : file(f, fclose) {}
+
+    size_t write(uint8_t c) override { return file ? fwrite(&c, 1, 1, file.get()) : 0; }
+    size_t write(const uint8_t* buffer, size_t size) override { return file ? fwrite(buffer, 1, size, file.get()) : 0; }
+    using Print::write;
+    int available() override { return file ? static_cast<int>(size() - position()) : 0; }
+    int read() override
+    {
+        int c = file ? fgetc(file.get()) : EOF;
+        return c == EOF ? -1 : c;
+    }
+    int peek() override
+    {
+        int c = read();
+        if (c >= 0)
+        {
+            ungetc(c, file.get());
+        }
+        return c;
+    }
+    size_t read(uint8_t* buffer, size_t size) { return file ? fread(buffer, 1, size, file.get()) : 0; }
+    size_t readBytes(char* buffer, size_t size) { return read(reinterpret_cast<uint8_t*>(buffer), size); }
+    bool seek(uint32_t position) { return file && fseek(file.get(), position, SEEK_SET) == 0; }
+    size_t position() const { return file ? ftell(file.get()) : 0; }
+    size_t size() const
+    {
+        if (!file)
+        {
+            return 0;
+        }
+        long here = ftell(file.get());
+        fseek(file.get(), 0, SEEK_END);
+        long end = ftell(file.get());
+        fseek(file.get(), here, SEEK_SET);
+        return end;
+    }
+    void flush() override
+    {
+        if (file)
+        {
+            fflush(file.get());
+        }
+    }
+    void close() { file.reset(); }
+    operator bool() const { return file != nullptr; }
+
+private:
+    std::shared_ptr<FILE> file; // copies share the handle, like the ESP32's File
+};
+
+class FS {
+public:
+    File open(const char* path, const char* mode = "r");
+    bool exists(const char* path);
+    bool remove(const char* path);
+    bool rename(const char* from, const char* to);
+};
+
+} // namespace fs
+
+using fs::File;
+using fs::FS;
@@ -0,0 +1,46 @@
+#pragma once
+
+// SPI for the host build: every byte goes to the simulated LED matrix (hal.h)
+
+#include "Arduino.h"
+
+#define MSBFIRST 1
+#define LSBFIRST 0
+#define SPI_MODE0 0
+#define SPI_MODE1 1
+#define SPI_MODE2 2
+#define SPI_MODE3 3
+#define HSPI 2
+#define VSPI 3
+
+class SPISettings {
+public:
+    SPISettings(uint32_t clock = 1000000, uint8_t bitOrder = MSBFIRST, uint8_t dataMode = SPI_MODE0)
+        : clock(clock), bitOrder(bitOrder), dataMode(dataMode) {}
+    uint32_t clock;
+    uint8_t bitOrder;
+    uint8_t dataMode;
+};
+
+class SPIClass {
+public:
+    explicit SPIClass(uint8_t bus = VSPI) : bus(bus) {}
+    void begin() {}
+    void end() {}
+    void beginTransaction(SPISettings settings) { clock = settings.clock; }
+    void endTransaction() {}
+    uint8_t transfer(uint8_t value)
+    {
+        hal_spi_byte(value, clock);
+        return 0;
+    }
+    void writeBytes(const uint8_t* data, uint32_t size)
+    {
+        hal_spi_bytes(data, size, clock);
+    }
+    int8_t pinSS() { return bus == VSPI ? 5 : 15; } // the ESP32's default chip selects
+
+private:
+    uint8_t bus;
+    uint32_t clock = 1000000;
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "FS.h"
+
+class SPIFFSFS : public fs::FS {
+public:
+    bool begin(bool formatOnFail = false);
+    size_t totalBytes() { return 1408 * 1024; } // the default partition
+    size_t usedBytes();
+};
+extern SPIFFSFS SPIFFS;
@@ -0,0 +1,60 @@
+#pragma once
+
+// WiFi for the host build: the access point joins after a simulated delay
+// and every client connection is a real socket to HalOptions::server
+
+#include "Arduino.h"
+
+#define WL_IDLE_STATUS 0
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+#define WIFI_STA 1
+typedef int wl_status_t;
+
+class IPAddress : public Printable {
+public:
+    IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) : bytes{a, b, c, d} {}
+    size_t printTo(Print& p) const override;
+    std::string toString() const;
+
+private:
+    uint8_t bytes[4];
+};
+
+class WiFiClient : public Stream {
+public:
+    WiFiClient() {}
+    ~WiFiClient() { stop(); }
+    WiFiClient(const WiFiClient&) = delete;
+    WiFiClient& operator=(const WiFiClient&) = delete;
+
+    int connect(const char* host, uint16_t port) { return connect(host, port, 3000); }
+    int connect(const char* host, uint16_t port, int32_t timeoutMs);
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* buffer, size_t size) override;
+    using Print::write;
+    int available() override;
+    int read() override;
+    int read(uint8_t* buffer, size_t size);
+    void stop();
+    uint8_t connected();
+    void setNoDelay(bool noDelay);
+    operator bool() { return connected(); }
+
+private:
+    int fd = -1;
+};
+
+class WiFiClass {
+public:
+    void mode(int) {}
+    void begin(const char* ssid, const char* password);
+    void disconnect() { joined = false; }
+    wl_status_t status();
+    IPAddress localIP();
+
+private:
+    bool joined = false;
+    uint64_t joinAtNs = 0;
+};
+extern WiFiClass WiFi;
@@ -0,0 +1,635 @@
+// The simulated hardware behind the host build; hal.h says what each part
+// models.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <sstream>
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "SPIFFS.h"
+#include "WiFi.h"
+
+HalOptions halOptions;
+HalLedStats halLeds;
+HalKeyStats halKeys;
+HalNetStats halNet;
+
+HardwareSerial Serial;
+EspClass ESP;
+SPIFFSFS SPIFFS;
+WiFiClass WiFi;
+
+static uint64_t nowNs = 0;
+static int pinLevel[64];
+
+// clock
+
+uint64_t hal_now_ns()
+{
+    return nowNs;
+}
+
+void hal_advance_ns(uint64_t ns)
+{
+    nowNs += ns;
+    if (nowNs >= halOptions.runNs)
+    {
+        hal_finish();
+    }
+}
+
+unsigned long micros()
+{
+    return static_cast<unsigned long>(nowNs / 1000);
+}
+
+unsigned long millis()
+{
+    return static_cast<unsigned long>(nowNs / 1000000);
+}
+
+void delay(unsigned long ms)
+{
+    hal_advance_ns(static_cast<uint64_t>(ms) * 1000000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    hal_advance_ns(static_cast<uint64_t>(us) * 1000);
+}
+
+void yield()
+{
+}
+
+uint32_t EspClass::getCycleCount()
+{
+    return static_cast<uint32_t>(nowNs * getCpuFreqMHz() / 1000);
+}
+
+// LED matrix: shift registers behind a latch, rows picked by a decade counter
+
+static struct {
+    int latchPin = -1;
+    int resetPin = -1;
+    int rows = 0;
+    int registers = 0;
+    int counter = 0;                      // decade counter output
+    std::vector<uint8_t> shifting;        // bytes clocked in since the latch went low
+    std::vector<uint8_t> picture;         // rows * registers, as last latched
+    std::vector<uint8_t> lastRefresh;     // the picture at the last whole refresh
+    FILE* log = nullptr;
+} leds;
+
+void hal_leds_wire(int latchPin, int resetPin, int rows, int registers)
+{
+    leds.latchPin = latchPin;
+    leds.resetPin = resetPin;
+    leds.rows = rows;
+    leds.registers = registers;
+    leds.picture.assign(rows * registers, 0);
+    leds.lastRefresh.assign(rows * registers, 0);
+    if (!halOptions.ledLog.empty())
+    {
+        leds.log = fopen(halOptions.ledLog.c_str(), "w");
+    }
+}
+
+void hal_spi_byte(uint8_t value, uint32_t clockHz)
+{
+    if (leds.latchPin >= 0 && pinLevel[leds.latchPin] == LOW)
+    {
+        leds.shifting.push_back(value);
+    }
+    hal_advance_ns(HAL_SPI_CALL_NS + 8ULL * 1000000000 / (clockHz > 0 ? clockHz : 1));
+}
+
+void hal_spi_bytes(const uint8_t* data, size_t size, uint32_t clockHz)
+{
+    if (leds.latchPin >= 0 && pinLevel[leds.latchPin] == LOW)
+    {
+        leds.shifting.insert(leds.shifting.end(), data, data + size);
+    }
+    hal_advance_ns(HAL_SPI_CALL_NS + size * 8ULL * 1000000000 / (clockHz > 0 ? clockHz : 1));
+}
+
+static void leds_latch()
+{
+    int row = leds.counter;
+    halLeds.latches++;
+    // the last bytes shifted in are the ones left in the chain
+    size_t keep = std::min(leds.shifting.size(), static_cast<size_t>(leds.registers));
+    if (row < leds.rows)
+    {
+        std::copy(leds.shifting.end() - keep, leds.shifting.end(), leds.picture.begin() + row * leds.registers);
+    }
+    if (leds.log != nullptr)
+    {
+        fprintf(leds.log, "%llu %d", static_cast<unsigned long long>(nowNs / 1000), row);
+        for (size_t b = leds.shifting.size() - keep; b < leds.shifting.size(); b++)
+        {
+            fprintf(leds.log, " %02x", leds.shifting[b]);
+        }
+        fputc('\n', leds.log);
+    }
+    leds.shifting.clear();
+
+    if (row == leds.rows - 1)
+    {
+        if (halLeds.refreshes > 0)
+        {
+            uint64_t gap = nowNs - halLeds.lastRefreshNs;
+            halLeds.minRefreshNs = halLeds.refreshes == 1 ? gap : std::min(halLeds.minRefreshNs, gap);
+            halLeds.maxRefreshNs = std::max(halLeds.maxRefreshNs, gap);
+        }
+        else
+        {
+            halLeds.firstRefreshNs = nowNs;
+        }
+        halLeds.refreshes++;
+        halLeds.lastRefreshNs = nowNs;
+        if (leds.picture != leds.lastRefresh)
+        {
+            halLeds.changes++;
+            leds.lastRefresh = leds.picture;
+        }
+    }
+    // the counter moves on with the latch pulse, unless reset holds it at 0
+    if (leds.resetPin < 0 || pinLevel[leds.resetPin] == LOW)
+    {
+        leds.counter = (leds.counter + 1) % HAL_DECADE_OUTPUTS;
+    }
+}
+
+// Keyboard: a chain of 74HC165s fed from the key script
+
+struct KeyEvent {
+    uint64_t atNs;
+    int key;
+    bool down;
+};
+
+static struct {
+    int loadPin = -1;
+    int clockPin = -1;
+    int inhibitPin = -1;
+    int dataPin = -1;
+    std::vector<int> keyOfBit;
+    std::vector<uint8_t> chain;        // chain[0] is on the data pin
+    std::vector<KeyEvent> script;
+    size_t nextEvent = 0;
+    std::vector<uint8_t> down;         // key state at the current time
+} keys;
+
+void hal_keys_wire(int loadPin, int clockPin, int inhibitPin, int dataPin, const int* keyOfBit, int bits)
+{
+    keys.loadPin = loadPin;
+    keys.clockPin = clockPin;
+    keys.inhibitPin = inhibitPin;
+    keys.dataPin = dataPin;
+    keys.keyOfBit.assign(keyOfBit, keyOfBit + bits);
+    keys.chain.assign(bits, 0);
+    int most = 0;
+    for (int b = 0; b < bits; b++)
+    {
+        most = std::max(most, keyOfBit[b] + 1);
+    }
+    keys.down.assign(most, 0);
+}
+
+bool hal_load_key_script()
+{
+    std::ifstream file(halOptions.keyScript);
+    if (!file)
+    {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line))
+    {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        double ms;
+        int key;
+        int down;
+        if (fields >> ms >> key >> down)
+        {
+            keys.script.push_back({static_cast<uint64_t>(ms * 1000000), key, down != 0});
+        }
+    }
+    std::stable_sort(keys.script.begin(), keys.script.end(),
+                     [](const KeyEvent& a, const KeyEvent& b) { return a.atNs < b.atNs; });
+    return true;
+}
+
+static void keys_load()
+{
+    while (keys.nextEvent < keys.script.size() && keys.script[keys.nextEvent].atNs <= nowNs)
+    {
+        const KeyEvent& event = keys.script[keys.nextEvent++];
+        if (event.key >= 0 && event.key < static_cast<int>(keys.down.size()))
+        {
+            keys.down[event.key] = event.down;
+        }
+        halKeys.events++;
+    }
+    for (size_t b = 0; b < keys.chain.size(); b++)
+    {
+        int key = keys.keyOfBit[b];
+        keys.chain[b] = key >= 0 && keys.down[key];
+    }
+    halKeys.scans++;
+}
+
+static void keys_shift()
+{
+    if (!keys.chain.empty())
+    {
+        keys.chain.erase(keys.chain.begin());
+        keys.chain.push_back(0); // serial input is tied low
+    }
+}
+
+// pins
+
+void pinMode(int, int)
+{
+}
+
+void digitalWrite(int pin, int value)
+{
+    if (pin < 0 || pin >= 64)
+    {
+        return;
+    }
+    int was = pinLevel[pin];
+    pinLevel[pin] = value ? HIGH : LOW;
+    hal_advance_ns(HAL_PIN_WRITE_NS);
+
+    if (pin == leds.latchPin && was == LOW && value)
+    {
+        leds_latch();
+    }
+    if (pin == leds.resetPin && value)
+    {
+        leds.counter = 0;
+    }
+    if (pin == keys.loadPin && !value)
+    {
+        keys_load(); // parallel load happens while the pin is low
+    }
+    if (pin == keys.clockPin && was == LOW && value && pinLevel[keys.loadPin] == HIGH && pinLevel[keys.inhibitPin] == LOW)
+    {
+        keys_shift();
+    }
+}
+
+int digitalRead(int pin)
+{
+    hal_advance_ns(HAL_PIN_WRITE_NS);
+    if (pin == keys.dataPin && keys.dataPin >= 0)
+    {
+        return keys.chain.empty() ? LOW : (keys.chain[0] ? HIGH : LOW);
+    }
+    return pin >= 0 && pin < 64 ? pinLevel[pin] : LOW;
+}
+
+// Serial: bytes leave at the baud rate through a small FIFO
+
+static uint64_t serialBusyUntilNs = 0;
+static bool stdinClosed = false;
+
+void HardwareSerial::begin(unsigned long)
+{
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    const uint64_t byteNs = 10ULL * 1000000000 / HAL_SERIAL_BAUD; // start + 8 + stop bits
+    uint64_t queued = serialBusyUntilNs > nowNs ? serialBusyUntilNs - nowNs : 0;
+    if (queued > byteNs * HAL_SERIAL_BUFFER)
+    {
+        hal_advance_ns(queued - byteNs * HAL_SERIAL_BUFFER); // wait for room in the FIFO
+    }
+    serialBusyUntilNs = std::max(serialBusyUntilNs, nowNs) + byteNs;
+    if (!halOptions.quiet)
+    {
+        fputc(c, stdout);
+    }
+    return 1;
+}
+
+int HardwareSerial::availableForWrite()
+{
+    const uint64_t byteNs = 10ULL * 1000000000 / HAL_SERIAL_BAUD;
+    uint64_t queued = serialBusyUntilNs > nowNs ? (serialBusyUntilNs - nowNs + byteNs - 1) / byteNs : 0;
+    return queued < HAL_SERIAL_BUFFER ? HAL_SERIAL_BUFFER - queued : 0;
+}
+
+int HardwareSerial::available()
+{
+    if (stdinClosed)
+    {
+        return 0;
+    }
+    pollfd in = {0, POLLIN, 0};
+    return poll(&in, 1, 0) > 0 && (in.revents & (POLLIN | POLLHUP)) ? 1 : 0;
+}
+
+int HardwareSerial::read()
+{
+    if (!available())
+    {
+        return -1;
+    }
+    unsigned char c;
+    if (::read(0, &c, 1) != 1)
+    {
+        stdinClosed = true;
+        return -1;
+    }
+    return c;
+}
+
+size_t Print::printNumber(unsigned long long value, int base)
+{
+    char digits[65];
+    int n = 0;
+    if (base < 2)
+    {
+        base = DEC;
+    }
+    do
+    {
+        int digit = value % base;
+        digits[n++] = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        value /= base;
+    } while (value > 0);
+    size_t written = 0;
+    while (n > 0)
+    {
+        written += write(static_cast<uint8_t>(digits[--n]));
+    }
+    return written;
+}
+
+size_t Print::printSigned(long long value, int base)
+{
+    if (value < 0 && base == DEC)
+    {
+        return write(static_cast<uint8_t>('-')) + printNumber(-static_cast<unsigned long long>(value), base);
+    }
+    return printNumber(static_cast<unsigned long long>(value), base);
+}
+
+size_t Print::print(double value, int digits)
+{
+    char text[64];
+    snprintf(text, sizeof(text), "%.*f", digits, value);
+    return write(text);
+}
+
+size_t Print::printf(const char* format, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    return write(text);
+}
+
+// SPIFFS
+
+static std::string spiffs_path(const char* path)
+{
+    return halOptions.spiffsDir + (path[0] == '/' ? "" : "/") + path;
+}
+
+bool SPIFFSFS::begin(bool)
+{
+    std::error_code error;
+    std::filesystem::create_directories(halOptions.spiffsDir, error);
+    return !error;
+}
+
+size_t SPIFFSFS::usedBytes()
+{
+    size_t used = 0;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(halOptions.spiffsDir, error))
+    {
+        used += entry.is_regular_file() ? entry.file_size() : 0;
+    }
+    return used;
+}
+
+fs::File fs::FS::open(const char* path, const char* mode)
+{
+    std::string how = mode[0] == 'w' ? "w+b" : mode[0] == 'a' ? "a+b" : "rb";
+    FILE* file = fopen(spiffs_path(path).c_str(), how.c_str());
+    return file != nullptr ? File(file) : File();
+}
+
+bool fs::FS::exists(const char* path)
+{
+    struct stat info;
+    return stat(spiffs_path(path).c_str(), &info) == 0;
+}
+
+bool fs::FS::remove(const char* path)
+{
+    return ::remove(spiffs_path(path).c_str()) == 0;
+}
+
+bool fs::FS::rename(const char* from, const char* to)
+{
+    return ::rename(spiffs_path(from).c_str(), spiffs_path(to).c_str()) == 0;
+}
+
+// WiFi and sockets
+
+size_t IPAddress::printTo(Print& p) const
+{
+    size_t n = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        n += p.print(static_cast<unsigned>(bytes[i]));
+        if (i < 3)
+        {
+            n += p.print('.');
+        }
+    }
+    return n;
+}
+
+std::string IPAddress::toString() const
+{
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+    return text;
+}
+
+void WiFiClass::begin(const char*, const char*)
+{
+    joined = true;
+    joinAtNs = nowNs + halOptions.wifiJoinNs;
+}
+
+wl_status_t WiFiClass::status()
+{
+    return joined && nowNs >= joinAtNs ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+IPAddress WiFiClass::localIP()
+{
+    return status() == WL_CONNECTED ? IPAddress(127, 0, 0, 1) : IPAddress();
+}
+
+int WiFiClient::connect(const char*, uint16_t port, int32_t timeoutMs)
+{
+    stop();
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(halOptions.serverPort != 0 ? halOptions.serverPort : port);
+    if (inet_pton(AF_INET, halOptions.server.c_str(), &address.sin_addr) != 1)
+    {
+        halNet.failedConnects++;
+        return 0;
+    }
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        ::close(fd);
+        fd = -1;
+        halNet.failedConnects++;
+        return 0;
+    }
+    halNet.connects++;
+    return 1;
+}
+
+size_t WiFiClient::write(const uint8_t* buffer, size_t size)
+{
+    size_t sent = 0;
+    while (fd >= 0 && sent < size)
+    {
+        ssize_t put = send(fd, buffer + sent, size - sent, MSG_NOSIGNAL);
+        if (put <= 0)
+        {
+            break;
+        }
+        sent += put;
+    }
+    halNet.bytesOut += sent;
+    return sent;
+}
+
+int WiFiClient::available()
+{
+    if (fd < 0)
+    {
+        return 0;
+    }
+    int waiting = 0;
+    ioctl(fd, FIONREAD, &waiting);
+    if (waiting == 0)
+    {
+        // nothing yet: let real time pass for the server, and the same on our clock
+        pollfd ready = {fd, POLLIN, 0};
+        poll(&ready, 1, HAL_NET_WAIT_US / 1000);
+        hal_advance_ns(HAL_NET_WAIT_US * 1000ULL);
+        ioctl(fd, FIONREAD, &waiting);
+    }
+    return waiting;
+}
+
+int WiFiClient::read(uint8_t* buffer, size_t size)
+{
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ssize_t got = recv(fd, buffer, size, MSG_DONTWAIT);
+    if (got > 0)
+    {
+        halNet.bytesIn += got;
+    }
+    return got > 0 ? static_cast<int>(got) : -1;
+}
+
+int WiFiClient::read()
+{
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+void WiFiClient::stop()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+uint8_t WiFiClient::connected()
+{
+    if (fd < 0)
+    {
+        return 0;
+    }
+    char c;
+    ssize_t got = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return got > 0 || (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+void WiFiClient::setNoDelay(bool noDelay)
+{
+    int flag = noDelay;
+    if (fd >= 0)
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+}
+
+// the report
+
+void hal_finish()
+{
+    fflush(stdout);
+    double seconds = nowNs / 1e9;
+    fprintf(stderr, "\nsimulated %.3f s\n", seconds);
+    double active = (halLeds.lastRefreshNs - halLeds.firstRefreshNs) / 1e9;
+    fprintf(stderr, "leds: %llu rows latched, %llu refreshes (%.1f Hz while drawing, gaps %.3f-%.3f ms), %llu picture changes\n",
+            static_cast<unsigned long long>(halLeds.latches), static_cast<unsigned long long>(halLeds.refreshes),
+            active > 0 ? (halLeds.refreshes - 1) / active : 0.0,
+            halLeds.minRefreshNs / 1e6, halLeds.maxRefreshNs / 1e6, static_cast<unsigned long long>(halLeds.changes));
+    fprintf(stderr, "keys: %llu scans, %llu scripted events\n",
+            static_cast<unsigned long long>(halKeys.scans), static_cast<unsigned long long>(halKeys.events));
+    fprintf(stderr, "net: %llu connects (%llu failed), %llu bytes in, %llu bytes out\n",
+            static_cast<unsigned long long>(halNet.connects), static_cast<unsigned long long>(halNet.failedConnects),
+            static_cast<unsigned long long>(halNet.bytesIn), static_cast<unsigned long long>(halNet.bytesOut));
+    if (leds.log != nullptr)
+    {
+        fclose(leds.log);
+    }
+    exit(0);
+}
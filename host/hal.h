@@ -0,0 +1,96 @@
+#pragma once
+
+// The simulated hardware behind the host build (see main.cpp).
+//
+// The Arduino calls the sketch makes (Arduino.h, SPI.h, WiFi.h, SPIFFS.h in
+// this directory) land here instead of on the ESP32:
+//
+//   clock      simulated, in nanoseconds. It only moves when the hardware
+//              would take time: delay(), SPI bytes at the bus clock, pin
+//              writes, Serial bytes draining at the baud rate, waiting on
+//              the network. CPU work is free, so two runs of the same song
+//              give the same numbers.
+//   LEDs       SPI bytes shifted in while the latch pin is low are latched
+//              as one row on its rising edge; the decade counter picks the
+//              row and its reset pin sends it back to row 0. Every latch is
+//              counted and can be logged with its timestamp.
+//   keyboard   a 74HC165 chain: load pin low copies the scripted key state
+//              in, each clock rising edge shifts one bit out of the data pin.
+//   SPIFFS     files in a directory on the host.
+//   network    real sockets; every connection goes to one loopback server.
+//
+// The costs below are rough figures for the ESP32 Arduino core. They only
+// need to be in the right proportion to each other for comparisons between
+// builds to mean something.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#define HAL_PIN_WRITE_NS 100          // digitalWrite / digitalRead
+#define HAL_SPI_CALL_NS 500           // overhead of one transfer() or writeBytes() call
+#define HAL_SERIAL_BAUD 115200
+#define HAL_SERIAL_BUFFER 128         // UART FIFO; writes wait once it is full
+#define HAL_NET_WAIT_US 1000          // an empty socket read waits this long for data
+#define HAL_DECADE_OUTPUTS 10         // CD4017
+
+struct HalOptions {
+    uint64_t runNs = 10ULL * 1000 * 1000 * 1000;  // stop after this much simulated time
+    uint64_t wifiJoinNs = 1500ULL * 1000 * 1000;  // access point "answers" after this long
+    std::string server = "127.0.0.1";             // where every connection goes
+    uint16_t serverPort = 0;                      // and on which port, 0 for the sketch's own
+    std::string spiffsDir = "spiffs";
+    std::string ledLog;                           // file for every latched row, if set
+    std::string keyScript;                        // file of scripted key presses, if set
+    bool quiet = false;                           // drop Serial output (it still costs time)
+};
+
+// What the LED matrix saw
+struct HalLedStats {
+    uint64_t latches = 0;
+    uint64_t refreshes = 0;      // latches of the last row: one whole picture
+    uint64_t changes = 0;        // refreshes that showed a different picture
+    uint64_t firstRefreshNs = 0;
+    uint64_t lastRefreshNs = 0;
+    uint64_t minRefreshNs = 0;   // shortest / longest time between refreshes
+    uint64_t maxRefreshNs = 0;
+};
+
+struct HalKeyStats {
+    uint64_t events = 0;         // scripted presses and releases so far
+    uint64_t scans = 0;          // parallel loads of the 165 chain
+};
+
+struct HalNetStats {
+    uint64_t connects = 0;
+    uint64_t failedConnects = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+};
+
+extern HalOptions halOptions;
+extern HalLedStats halLeds;
+extern HalKeyStats halKeys;
+extern HalNetStats halNet;
+
+uint64_t hal_now_ns();
+void hal_advance_ns(uint64_t ns); // ends the run (hal_finish) once runNs is reached
+
+// Which pins the LED rows hang off, and how many rows / register bytes a picture has
+void hal_leds_wire(int latchPin, int resetPin, int rows, int registers);
+
+// Which pins the 165 chain uses; keyOfBit[b] is the key the b-th bit out
+// belongs to, -1 for an unused input
+void hal_keys_wire(int loadPin, int clockPin, int inhibitPin, int dataPin, const int* keyOfBit, int bits);
+
+// Read options.keyScript: lines of "<ms> <key> <1 down | 0 up>", key as a
+// frame index, '#' starts a comment. Returns false if it can't be read.
+bool hal_load_key_script();
+
+// Called by SPIClass for every byte shifted out, or once for a whole burst
+void hal_spi_byte(uint8_t value, uint32_t clockHz);
+void hal_spi_bytes(const uint8_t* data, size_t size, uint32_t clockHz);
+
+// Print what the simulated hardware measured and exit
+[[noreturn]] void hal_finish();
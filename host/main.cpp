@@ -0,0 +1,76 @@
+// Host build: the whole sketch as a Linux program, on simulated hardware
+// (hal.h). setup() and loop() run exactly as on the board; the run stops
+// after --run-ms of simulated time and prints what the LEDs, keyboard and
+// network saw. Start a server first (song_server.py or
+// tools/session_server.cpp); connections to the sketch's host address go
+// to --server instead.
+//
+// Build:  g++ -std=gnu++17 -O2 -pthread -I. -I../Final_Code main.cpp hal.cpp -o pianohero
+// Usage:  ./pianohero [--run-ms N] [--wifi-ms N] [--server ADDR[:PORT]] [--spiffs DIR]
+//                     [--leds FILE] [--keys FILE] [--quiet]
+
+#include "Final_Code.ino"
+
+int main(int argc, char** argv)
+{
+    for (int arg = 1; arg < argc; arg++)
+    {
+        std::string option = argv[arg];
+        bool hasValue = arg + 1 < argc;
+        if (option == "--quiet")
+        {
+            halOptions.quiet = true;
+        }
+        else if (option == "--run-ms" && hasValue)
+        {
+            halOptions.runNs = strtoull(argv[++arg], nullptr, 10) * 1000000;
+        }
+        else if (option == "--wifi-ms" && hasValue)
+        {
+            halOptions.wifiJoinNs = strtoull(argv[++arg], nullptr, 10) * 1000000;
+        }
+        else if (option == "--server" && hasValue)
+        {
+            halOptions.server = argv[++arg];
+            size_t colon = halOptions.server.find(':');
+            if (colon != std::string::npos)
+            {
+                halOptions.serverPort = atoi(halOptions.server.c_str() + colon + 1);
+                halOptions.server.erase(colon);
+            }
+        }
+        else if (option == "--spiffs" && hasValue)
+        {
+            halOptions.spiffsDir = argv[++arg];
+        }
+        else if (option == "--leds" && hasValue)
+        {
+            halOptions.ledLog = argv[++arg];
+        }
+        else if (option == "--keys" && hasValue)
+        {
+            halOptions.keyScript = argv[++arg];
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--run-ms N] [--wifi-ms N] [--server ADDR[:PORT]] [--spiffs DIR] [--leds FILE] [--keys FILE] [--quiet]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!halOptions.keyScript.empty() && !hal_load_key_script())
+    {
+        fprintf(stderr, "can't read %s\n", halOptions.keyScript.c_str());
+        return 1;
+    }
+
+    // wire the simulated parts to the sketch's pins
+    hal_leds_wire(SPIClass(VSPI).pinSS(), 4, ActiveKeyboard::rows, ActiveKeyboard::registers);
+    std::vector<int> keyOfBit(ActiveKeyboard::scan.key, ActiveKeyboard::scan.key + ActiveKeyboard::scanBits);
+    hal_keys_wire(shift_load, clock_pin, clock_inhibit, q_h, keyOfBit.data(), ActiveKeyboard::scanBits);
+
+    setup();
+    for (;;)
+    {
+        loop();
+    }
+}
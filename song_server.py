@@ -0,0 +1,235 @@
+# Headless stand-in for the guitest.py server, for testing the device (or
+# a host build of it) without the GUI:
+#
+#   python3 song_server.py cmaj.mid,pir2.mid [--raw] [--stats] [--catalog catalog.bin]
+#
+# Serves each file in turn, one per GET, and stops once the device asks
+# for one past the last. A GET with the compressed option gets the song
+# LZSS-compressed (see Final_Code/lz_stream.h) unless --raw is given.
+# Practice logs the device uploads are appended to practice.log (records
+# as in Final_Code/practice_record.h). A LIST gets the catalog file given
+# with --catalog (built by tools/indexer, see Final_Code/song_catalog.h).
+# guitest.py and test.py use serve() from here too.
+
+import socket
+import struct
+import sys
+
+WINDOW = 4096
+MIN_MATCH = 3
+MAX_MATCH = 18
+CHAIN = 64 # earlier positions tried per match
+
+
+def compress(data):
+    out = bytearray(b'PHZ1' + struct.pack('<I', len(data)))
+    positions = {} # 3 byte prefix -> where it has been seen
+    i = 0
+    n = len(data)
+    while i < n:
+        flag_at = len(out)
+        out.append(0)
+        flags = 0
+        for bit in range(8):
+            if i >= n:
+                break
+            best_len = 0
+            best_distance = 0
+            if i + MIN_MATCH <= n:
+                for p in reversed(positions.get(data[i:i + MIN_MATCH], [])[-CHAIN:]):
+                    distance = i - p
+                    if distance > WINDOW:
+                        break
+                    length = MIN_MATCH
+                    while length < MAX_MATCH and i + length < n and data[p + length] == data[i + length]:
+                        length += 1
+                    if length > best_len:
+                        best_len = length
+                        best_distance = distance
+                        if length == MAX_MATCH:
+                            break
+            if best_len >= MIN_MATCH:
+                out.append((best_distance - 1) & 0xFF)
+                out.append((((best_distance - 1) >> 8) << 4) | (best_len - MIN_MATCH))
+                step = best_len
+            else:
+                flags |= 1 << bit
+                out.append(data[i])
+                step = 1
+            for j in range(i, i + step):
+                if j + MIN_MATCH <= n:
+                    positions.setdefault(data[j:j + MIN_MATCH], []).append(j)
+            i += step
+        out[flag_at] = flags
+    return bytes(out)
+
+
+def decompress(data):
+    """Undo compress(); data that isn't compressed comes back as it is"""
+    if data[:4] != b'PHZ1':
+        return data
+    expected = struct.unpack('<I', data[4:8])[0]
+    out = bytearray()
+    i = 8
+    while len(out) < expected:
+        flags = data[i]
+        i += 1
+        for bit in range(8):
+            if len(out) >= expected:
+                break
+            if flags & (1 << bit):
+                out.append(data[i])
+                i += 1
+            else:
+                distance = (data[i] | ((data[i + 1] & 0xF0) << 4)) + 1
+                length = (data[i + 1] & 0x0F) + MIN_MATCH
+                i += 2
+                for _ in range(length):
+                    out.append(out[-distance])
+    return bytes(out)
+
+
+PRACTICE_RECORD = struct.Struct('<IIiBBBB') # frame, timeUs, deltaUs, key, level, chord, kind
+PRACTICE_KINDS = {1: 'songs', 2: 'speed changes', 3: 'hits', 4: 'misses', 5: 'extras'}
+
+
+# The session protocol (see Final_Code/session.h): every message is a frame
+# of length, request id, command and status, and the device keeps one
+# connection open for all of its requests.
+HEADER = struct.Struct('<IHBB')
+MAX_CHUNK = 1024
+GET, PUT, LIST, STAT, PING, LOG = 1, 2, 3, 4, 5, 6
+MORE = 0x40
+REPLY = 0x80
+COMMAND_MASK = 0x3F
+OK, NOT_FOUND, BAD_REQUEST, FAILED = 0, 1, 2, 3
+GET_COMPRESSED = 0x01
+
+
+def read_exact(client, n):
+    data = bytearray()
+    while len(data) < n:
+        part = client.recv(n - len(data))
+        if not part:
+            raise ConnectionError("device hung up")
+        data += part
+    return bytes(data)
+
+
+def read_message(client):
+    """One whole message: (id, command, status, payload)"""
+    payload = bytearray()
+    while True:
+        length, request_id, command, status = HEADER.unpack(read_exact(client, HEADER.size))
+        payload += read_exact(client, length - 4)
+        if not command & MORE:
+            return request_id, command, status, bytes(payload)
+
+
+def send_message(client, request_id, command, status, payload=b''):
+    sent = 0
+    while True:
+        chunk = payload[sent:sent + MAX_CHUNK]
+        sent += len(chunk)
+        more = MORE if sent < len(payload) else 0
+        client.sendall(HEADER.pack(4 + len(chunk), request_id, command | more, status) + chunk)
+        if not more:
+            break
+
+
+def serve(songs, port=1235, compressed=True, log=print, catalog=None, stats=False):
+    next_song = 0
+
+    log("Running TCP Socket server...")
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(('0.0.0.0', port))
+    s.listen(0)
+
+    while next_song <= len(songs):
+        client, addr = s.accept()
+        log(f"Connection from {addr} has been established!")
+        client.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        try:
+            if stats:
+                # the device answers with its probe dump whenever it is asked
+                send_message(client, 0, STAT, OK)
+            while True:
+                request_id, command, status, payload = read_message(client)
+                if command & REPLY:
+                    # STAT is the only thing we ever ask the device
+                    if command & COMMAND_MASK == STAT:
+                        log(str(payload, 'utf-8', errors='replace'))
+                    continue
+                command &= COMMAND_MASK
+                if command == GET:
+                    log("GET")
+                    if next_song >= len(songs):
+                        # the device fetches the next song while this one
+                        # plays, so only stop once it has asked past the end
+                        send_message(client, request_id, command | REPLY, NOT_FOUND)
+                        next_song += 1
+                        break
+                    song = songs[next_song]
+                    next_song += 1
+                    if payload[:1] and payload[0] & GET_COMPRESSED and compressed:
+                        packed = compress(song)
+                        # the device spots the format itself, so tiny files can go as they are
+                        if len(packed) < len(song):
+                            log(f"Sending {len(packed)} bytes for a {len(song)} byte song")
+                            song = packed
+                    send_message(client, request_id, command | REPLY, OK, song)
+                elif command == PUT:
+                    log(f"PUT, {len(payload)} bytes")
+                    with open("received_recording.mid", "wb") as received:
+                        received.write(payload)
+                    send_message(client, request_id, command | REPLY, OK)
+                elif command == LIST:
+                    log("LIST")
+                    if catalog is None:
+                        send_message(client, request_id, command | REPLY, NOT_FOUND)
+                    else:
+                        send_message(client, request_id, command | REPLY, OK, catalog)
+                elif command == STAT:
+                    # probe dump text from the device
+                    log(str(payload, 'utf-8', errors='replace'))
+                    send_message(client, request_id, command | REPLY, OK)
+                elif command == PING:
+                    send_message(client, request_id, command | REPLY, OK, payload)
+                elif command == LOG:
+                    try:
+                        records = decompress(payload)
+                    except IndexError:
+                        records = b'?' # cut short
+                    if len(records) % PRACTICE_RECORD.size:
+                        send_message(client, request_id, command | REPLY, BAD_REQUEST)
+                        continue
+                    counts = {}
+                    for record in PRACTICE_RECORD.iter_unpack(records):
+                        counts[record[6]] = counts.get(record[6], 0) + 1
+                    log(f"LOG, {len(payload)} bytes: " + ", ".join(
+                        f"{counts.get(kind, 0)} {name}" for kind, name in PRACTICE_KINDS.items()))
+                    with open("practice.log", "ab") as practice:
+                        practice.write(records)
+                    send_message(client, request_id, command | REPLY, OK)
+                else:
+                    send_message(client, request_id, command | REPLY, BAD_REQUEST)
+        except (ConnectionError, OSError) as error:
+            log(f"Connection closed: {error}")
+        client.close()
+    s.close()
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print("usage: song_server.py file.mid[,file2.mid...] [--raw] [--stats] [--catalog catalog.bin]")
+        sys.exit(1)
+    songs = []
+    for name in sys.argv[1].split(','):
+        with open(name.strip(), 'rb') as f:
+            songs.append(f.read())
+    catalog = None
+    if '--catalog' in sys.argv[2:-1]:
+        with open(sys.argv[sys.argv.index('--catalog', 2) + 1], 'rb') as f:
+            catalog = f.read()
+    serve(songs, compressed='--raw' not in sys.argv[2:], catalog=catalog, stats='--stats' in sys.argv[2:])
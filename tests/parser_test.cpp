@@ -0,0 +1,248 @@
+// Parser checks: songs are built in memory, run through the firmware's own
+// measure / parse / frame steps (Final_Code/midi_parser.h), and what each
+// step decides is compared. Prints one line per failed check and exits
+// non-zero if there was one.
+//
+// Build:  g++ -std=c++17 -O2 -I../Final_Code parser_test.cpp -o parser_test
+// Usage:  ./parser_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// The parser logs what it finds; nobody is listening here
+#define LOG_LEVEL LOG_LEVEL_OFF
+
+#include "midi_parser.h"
+
+#define TEST_ARENA (256 * 1024)
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                \
+    do                                                  \
+    {                                                   \
+        if (!(cond))                                    \
+        {                                               \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                        \
+            printf("\n");                               \
+            failures++;                                 \
+        }                                               \
+    } while (0)
+
+static void putVariableLength(std::string& out, unsigned long value)
+{
+    unsigned char bytes[5];
+    int count = 0;
+    do
+    {
+        bytes[count++] = value & 0x7F;
+        value >>= 7;
+    } while (value);
+    while (count > 1)
+    {
+        out += static_cast<char>(bytes[--count] | 0x80);
+    }
+    out += static_cast<char>(bytes[0]);
+}
+
+static void putBigEndian(std::string& out, unsigned long value, int bytes)
+{
+    while (bytes--)
+    {
+        out += static_cast<char>((value >> (8 * bytes)) & 0xFF);
+    }
+}
+
+// A song at 480 ticks a quarter from its track chunks' events
+static std::string makeSong(const std::vector<std::string>& tracks)
+{
+    std::string song = "MThd";
+    putBigEndian(song, 6, 4);
+    putBigEndian(song, tracks.size() > 1 ? 1 : 0, 2);
+    putBigEndian(song, tracks.size(), 2);
+    putBigEndian(song, 480, 2);
+    for (const std::string& events : tracks)
+    {
+        song += "MTrk";
+        putBigEndian(song, events.size() + 4, 4);
+        song += events;
+        song += std::string("\x00\xFF\x2F\x00", 4);
+    }
+    return song;
+}
+
+static std::string setTempo(unsigned long delta, unsigned long usPerQuarter)
+{
+    std::string event;
+    putVariableLength(event, delta);
+    event += std::string("\xFF\x51\x03", 3);
+    putBigEndian(event, usPerQuarter, 3);
+    return event;
+}
+
+// `quarters` middle Cs a quarter apart
+static std::string quarterNotes(int quarters)
+{
+    std::string events;
+    for (int q = 0; q < quarters; q++)
+    {
+        putVariableLength(events, 0);
+        events += std::string("\x90\x3C\x64", 3);
+        putVariableLength(events, 480);
+        events += std::string("\x80\x3C\x00", 3);
+    }
+    return events;
+}
+
+// 4/4 with the given 32nd notes per quarter
+static std::string timeSignature(unsigned long delta, unsigned char bb)
+{
+    std::string event;
+    putVariableLength(event, delta);
+    event += std::string("\xFF\x58\x04\x04\x02\x18", 6);
+    event += static_cast<char>(bb);
+    return event;
+}
+
+// One track: a time signature, then `quarters` quarter notes
+static std::string makeGridSong(unsigned char bb, int quarters)
+{
+    return makeSong({timeSignature(0, bb) + quarterNotes(quarters)});
+}
+
+// The same song with a longer MThd chunk, as a later MIDI revision might
+// write: readers skip what they don't know by the chunk's size
+static std::string longHeader(const std::string& song)
+{
+    std::string longer = song.substr(0, 4);
+    putBigEndian(longer, 8, 4);
+    return longer + song.substr(8, 6) + std::string("\x12\x34", 2) + song.substr(14);
+}
+
+// Every step has to agree on the grid, or the frames outgrow what was measured
+static void checkGrid(const char* name, const std::string& song, int expectStep)
+{
+    SongArena arena;
+    if (!arena_init(arena, TEST_ARENA))
+    {
+        printf("FAIL %s: no arena\n", name);
+        failures++;
+        return;
+    }
+
+    {
+        MidiData scanned(arena);
+        CHECK(scanSong(reinterpret_cast<const unsigned char*>(song.data()), song.size(), arena, scanned), "%s: scanSong", name);
+        CHECK(song_grid_step(scanned.grid, scanned.division) == expectStep,
+              "%s: scanSong grid", name);
+    }
+    arena_reset(arena);
+
+    SongSizing sizing;
+    CHECK(measureSong(song, arena, sizing), "%s: measureSong", name);
+    CHECK(song_grid_step(sizing.grid, sizing.division) == expectStep,
+          "%s: measureSong grid", name);
+    size_t measured = sizing.bytes;
+    size_t before = arena.used;
+
+    std::istringstream midiFile(song);
+    midiFile.ignore(4); // "MThd", measureSong() checks it
+    MidiData midiData(arena);
+    bool parsed = parseSong(midiFile, sizing, arena, midiData);
+    CHECK(parsed, "%s: parseSong", name);
+    if (parsed)
+    {
+        CHECK(buildFrames(midiData), "%s: buildFrames", name);
+        CHECK(midiData.step == expectStep, "%s: step %d, expected %d", name, midiData.step, expectStep);
+        CHECK(arena.used - before <= measured, "%s: used %lu of %lu measured bytes", name,
+              static_cast<unsigned long>(arena.used - before), static_cast<unsigned long>(measured));
+    }
+    free(arena.base);
+}
+
+// Scan and parse have to settle on the same tempo the frame stream plays at
+static void checkTempo(const char* name, const std::string& song, uint32_t expectUs)
+{
+    SongArena arena;
+    if (!arena_init(arena, TEST_ARENA))
+    {
+        printf("FAIL %s: no arena\n", name);
+        failures++;
+        return;
+    }
+
+    {
+        MidiData scanned(arena);
+        CHECK(scanSong(reinterpret_cast<const unsigned char*>(song.data()), song.size(), arena, scanned), "%s: scanSong", name);
+        CHECK(scanned.usPerQuarter == expectUs, "%s: scanSong tempo %lu, expected %lu", name,
+              static_cast<unsigned long>(scanned.usPerQuarter), static_cast<unsigned long>(expectUs));
+    }
+    arena_reset(arena);
+
+    SongSizing sizing;
+    CHECK(measureSong(song, arena, sizing), "%s: measureSong", name);
+    std::istringstream midiFile(song);
+    midiFile.ignore(4);
+    MidiData midiData(arena);
+    CHECK(parseSong(midiFile, sizing, arena, midiData), "%s: parseSong", name);
+    CHECK(midiData.usPerQuarter == expectUs, "%s: parseSong tempo %lu, expected %lu", name,
+          static_cast<unsigned long>(midiData.usPerQuarter), static_cast<unsigned long>(expectUs));
+    free(arena.base);
+}
+
+// A song the merge can't name every event of is turned away, not played wrong
+static void checkRejected(const char* name, const std::string& song)
+{
+    SongArena arena;
+    if (!arena_init(arena, TEST_ARENA))
+    {
+        printf("FAIL %s: no arena\n", name);
+        failures++;
+        return;
+    }
+    SongSizing sizing;
+    CHECK(measureSong(song, arena, sizing), "%s: measureSong", name);
+    std::istringstream midiFile(song);
+    midiFile.ignore(4);
+    MidiData midiData(arena);
+    CHECK(!parseSong(midiFile, sizing, arena, midiData), "%s: parseSong took it", name);
+    free(arena.base);
+}
+
+int main()
+{
+    // 200 quarters on a 32nd-note grid is 1601 frames
+    checkGrid("bb=8", makeGridSong(8, 200), 60);
+    // bb=0 is no answer: every step keeps the default of 8, not a 1-tick grid
+    checkGrid("bb=0", makeGridSong(0, 200), 60);
+    checkGrid("bb=4", makeGridSong(4, 200), 120);
+    checkGrid("long header", longHeader(makeGridSong(8, 200)), 60);
+    // The earliest time signature sets the grid, whichever track has it,
+    // and later ones don't move it
+    checkGrid("grid in track 2", makeSong({quarterNotes(100) + timeSignature(0, 16) + quarterNotes(100),
+                                           timeSignature(960, 4) + timeSignature(960, 2)}), 120);
+
+    checkTempo("no tempo", makeSong({quarterNotes(8)}), 500000);
+    // The earliest Set Tempo wins even when another track has it, and
+    // later changes don't move it
+    checkTempo("first tempo", makeSong({setTempo(480, 750000) + setTempo(480, 300000) + quarterNotes(8),
+                                        setTempo(240, 600000) + quarterNotes(8)}), 600000);
+    checkTempo("tied tempo", makeSong({setTempo(0, 400000) + quarterNotes(8), setTempo(0, 900000)}), 400000);
+
+    // One track more than a merge entry has bits for
+    checkRejected("257 tracks", makeSong(std::vector<std::string>(MERGE_MAX_TRACKS + 1, quarterNotes(1))));
+    // The most it has bits for still plays
+    checkGrid("256 tracks", makeSong(std::vector<std::string>(MERGE_MAX_TRACKS, quarterNotes(1))), 60);
+
+    if (failures)
+    {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,428 @@
+// Bar seek and loop checks: a song with a time signature change is built
+// in memory, played from RAM (buildFrames / buildSongIndex) as the frames
+// every seek should land on, and streamed from a file (frame_stream.h) on
+// the host build's SPIFFS. Seeks go to the first bar, the last and past
+// the end; loops wrap across the stream's ring and checkpoints. A second
+// song, whose grid is set outside its first track, has to stream the same
+// frames as it plays from RAM. Prints one line per failed check and exits
+// non-zero if there was one.
+//
+// Build:  g++ -std=gnu++17 -O2 -pthread -I../host -I../Final_Code seek_test.cpp ../host/hal.cpp -o seek_test
+// Usage:  ./seek_test [scratch dir]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// The parser and the stream log what they find; nobody is listening here
+#define LOG_LEVEL LOG_LEVEL_OFF
+
+#include <Arduino.h>
+#include "hal.h"
+#include "midi_parser.h"
+#include "frame_stream.h"
+
+#define TEST_ARENA (256 * 1024)
+#define TEST_SONG "/seek.mid"
+#define TEST_GRID_SONG "/grid.mid"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                \
+    do                                                  \
+    {                                                   \
+        if (!(cond))                                    \
+        {                                               \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                        \
+            printf("\n");                               \
+            failures++;                                 \
+        }                                               \
+    } while (0)
+
+static void putVariableLength(std::string& out, unsigned long value)
+{
+    unsigned char bytes[5];
+    int count = 0;
+    do
+    {
+        bytes[count++] = value & 0x7F;
+        value >>= 7;
+    } while (value);
+    while (count > 1)
+    {
+        out += static_cast<char>(bytes[--count] | 0x80);
+    }
+    out += static_cast<char>(bytes[0]);
+}
+
+static void putBigEndian(std::string& out, unsigned long value, int bytes)
+{
+    while (bytes--)
+    {
+        out += static_cast<char>((value >> (8 * bytes)) & 0xFF);
+    }
+}
+
+// Quarter note beats, bb 32nd notes a quarter
+static void timeSignature(std::string& events, unsigned long delta, int numerator, int bb = 8)
+{
+    putVariableLength(events, delta);
+    events += std::string("\xFF\x58\x04", 3);
+    events += static_cast<char>(numerator);
+    events += std::string("\x02\x18", 2);
+    events += static_cast<char>(bb);
+}
+
+static void endOfTrack(std::string& events)
+{
+    putVariableLength(events, 0);
+    events += std::string("\xFF\x2F\x00", 3);
+}
+
+// A song at 480 ticks a quarter from its track chunks' events
+static std::string songFile(const std::vector<std::string>& tracks)
+{
+    std::string song = "MThd";
+    putBigEndian(song, 6, 4);
+    putBigEndian(song, tracks.size() > 1 ? 1 : 0, 2);
+    putBigEndian(song, tracks.size(), 2);
+    putBigEndian(song, 480, 2);
+    for (const std::string& events : tracks)
+    {
+        song += "MTrk";
+        putBigEndian(song, events.size(), 4);
+        song += events;
+    }
+    return song;
+}
+
+// One track at 480 ticks a quarter: 8 bars of 4/4, then 24 of 3/4, an
+// eighth note on every beat, each on a different key than the last so
+// every frame of a bar can be told apart
+static std::string makeSong()
+{
+    std::string events;
+    timeSignature(events, 0, 4);
+    unsigned long delta = 0;
+    for (int beat = 0; beat < 8 * 4 + 24 * 3; beat++)
+    {
+        if (beat == 8 * 4)
+        {
+            timeSignature(events, delta, 3);
+            delta = 0;
+        }
+        char key = static_cast<char>(ActiveKeyboard::lowestNote + (beat * 7) % ActiveKeyboard::keys);
+        putVariableLength(events, delta);
+        events += '\x90';
+        events += key;
+        events += static_cast<char>(40 + beat % 80);
+        putVariableLength(events, 240);
+        events += '\x80';
+        events += key;
+        events += '\x00';
+        delta = 240;
+    }
+    endOfTrack(events);
+    return songFile({events});
+}
+
+// Two tracks: the first has the notes, dotted eighths so they don't sit on
+// every grid alike, and a time signature asking for a 64th-note grid in
+// bar 5. The second has none but a signature asking for a 16th-note grid
+// in bar 2, which is the first one in the song and so sets the grid.
+static std::string makeGridSong()
+{
+    std::string notes;
+    for (int n = 0; n < 64; n++)
+    {
+        if (n == 22)
+        {
+            timeSignature(notes, 180, 4, 16); // tick 7920, bar 5
+        }
+        char key = static_cast<char>(ActiveKeyboard::lowestNote + (n * 5) % ActiveKeyboard::keys);
+        putVariableLength(notes, n == 0 || n == 22 ? 0 : 180);
+        notes += '\x90';
+        notes += key;
+        notes += static_cast<char>(40 + n);
+        putVariableLength(notes, 180);
+        notes += '\x80';
+        notes += key;
+        notes += '\x00';
+    }
+    endOfTrack(notes);
+
+    std::string meta;
+    timeSignature(meta, 1920, 4, 4);
+    endOfTrack(meta);
+    return songFile({notes, meta});
+}
+
+static bool sameFrame(const LedFrame& a, const LedFrame& b)
+{
+    for (int p = 0; p < LED_LEVEL_BITS; p++)
+    {
+        if (a.plane[p] != b.plane[p])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The next `count` streamed frames should be the RAM frames from `first`,
+// wrapping back to `loopStart` at `loopEnd`
+static void checkStreamed(const char* name, FrameStream& s, const SongVector<LedFrame>& frames,
+                          uint32_t first, uint32_t count, uint32_t loopStart = 0, uint32_t loopEnd = 0)
+{
+    uint32_t expect = first;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (loopEnd > 0 && expect == loopEnd)
+        {
+            expect = loopStart;
+        }
+        LedFrame frame;
+        if (!frame_stream_next(s, frame))
+        {
+            printf("FAIL %s: stream ran out after %lu frames\n", name, static_cast<unsigned long>(i));
+            failures++;
+            return;
+        }
+        if (!sameFrame(frame, frames[expect]))
+        {
+            printf("FAIL %s: frame %lu of the stream isn't frame %lu\n", name, static_cast<unsigned long>(i),
+                   static_cast<unsigned long>(expect));
+            failures++;
+            return;
+        }
+        expect++;
+    }
+}
+
+// A practice command typed as on the serial port
+static bool typeCommand(const char* text, const SongIndex& index, PracticeMove& move)
+{
+    PracticeRequest request;
+    for (const char* c = text; *c; c++)
+    {
+        practice_input(request, *c);
+    }
+    practice_input(request, '\n');
+    return practice_take(request, index, move);
+}
+
+static void checkIndex(const SongIndex& index)
+{
+    uint32_t bars = song_index_bars(index);
+    CHECK(bars == 32, "%lu bars, expected 32", static_cast<unsigned long>(bars));
+
+    // Bar 0 isn't on the score; it goes to the start like bar 1
+    CHECK(song_index_bar_frame(index, 0) == 0, "bar 0 starts at frame %lu", static_cast<unsigned long>(song_index_bar_frame(index, 0)));
+    CHECK(song_index_bar_frame(index, 1) == 0, "bar 1 starts at frame %lu", static_cast<unsigned long>(song_index_bar_frame(index, 1)));
+    CHECK(song_index_frame_bar(index, 0) == 1, "frame 0 is in bar %lu", static_cast<unsigned long>(song_index_frame_bar(index, 0)));
+
+    // 4/4 bars are 32 frames, 3/4 bars 24 from bar 9 on
+    CHECK(song_index_bar_frame(index, 9) == 8 * 32, "bar 9 starts at frame %lu", static_cast<unsigned long>(song_index_bar_frame(index, 9)));
+    CHECK(song_index_bar_frame(index, 10) == 8 * 32 + 24, "bar 10 starts at frame %lu", static_cast<unsigned long>(song_index_bar_frame(index, 10)));
+
+    uint32_t last = song_index_bar_frame(index, bars);
+    CHECK(last == 8 * 32 + 23 * 24, "last bar starts at frame %lu", static_cast<unsigned long>(last));
+    CHECK(last < index.frames && song_index_frame_bar(index, last) == bars, "last bar's frame is in bar %lu",
+          static_cast<unsigned long>(song_index_frame_bar(index, last)));
+    CHECK(song_index_frame_bar(index, last - 1) == bars - 1, "frame before the last bar is in bar %lu",
+          static_cast<unsigned long>(song_index_frame_bar(index, last - 1)));
+
+    // Past the end there is nothing to jump to
+    CHECK(song_index_bar_frame(index, bars + 1) == index.frames, "bar past the end starts at frame %lu",
+          static_cast<unsigned long>(song_index_bar_frame(index, bars + 1)));
+    CHECK(song_index_bar_frame(index, 100000) == index.frames, "bar 100000 starts at frame %lu",
+          static_cast<unsigned long>(song_index_bar_frame(index, 100000)));
+
+    PracticeMove move;
+    CHECK(typeCommand("b0", index, move) && move.seekFrame == 0 && move.loopEnd == 0, "b0");
+    CHECK(typeCommand("b32", index, move) && move.seekFrame == static_cast<int32_t>(last), "b32");
+    move = PracticeMove();
+    CHECK(!typeCommand("b33", index, move) && move.seekFrame == -1, "b33 past the end");
+    CHECK(!typeCommand("l33-34", index, move), "l33-34 past the end");
+    CHECK(!typeCommand("l5-3", index, move), "l5-3 backwards");
+    CHECK(typeCommand("l32", index, move) && move.loopStart == last && move.loopEnd == index.frames, "l32 loops to the end");
+    CHECK(typeCommand("l31-40", index, move) && move.loopEnd == index.frames, "l31-40 runs into the end");
+    CHECK(typeCommand("l", index, move) && move.seekFrame == -1 && move.loopEnd == 0, "l ends the loop");
+}
+
+static void checkStream(FrameStream& s, const SongIndex& ramIndex, const SongVector<LedFrame>& frames)
+{
+    const SongIndex& index = s.index;
+    uint32_t bars = song_index_bars(index);
+    CHECK(bars == song_index_bars(ramIndex), "streamed %lu bars, %lu from RAM", static_cast<unsigned long>(bars),
+          static_cast<unsigned long>(song_index_bars(ramIndex)));
+    CHECK(index.frames <= frames.size() && index.frames + 1 >= frames.size(), "streamed %lu frames, %lu from RAM",
+          static_cast<unsigned long>(index.frames), static_cast<unsigned long>(frames.size()));
+    CHECK(s.checkpointSpacing > 1, "the checkpoint table never filled, the song is too short for this test");
+    for (uint32_t bar = 1; bar <= bars; bar++)
+    {
+        CHECK(song_index_bar_frame(index, bar) == song_index_bar_frame(ramIndex, bar), "bar %lu streamed at frame %lu, %lu from RAM",
+              static_cast<unsigned long>(bar), static_cast<unsigned long>(song_index_bar_frame(index, bar)),
+              static_cast<unsigned long>(song_index_bar_frame(ramIndex, bar)));
+    }
+
+    checkStreamed("from the start", s, frames, 0, index.frames);
+
+    frame_stream_seek(s, song_index_bar_frame(index, 0));
+    checkStreamed("bar 0", s, frames, 0, STREAM_RING_FRAMES * 2);
+
+    uint32_t last = song_index_bar_frame(index, bars);
+    frame_stream_seek(s, last);
+    checkStreamed("last bar", s, frames, last, index.frames - last);
+    LedFrame frame;
+    CHECK(!frame_stream_next(s, frame), "last bar: stream runs on past the end");
+
+    frame_stream_seek(s, song_index_bar_frame(index, bars + 1));
+    CHECK(!frame_stream_next(s, frame), "past the end: stream still plays");
+
+    // Bars 3-6: 128 frames, four rings' worth, starting between two
+    // checkpoints and running over at least one more
+    uint32_t start = song_index_bar_frame(index, 3);
+    uint32_t end = song_index_bar_frame(index, 7);
+    bool crossesCheckpoint = false;
+    for (int c = 0; c < s.checkpointCount; c++)
+    {
+        CHECK(s.checkpoints[c].step != start, "bar 3 is on a checkpoint, pick another");
+        crossesCheckpoint |= s.checkpoints[c].step > start && s.checkpoints[c].step < end;
+    }
+    CHECK(crossesCheckpoint, "bars 3-6 don't cross a checkpoint, pick others");
+    frame_stream_loop(s, start, end);
+    checkStreamed("loop bars 3-6", s, frames, start, (end - start) * 3 + 5, start, end);
+
+    // A loop shorter than the ring wraps inside it
+    start = song_index_bar_frame(index, 12);
+    end = song_index_bar_frame(index, 13);
+    frame_stream_loop(s, start, end);
+    checkStreamed("loop bar 12", s, frames, start, (end - start) * 5, start, end);
+
+    // A loop over the last bars wraps at the end of the song
+    start = song_index_bar_frame(index, bars - 1);
+    frame_stream_loop(s, start, index.frames);
+    checkStreamed("loop to the end", s, frames, start, (index.frames - start) * 3, start, index.frames);
+
+    // Ending the loop plays on from the ring
+    frame_stream_loop(s, 0, 0);
+    uint32_t left = 0;
+    while (frame_stream_next(s, frame) && left <= index.frames)
+    {
+        left++;
+    }
+    CHECK(left <= index.frames, "loop off: stream keeps looping");
+
+    // Seeking ends a loop
+    start = song_index_bar_frame(index, 20);
+    frame_stream_loop(s, start, song_index_bar_frame(index, 21));
+    checkStreamed("loop bar 20", s, frames, start, 10, start, song_index_bar_frame(index, 21));
+    frame_stream_seek(s, song_index_bar_frame(index, 5));
+    checkStreamed("seek out of a loop", s, frames, song_index_bar_frame(index, 5), index.frames - song_index_bar_frame(index, 5));
+    CHECK(!frame_stream_next(s, frame), "seek out of a loop: stream still loops");
+}
+
+// The streamed player has to take the grid from the same time signature
+// buildFrames() does, or no frame after the first lines up
+static void checkGridSong(SongArena& arena)
+{
+    std::string song = makeGridSong();
+    {
+        std::ofstream file(halOptions.spiffsDir + TEST_GRID_SONG, std::ios::binary);
+        file.write(song.data(), song.size());
+    }
+
+    SongSizing sizing;
+    CHECK(measureSong(song, arena, sizing), "grid song: measureSong");
+    CHECK(song_grid_step(sizing.grid, sizing.division) == 120, "grid song: measured step %d, expected 120",
+          song_grid_step(sizing.grid, sizing.division));
+    std::istringstream midiFile(song);
+    midiFile.ignore(4);
+    MidiData midiData(arena);
+    if (!parseSong(midiFile, sizing, arena, midiData) || !buildFrames(midiData))
+    {
+        printf("FAIL: the grid song didn't parse\n");
+        failures++;
+        return;
+    }
+    CHECK(midiData.step == 120, "grid song: step %d from RAM, expected 120", midiData.step);
+
+    static FrameStream stream;
+    if (!frame_stream_open(stream, TEST_GRID_SONG))
+    {
+        printf("FAIL: couldn't stream the grid song\n");
+        failures++;
+        return;
+    }
+    CHECK(stream.step == midiData.step, "grid song: streamed step %d, %d from RAM", stream.step, midiData.step);
+    CHECK(stream.index.frames <= midiData.frames.size() && stream.index.frames + 1 >= midiData.frames.size(),
+          "grid song: streamed %lu frames, %lu from RAM", static_cast<unsigned long>(stream.index.frames),
+          static_cast<unsigned long>(midiData.frames.size()));
+    if (stream.index.frames <= midiData.frames.size())
+    {
+        checkStreamed("grid song", stream, midiData.frames, 0, stream.index.frames);
+    }
+    frame_stream_close(stream);
+    SPIFFS.remove(TEST_GRID_SONG);
+}
+
+int main(int argc, char** argv)
+{
+    halOptions.spiffsDir = argc > 1 ? argv[1] : "seek_test_spiffs";
+    if (!SPIFFS.begin())
+    {
+        printf("FAIL: no SPIFFS directory at %s\n", halOptions.spiffsDir.c_str());
+        return 1;
+    }
+
+    std::string song = makeSong();
+    {
+        std::ofstream file(halOptions.spiffsDir + TEST_SONG, std::ios::binary);
+        file.write(song.data(), song.size());
+    }
+
+    SongArena arena;
+    if (!arena_init(arena, TEST_ARENA))
+    {
+        printf("FAIL: no arena\n");
+        return 1;
+    }
+    SongSizing sizing;
+    CHECK(measureSong(song, arena, sizing), "measureSong");
+    std::istringstream midiFile(song);
+    midiFile.ignore(4); // "MThd", measureSong() checks it
+    MidiData midiData(arena);
+    if (!parseSong(midiFile, sizing, arena, midiData) || !buildFrames(midiData))
+    {
+        printf("FAIL: the song didn't parse\n");
+        return 1;
+    }
+    SongIndex ramIndex;
+    buildSongIndex(midiData, ramIndex);
+    checkIndex(ramIndex);
+
+    static FrameStream stream;
+    if (!frame_stream_open(stream, TEST_SONG))
+    {
+        printf("FAIL: couldn't stream the song\n");
+        return 1;
+    }
+    checkStream(stream, ramIndex, midiData.frames);
+    frame_stream_close(stream);
+    SPIFFS.remove(TEST_SONG);
+
+    checkGridSong(arena);
+
+    if (failures)
+    {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,356 @@
+// Library indexer: scans a directory of MIDI files and writes a song catalog
+// (Final_Code/song_catalog.h) for the device to fetch as one small file.
+//
+// Songs are parsed with the firmware's own parser (Final_Code/midi_parser.h),
+// so what the catalog says is what the device will see. Files are memory
+// mapped and parsed straight out of the mapping, and a pool of worker
+// threads pulls files off a shared counter, each with its own song arena.
+//
+// With -m only meta events are read (scanSong), which is enough for names,
+// tempo, signatures and length; note count, key range and polyphony are
+// left at 0.
+//
+// Build:  g++ -std=c++17 -O2 -pthread -I../Final_Code indexer.cpp -o indexer
+// Usage:  ./indexer [-m] <library dir> [catalog file] [threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The parser logs what it finds; nobody is listening here
+#define LOG_LEVEL LOG_LEVEL_OFF
+
+#include "midi_parser.h"
+#include "song_catalog.h"
+
+#define INDEXER_ARENA_START (1024 * 1024) // each worker's arena, grown for bigger songs
+
+// An istream over memory that is already there, so the parser reads the mapping in place
+struct MappedBuffer : std::streambuf {
+    MappedBuffer(const unsigned char* data, size_t size)
+    {
+        char* start = const_cast<char*>(reinterpret_cast<const char*>(data));
+        setg(start, start, start + size);
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override
+    {
+        char* target = (dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr()) + off;
+        if (target < eback() || target > egptr())
+        {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), target, egptr());
+        return pos_type(target - eback());
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
+
+struct IndexedSong {
+    bool ok = false;
+    CatalogEntry entry = {};
+    std::string path;  // relative to the library
+    std::string names; // track names, CATALOG_NAME_SEPARATOR joined
+};
+
+// Most notes sounding at once: one pass over the merged song, where offs
+// come before ons on the same tick
+static int maxPolyphony(const MidiData& midiData)
+{
+    EventMerge merge(*midiData.tracks.get_allocator().arena);
+    if (!event_merge_begin(merge, midiData))
+    {
+        return 0;
+    }
+    SongEvent event;
+    int sounding = 0;
+    int most = 0;
+    while (event_merge_next(merge, event))
+    {
+        if (event.kind == SONG_NOTE_ON)
+        {
+            most = std::max(most, ++sounding);
+        }
+        else if (event.kind == SONG_NOTE_OFF)
+        {
+            sounding--;
+        }
+    }
+    return most;
+}
+
+// Fill in what the meta events say
+static void describeMeta(const MidiData& midiData, IndexedSong& song)
+{
+    CatalogEntry& entry = song.entry;
+    entry.division = midiData.division;
+    entry.tracks = midiData.tracks.size() > 255 ? 255 : midiData.tracks.size();
+    entry.usPerQuarter = midiData.usPerQuarter;
+    entry.timeNumerator = midiData.timeSignatures.empty() ? 4 : midiData.timeSignatures[0].numerator;
+    entry.timeDenominator = midiData.timeSignatures.empty() ? 4 : midiData.timeSignatures[0].denominator;
+    entry.keySharps = midiData.keySignatures.empty() ? 0 : midiData.keySignatures[0].key;
+    entry.keyMinor = !midiData.keySignatures.empty() && strcmp(midiData.keySignatures[0].scale, "minor") == 0;
+    entry.durationMs = songDurationMs(midiData);
+    for (const Track& track : midiData.tracks)
+    {
+        if (!track.name.empty())
+        {
+            if (!song.names.empty())
+            {
+                song.names += CATALOG_NAME_SEPARATOR;
+            }
+            song.names.append(track.name.data(), track.name.size());
+        }
+    }
+}
+
+// Fill in what only the notes can tell
+static void describeNotes(const MidiData& midiData, IndexedSong& song)
+{
+    CatalogEntry& entry = song.entry;
+    int lowest = 127;
+    int highest = 0;
+    for (const Track& track : midiData.tracks)
+    {
+        for (const Note& note : track.notes)
+        {
+            lowest = std::min(lowest, note.midi);
+            highest = std::max(highest, note.midi);
+            entry.notes++;
+        }
+    }
+    entry.lowestNote = entry.notes > 0 ? lowest : 0;
+    entry.highestNote = entry.notes > 0 ? highest : 0;
+    entry.polyphony = std::min(maxPolyphony(midiData), 255);
+}
+
+// Parse one mapped file the way the firmware does
+static bool indexSong(const unsigned char* bytes, size_t size, SongArena& arena, bool metaOnly, IndexedSong& song)
+{
+    {
+        MidiData scanned(arena);
+        if (!scanSong(bytes, size, arena, scanned))
+        {
+            return false;
+        }
+        describeMeta(scanned, song);
+    }
+    if (metaOnly)
+    {
+        return true;
+    }
+
+    SongSizing sizing;
+    if (!measureSong(bytes, size, arena, sizing))
+    {
+        return false;
+    }
+    if (sizing.bytes > arena_remaining(arena))
+    {
+        // Grow this worker's arena and measure again, the sizing lived in the old one
+        free(arena.base);
+        if (!arena_init(arena, (sizing.bytes + arena.capacity) * 2) || !measureSong(bytes, size, arena, sizing))
+        {
+            return false;
+        }
+    }
+    if (sizing.numTracks == 0 || sizing.division == 0)
+    {
+        return false;
+    }
+
+    MappedBuffer buffer(bytes, size);
+    std::istream file(&buffer);
+    file.ignore(8 + bigEndianToHost(const_cast<unsigned char*>(bytes + 4), 4));
+
+    MidiData midiData(arena);
+    midiData.division = sizing.division;
+    if (!arena_reserve(midiData.tracks, sizing.numTracks))
+    {
+        return false;
+    }
+    for (int t = 0; t < sizing.numTracks; t++)
+    {
+        midiData.tracks.emplace_back(arena);
+        Track& track = midiData.tracks.back();
+        if (!arena_reserve(track.notes, sizing.tracks[t].notes) ||
+            !arena_reserve(track.controlChanges, sizing.tracks[t].controlChanges) ||
+            !readTrackChunk(file, track, sizing.division))
+        {
+            return false;
+        }
+    }
+    describeNotes(midiData, song);
+    return true;
+}
+
+static bool indexFile(const std::string& fullPath, SongArena& arena, bool metaOnly, IndexedSong& song)
+{
+    int fd = open(fullPath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < 14)
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = info.st_size;
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    bool ok = false;
+    try
+    {
+        ok = indexSong(static_cast<const unsigned char*>(mapped), size, arena, metaOnly, song);
+    }
+    catch (const std::bad_alloc&)
+    {
+        ok = false; // the measurement and the parse disagreed: treat it as a bad file
+    }
+    munmap(mapped, size);
+    return ok;
+}
+
+static bool writeCatalog(const char* path, const std::vector<IndexedSong>& songs, size_t& catalogBytes)
+{
+    std::vector<CatalogEntry> entries;
+    std::string strings;
+    for (const IndexedSong& song : songs)
+    {
+        if (!song.ok)
+        {
+            continue;
+        }
+        CatalogEntry entry = song.entry;
+        entry.path = strings.size();
+        strings.append(song.path).push_back('\0');
+        entry.names = strings.size();
+        strings.append(song.names).push_back('\0');
+        entries.push_back(entry);
+    }
+
+    CatalogHeader header;
+    memcpy(header.magic, CATALOG_MAGIC, 4);
+    header.count = entries.size();
+    header.stringBytes = strings.size();
+
+    FILE* out = fopen(path, "wb");
+    if (out == nullptr)
+    {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && (entries.empty() || fwrite(entries.data(), sizeof(CatalogEntry), entries.size(), out) == entries.size());
+    ok = ok && (strings.empty() || fwrite(strings.data(), 1, strings.size(), out) == strings.size());
+    ok = fclose(out) == 0 && ok;
+    catalogBytes = sizeof(header) + entries.size() * sizeof(CatalogEntry) + strings.size();
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    bool metaOnly = argc > 1 && strcmp(argv[1], "-m") == 0;
+    if (metaOnly)
+    {
+        argv++;
+        argc--;
+    }
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s [-m] <library dir> [catalog file] [threads]\n", argv[0]);
+        return 1;
+    }
+    std::filesystem::path library = argv[1];
+    const char* catalogPath = argc > 2 ? argv[2] : "catalog.bin";
+    unsigned threads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    if (threads == 0)
+    {
+        threads = 1;
+    }
+
+    std::vector<IndexedSong> songs;
+    std::error_code error;
+    for (auto it = std::filesystem::recursive_directory_iterator(library, error); !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error))
+    {
+        std::string extension = it->path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (it->is_regular_file() && (extension == ".mid" || extension == ".midi"))
+        {
+            IndexedSong song;
+            song.path = std::filesystem::relative(it->path(), library).generic_string();
+            songs.push_back(song);
+        }
+    }
+    if (error)
+    {
+        fprintf(stderr, "can't scan %s: %s\n", argv[1], error.message().c_str());
+        return 1;
+    }
+    std::sort(songs.begin(), songs.end(), [](const IndexedSong& a, const IndexedSong& b) { return a.path < b.path; });
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; t++)
+    {
+        pool.emplace_back([&]() {
+            SongArena arena;
+            if (!arena_init(arena, INDEXER_ARENA_START))
+            {
+                return;
+            }
+            for (size_t i = next++; i < songs.size(); i = next++)
+            {
+                songs[i].ok = indexFile((library / songs[i].path).string(), arena, metaOnly, songs[i]);
+            }
+            free(arena.base);
+        });
+    }
+    for (std::thread& worker : pool)
+    {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t indexed = 0;
+    for (const IndexedSong& song : songs)
+    {
+        if (song.ok)
+        {
+            indexed++;
+        }
+        else
+        {
+            fprintf(stderr, "skipped %s: not a MIDI file the parser accepts\n", song.path.c_str());
+        }
+    }
+    size_t catalogBytes = 0;
+    if (!writeCatalog(catalogPath, songs, catalogBytes))
+    {
+        fprintf(stderr, "can't write %s\n", catalogPath);
+        return 1;
+    }
+    printf("%zu of %zu songs indexed%s with %u threads in %.3f s, %s is %zu bytes\n",
+           indexed, songs.size(), metaOnly ? " (meta only)" : "", threads, seconds, catalogPath, catalogBytes);
+    return 0;
+}
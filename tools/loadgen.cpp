@@ -0,0 +1,482 @@
+// Load generator: a room full of emulated keyboards against one song server.
+//
+// Each emulated device does what loop() does over its session
+// (Final_Code/session_protocol.h): connect, GET a song with the compressed
+// option and decode it as it arrives (Final_Code/lz_stream.h), then PUT a
+// recording if one was given, for as many rounds as asked. Every device is
+// a non-blocking socket on one epoll loop, so hundreds fit in one thread.
+//
+// At the end it prints latency percentiles per request type (from sending
+// the request to the last frame of the reply), throughput and what failed.
+//
+// The session server (tools/session_server.cpp) hands out its playlist one
+// song per GET, so for more than one GET per song use -g to ask for a song
+// by name.
+//
+// Build:  g++ -std=c++17 -O2 -I../Final_Code loadgen.cpp -o loadgen
+// Usage:  ./loadgen [-d devices] [-k rounds] [-g song] [-p recording.mid]
+//                   [-t timeout ms] host port
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "session_protocol.h"
+#include "lz_stream.h"
+
+enum DeviceState {
+    DEVICE_CONNECTING = 0,
+    DEVICE_WAITING,  // a request is out
+    DEVICE_FINISHED
+};
+
+enum RequestKind {
+    KIND_CONNECT = 0,
+    KIND_GET,
+    KIND_PUT,
+    KIND_COUNT
+};
+
+static const char* const kindNames[KIND_COUNT] = { "connect", "GET", "PUT" };
+
+// Counts decoded bytes; the song itself isn't kept
+struct CountingSink {
+    uint64_t bytes = 0;
+    void operator()(const uint8_t*, size_t length) { bytes += length; }
+};
+
+struct Device {
+    int fd = -1;
+    int state = DEVICE_CONNECTING;
+    int round = 0;
+    int kind = KIND_CONNECT;  // what we are waiting for
+    uint16_t nextId = 1;
+    uint16_t waitingId = 0;
+    uint64_t startedUs = 0;   // when the request went out
+    std::string in;           // bytes read, not yet a whole frame
+    std::string out;          // bytes not yet written
+    SongTransfer transfer;
+    CountingSink song;
+    bool transferOk = true;
+};
+
+struct Results {
+    std::vector<uint32_t> latencyUs[KIND_COUNT];
+    uint64_t failures[KIND_COUNT] = {};
+    uint64_t badStatus = 0;   // a reply that wasn't SESSION_OK
+    uint64_t badSongs = 0;    // GET replies that didn't decode
+    uint64_t timeouts = 0;
+    uint64_t dropped = 0;     // connections lost mid request
+    uint64_t wireBytes = 0;   // reply payload off the network
+    uint64_t songBytes = 0;   // after decompression
+};
+
+static int rounds = 1;
+static std::string songName;
+static std::string recording;
+static uint64_t timeoutUs = 10000 * 1000ULL;
+static Results results;
+
+static uint64_t nowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool readFile(const char* path, std::string& bytes)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    bytes = contents.str();
+    return true;
+}
+
+// Frame a whole message into the device's output, as session_send() does
+static void queueMessage(Device& d, uint16_t id, uint8_t command, const std::string& payload)
+{
+    size_t sent = 0;
+    do
+    {
+        size_t chunk = std::min(payload.size() - sent, static_cast<size_t>(SESSION_MAX_CHUNK));
+        bool more = sent + chunk < payload.size();
+        uint8_t header[SESSION_HEADER_BYTES];
+        uint32_t length = 4 + chunk;
+        memcpy(header, &length, 4); // the host is little-endian, like the wire
+        memcpy(header + 4, &id, 2);
+        header[6] = command | (more ? SESSION_MORE : 0);
+        header[7] = SESSION_OK;
+        d.out.append(reinterpret_cast<char*>(header), sizeof(header));
+        d.out.append(payload, sent, chunk);
+        sent += chunk;
+    } while (sent < payload.size());
+}
+
+static void startRequest(Device& d, int kind)
+{
+    d.kind = kind;
+    d.waitingId = d.nextId++;
+    d.state = DEVICE_WAITING;
+    d.startedUs = nowUs();
+    if (kind == KIND_GET)
+    {
+        std::string payload(1, static_cast<char>(SESSION_GET_COMPRESSED));
+        payload += songName;
+        song_transfer_begin(d.transfer);
+        d.song = CountingSink();
+        d.transferOk = true;
+        queueMessage(d, d.waitingId, SESSION_GET, payload);
+    }
+    else
+    {
+        queueMessage(d, d.waitingId, SESSION_PUT, recording);
+    }
+}
+
+static void finish(Device& d, int epollFd)
+{
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, d.fd, nullptr);
+    close(d.fd);
+    d.fd = -1;
+    d.state = DEVICE_FINISHED;
+}
+
+// The request on hand is over, one way or another: move on to the next
+static void nextStep(Device& d, int epollFd)
+{
+    if (d.kind == KIND_GET && !recording.empty())
+    {
+        startRequest(d, KIND_PUT);
+    }
+    else if (++d.round < rounds)
+    {
+        startRequest(d, KIND_GET);
+    }
+    else
+    {
+        finish(d, epollFd);
+    }
+}
+
+static void replyDone(Device& d, uint8_t status, int epollFd)
+{
+    uint64_t latency = nowUs() - d.startedUs;
+    bool ok = status == SESSION_OK;
+    if (!ok)
+    {
+        results.badStatus++;
+    }
+    if (d.kind == KIND_GET)
+    {
+        d.transferOk = song_transfer_end(d.transfer, d.song) && d.transferOk;
+        results.wireBytes += d.transfer.received;
+        results.songBytes += d.song.bytes;
+        if (ok && (!d.transferOk || d.song.bytes == 0))
+        {
+            results.badSongs++;
+            ok = false;
+        }
+    }
+    if (ok)
+    {
+        results.latencyUs[d.kind].push_back(static_cast<uint32_t>(latency));
+    }
+    else
+    {
+        results.failures[d.kind]++;
+    }
+    nextStep(d, epollFd);
+}
+
+// Take every whole frame out of the input
+static void framesIn(Device& d, int epollFd)
+{
+    size_t used = 0;
+    while (d.state == DEVICE_WAITING && d.in.size() - used >= SESSION_HEADER_BYTES)
+    {
+        uint32_t length;
+        uint16_t id;
+        memcpy(&length, d.in.data() + used, 4);
+        memcpy(&id, d.in.data() + used + 4, 2);
+        uint8_t command = d.in[used + 6];
+        uint8_t status = d.in[used + 7];
+        if (length < 4 || d.in.size() - used < 4 + length)
+        {
+            break;
+        }
+        const uint8_t* payload = reinterpret_cast<const uint8_t*>(d.in.data() + used + SESSION_HEADER_BYTES);
+        size_t payloadLength = length - 4;
+        used += 4 + length;
+        if (!(command & SESSION_REPLY))
+        {
+            // the server asking us something: answer like the device would
+            std::string echo = (command & SESSION_COMMAND_MASK) == SESSION_PING ? std::string(reinterpret_cast<const char*>(payload), payloadLength) : std::string();
+            queueMessage(d, id, (command & SESSION_COMMAND_MASK) | SESSION_REPLY, echo);
+            continue;
+        }
+        if (id != d.waitingId)
+        {
+            continue;
+        }
+        if (d.kind == KIND_GET)
+        {
+            d.transferOk = song_transfer_feed(d.transfer, payload, payloadLength, d.song) && d.transferOk;
+        }
+        if (!(command & SESSION_MORE))
+        {
+            replyDone(d, status, epollFd);
+        }
+    }
+    if (d.fd >= 0)
+    {
+        d.in.erase(0, used);
+    }
+}
+
+static void lost(Device& d, int epollFd)
+{
+    if (d.state == DEVICE_WAITING && d.kind == KIND_CONNECT)
+    {
+        results.failures[KIND_CONNECT]++;
+    }
+    else if (d.state == DEVICE_WAITING)
+    {
+        results.failures[d.kind]++;
+        results.dropped++;
+    }
+    finish(d, epollFd);
+}
+
+static void service(Device& d, uint32_t events, int epollFd)
+{
+    if (d.kind == KIND_CONNECT)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(d.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0 || (events & (EPOLLERR | EPOLLHUP)))
+        {
+            lost(d, epollFd);
+            return;
+        }
+        results.latencyUs[KIND_CONNECT].push_back(static_cast<uint32_t>(nowUs() - d.startedUs));
+        startRequest(d, KIND_GET);
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        char buffer[16384];
+        ssize_t got;
+        while ((got = read(d.fd, buffer, sizeof(buffer))) > 0)
+        {
+            d.in.append(buffer, got);
+        }
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            framesIn(d, epollFd);
+            if (d.fd >= 0)
+            {
+                lost(d, epollFd);
+            }
+            return;
+        }
+        framesIn(d, epollFd);
+    }
+    while (d.fd >= 0 && !d.out.empty())
+    {
+        ssize_t put = write(d.fd, d.out.data(), d.out.size());
+        if (put < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                lost(d, epollFd);
+            }
+            break;
+        }
+        d.out.erase(0, put);
+    }
+    if (d.fd >= 0)
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN | (d.out.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+        event.data.ptr = &d;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, d.fd, &event);
+    }
+}
+
+static bool startDevice(Device& d, const sockaddr_in& server, int epollFd)
+{
+    d.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (d.fd < 0)
+    {
+        return false;
+    }
+    int yes = 1;
+    setsockopt(d.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)); // as the device does
+    d.kind = KIND_CONNECT;
+    d.state = DEVICE_WAITING;
+    d.startedUs = nowUs();
+    if (connect(d.fd, reinterpret_cast<const sockaddr*>(&server), sizeof(server)) != 0 && errno != EINPROGRESS)
+    {
+        close(d.fd);
+        d.fd = -1;
+        return false;
+    }
+    epoll_event event = {};
+    event.events = EPOLLOUT | EPOLLIN; // writable once the connect is done
+    event.data.ptr = &d;
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, d.fd, &event) == 0;
+}
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+static void report(double seconds, int devices)
+{
+    printf("%d devices, %d rounds, %.3f s\n", devices, rounds, seconds);
+    printf("%-8s %8s %8s %10s %10s %10s %10s %10s\n", "request", "ok", "failed", "p50 ms", "p90 ms", "p99 ms", "max ms", "per s");
+    for (int kind = 0; kind < KIND_COUNT; kind++)
+    {
+        std::vector<uint32_t>& latencies = results.latencyUs[kind];
+        if (latencies.empty() && results.failures[kind] == 0)
+        {
+            continue;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        printf("%-8s %8zu %8llu %10.2f %10.2f %10.2f %10.2f %10.1f\n", kindNames[kind], latencies.size(),
+               static_cast<unsigned long long>(results.failures[kind]),
+               percentile(latencies, 50) / 1000.0, percentile(latencies, 90) / 1000.0,
+               percentile(latencies, 99) / 1000.0, (latencies.empty() ? 0 : latencies.back()) / 1000.0,
+               latencies.size() / seconds);
+    }
+    printf("songs: %.2f MB on the wire, %.2f MB decoded, %.2f MB/s decoded\n",
+           results.wireBytes / 1e6, results.songBytes / 1e6, results.songBytes / 1e6 / seconds);
+    printf("failures: %llu bad status, %llu bad songs, %llu timeouts, %llu dropped\n",
+           static_cast<unsigned long long>(results.badStatus), static_cast<unsigned long long>(results.badSongs),
+           static_cast<unsigned long long>(results.timeouts), static_cast<unsigned long long>(results.dropped));
+}
+
+int main(int argc, char** argv)
+{
+    int devices = 100;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        if (strcmp(argv[arg], "-d") == 0)
+        {
+            devices = atoi(argv[arg + 1]);
+        }
+        else if (strcmp(argv[arg], "-k") == 0)
+        {
+            rounds = atoi(argv[arg + 1]);
+        }
+        else if (strcmp(argv[arg], "-g") == 0)
+        {
+            songName = argv[arg + 1];
+        }
+        else if (strcmp(argv[arg], "-t") == 0)
+        {
+            timeoutUs = strtoull(argv[arg + 1], nullptr, 10) * 1000;
+        }
+        else if (strcmp(argv[arg], "-p") == 0)
+        {
+            if (!readFile(argv[arg + 1], recording))
+            {
+                fprintf(stderr, "can't read %s\n", argv[arg + 1]);
+                return 1;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (argc - arg != 2 || devices < 1 || rounds < 1)
+    {
+        fprintf(stderr, "usage: %s [-d devices] [-k rounds] [-g song] [-p recording.mid] [-t timeout ms] host port\n", argv[0]);
+        return 1;
+    }
+    sockaddr_in server = {};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[arg + 1]));
+    if (inet_pton(AF_INET, argv[arg], &server.sin_addr) != 1)
+    {
+        fprintf(stderr, "%s is not an IPv4 address\n", argv[arg]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN); // a server that hangs up shows as a failed write
+    int epollFd = epoll_create1(0);
+    std::vector<Device> fleet(devices);
+    uint64_t start = nowUs();
+    for (Device& d : fleet)
+    {
+        if (!startDevice(d, server, epollFd))
+        {
+            results.failures[KIND_CONNECT]++;
+            d.state = DEVICE_FINISHED;
+        }
+    }
+
+    std::vector<epoll_event> events(256);
+    for (;;)
+    {
+        int ready = epoll_wait(epollFd, events.data(), events.size(), 100);
+        for (int i = 0; i < ready; i++)
+        {
+            Device& d = *static_cast<Device*>(events[i].data.ptr);
+            if (d.fd >= 0)
+            {
+                service(d, events[i].events, epollFd);
+            }
+        }
+
+        // give up on anything that has been waiting too long
+        uint64_t now = nowUs();
+        int active = 0;
+        for (Device& d : fleet)
+        {
+            if (d.state == DEVICE_WAITING && now - d.startedUs >= timeoutUs)
+            {
+                results.timeouts++;
+                results.failures[d.kind]++;
+                finish(d, epollFd);
+            }
+            if (d.state != DEVICE_FINISHED)
+            {
+                active++;
+            }
+        }
+        if (active == 0)
+        {
+            break;
+        }
+    }
+    report((nowUs() - start) / 1e6, devices);
+    close(epollFd);
+    return 0;
+}
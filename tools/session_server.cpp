@@ -0,0 +1,391 @@
+// Session server: a stand-in for song_server.py that speaks the framed
+// session protocol (Final_Code/session_protocol.h) to any number of
+// devices at once, for testing the device side without the GUI.
+//
+// Every connection is non-blocking and served from one poll() loop. Replies
+// are queued per connection and sent a frame at a time, round robin, so a
+// long song download never holds up a PING or a STAT behind it.
+//
+// GET with no name serves the songs in the order given, one per request,
+// and answers SESSION_NOT_FOUND past the last; GET with a name serves that
+// file. Songs go out as they are on disk: the device tells plain from
+// compressed by itself, and song_server.py is the one that compresses.
+// PUT saves recording<n>.mid. LOG batches of practice records are
+// decompressed if need be and appended to practice.log, all devices in one
+// file. With -s each device is asked for its probe dump as soon as it
+// connects.
+//
+// Build:  g++ -std=c++17 -O2 -I../Final_Code session_server.cpp -o session_server
+// Usage:  ./session_server [-p port] [-c catalog.bin] [-s] song.mid [song.mid ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "session_protocol.h"
+#include "lz_stream.h"
+#include "practice_record.h"
+
+#define SERVER_WRITE_AHEAD (16 * 1024) // bytes queued on a socket before picking the next frame
+
+// A message on its way out, sent a frame at a time
+struct Outgoing {
+    uint16_t id;
+    uint8_t command;
+    uint8_t status;
+    std::string payload;
+    size_t sent = 0;
+};
+
+struct Connection {
+    int fd;
+    std::string in;                    // bytes read, not yet a whole frame
+    std::string out;                   // frames ready for the socket
+    std::deque<Outgoing> queue;        // messages waiting to be framed
+    std::map<uint16_t, std::string> partial; // requests split over several frames
+    uint16_t nextId = 1;               // for requests we send the device
+};
+
+struct Song {
+    std::string path;
+    std::string bytes;
+};
+
+static std::vector<Song> songs;
+static size_t nextSong = 0;
+static std::string catalog;
+static bool askForStats = false;
+static int recordings = 0;
+
+static bool readFile(const std::string& path, std::string& bytes)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    bytes = contents.str();
+    return true;
+}
+
+static void queueMessage(Connection& c, uint16_t id, uint8_t command, uint8_t status, const std::string& payload)
+{
+    Outgoing message;
+    message.id = id;
+    message.command = command;
+    message.status = status;
+    message.payload = payload;
+    c.queue.push_back(message);
+}
+
+static void reply(Connection& c, uint16_t id, uint8_t command, uint8_t status, const std::string& payload = std::string())
+{
+    queueMessage(c, id, command | SESSION_REPLY, status, payload);
+}
+
+// Move frames from the message queue to the socket buffer, one frame from
+// each message in turn
+static void frameOut(Connection& c)
+{
+    while (c.out.size() < SERVER_WRITE_AHEAD && !c.queue.empty())
+    {
+        Outgoing message = std::move(c.queue.front());
+        c.queue.pop_front();
+        size_t chunk = std::min(message.payload.size() - message.sent, static_cast<size_t>(SESSION_MAX_CHUNK));
+        bool more = message.sent + chunk < message.payload.size();
+        uint8_t header[SESSION_HEADER_BYTES];
+        uint32_t length = 4 + chunk;
+        memcpy(header, &length, 4); // the host is little-endian, like the wire
+        memcpy(header + 4, &message.id, 2);
+        header[6] = message.command | (more ? SESSION_MORE : 0);
+        header[7] = message.status;
+        c.out.append(reinterpret_cast<char*>(header), sizeof(header));
+        c.out.append(message.payload, message.sent, chunk);
+        message.sent += chunk;
+        if (more)
+        {
+            c.queue.push_back(std::move(message));
+        }
+    }
+}
+
+static void handleRequest(Connection& c, uint16_t id, uint8_t command, const std::string& payload)
+{
+    switch (command)
+    {
+    case SESSION_GET:
+    {
+        std::string name = payload.size() > 1 ? payload.substr(1) : std::string();
+        const Song* song = nullptr;
+        if (name.empty())
+        {
+            song = nextSong < songs.size() ? &songs[nextSong++] : nullptr;
+        }
+        else
+        {
+            for (const Song& candidate : songs)
+            {
+                if (candidate.path == name)
+                {
+                    song = &candidate;
+                }
+            }
+        }
+        printf("[%d] GET %s: %s\n", c.fd, name.empty() ? "(next)" : name.c_str(), song != nullptr ? song->path.c_str() : "not found");
+        if (song != nullptr)
+        {
+            reply(c, id, command, SESSION_OK, song->bytes);
+        }
+        else
+        {
+            reply(c, id, command, SESSION_NOT_FOUND);
+        }
+        break;
+    }
+    case SESSION_PUT:
+    {
+        std::string path = "recording" + std::to_string(recordings++) + ".mid";
+        std::ofstream file(path, std::ios::binary);
+        file.write(payload.data(), payload.size());
+        printf("[%d] PUT %zu bytes -> %s\n", c.fd, payload.size(), path.c_str());
+        reply(c, id, command, file ? SESSION_OK : SESSION_FAILED);
+        break;
+    }
+    case SESSION_LOG:
+    {
+        std::string records;
+        auto sink = [&records](const uint8_t* data, size_t length) { records.append(reinterpret_cast<const char*>(data), length); };
+        SongTransfer transfer;
+        song_transfer_begin(transfer);
+        bool ok = song_transfer_feed(transfer, reinterpret_cast<const uint8_t*>(payload.data()), payload.size(), sink) &&
+                  song_transfer_end(transfer, sink) && records.size() % sizeof(PracticeRecord) == 0;
+        int counts[PRACTICE_EXTRA + 1] = {0};
+        for (size_t at = 0; ok && at < records.size(); at += sizeof(PracticeRecord))
+        {
+            PracticeRecord record;
+            memcpy(&record, records.data() + at, sizeof(record));
+            if (record.kind <= PRACTICE_EXTRA)
+            {
+                counts[record.kind]++;
+            }
+        }
+        if (ok)
+        {
+            std::ofstream file("practice.log", std::ios::binary | std::ios::app);
+            file.write(records.data(), records.size());
+            ok = static_cast<bool>(file);
+        }
+        printf("[%d] LOG %zu bytes -> %zu records: %d songs, %d hits, %d misses, %d extras%s\n", c.fd, payload.size(),
+               records.size() / sizeof(PracticeRecord), counts[PRACTICE_SONG], counts[PRACTICE_HIT], counts[PRACTICE_MISS],
+               counts[PRACTICE_EXTRA], ok ? "" : " (bad batch)");
+        reply(c, id, command, ok ? SESSION_OK : SESSION_BAD_REQUEST);
+        break;
+    }
+    case SESSION_LIST:
+        reply(c, id, command, catalog.empty() ? SESSION_NOT_FOUND : SESSION_OK, catalog);
+        break;
+    case SESSION_STAT:
+        printf("[%d] STAT\n%s\n", c.fd, payload.c_str());
+        reply(c, id, command, SESSION_OK);
+        break;
+    case SESSION_PING:
+        reply(c, id, command, SESSION_OK, payload);
+        break;
+    default:
+        reply(c, id, command, SESSION_BAD_REQUEST);
+        break;
+    }
+}
+
+// Take every whole frame out of the input buffer
+static void framesIn(Connection& c)
+{
+    size_t used = 0;
+    while (c.in.size() - used >= SESSION_HEADER_BYTES)
+    {
+        const uint8_t* header = reinterpret_cast<const uint8_t*>(c.in.data() + used);
+        uint32_t length;
+        uint16_t id;
+        memcpy(&length, header, 4);
+        memcpy(&id, header + 4, 2);
+        uint8_t command = header[6];
+        uint8_t status = header[7];
+        if (length < 4 || c.in.size() - used < 4 + length)
+        {
+            break;
+        }
+        std::string& message = c.partial[id];
+        message.append(c.in, used + SESSION_HEADER_BYTES, length - 4);
+        used += 4 + length;
+        if (command & SESSION_MORE)
+        {
+            continue;
+        }
+        std::string payload = std::move(message);
+        c.partial.erase(id);
+        if (command & SESSION_REPLY)
+        {
+            // only STAT is ever asked of the device
+            if ((command & SESSION_COMMAND_MASK) == SESSION_STAT)
+            {
+                printf("[%d] probe dump (status %u):\n%s\n", c.fd, status, payload.c_str());
+            }
+            continue;
+        }
+        handleRequest(c, id, command & SESSION_COMMAND_MASK, payload);
+    }
+    c.in.erase(0, used);
+}
+
+// Read and write what the socket allows. Returns false once the device is gone.
+static bool service(Connection& c, short events)
+{
+    if (events & (POLLIN | POLLHUP | POLLERR))
+    {
+        char buffer[4096];
+        ssize_t got;
+        while ((got = read(c.fd, buffer, sizeof(buffer))) > 0)
+        {
+            c.in.append(buffer, got);
+        }
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            return false;
+        }
+        framesIn(c);
+    }
+    frameOut(c);
+    while (!c.out.empty())
+    {
+        ssize_t put = write(c.fd, c.out.data(), c.out.size());
+        if (put < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c.out.erase(0, put);
+        frameOut(c);
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int port = 1235;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        if (strcmp(argv[arg], "-p") == 0 && arg + 1 < argc)
+        {
+            port = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc)
+        {
+            if (!readFile(argv[++arg], catalog))
+            {
+                fprintf(stderr, "can't read %s\n", argv[arg]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[arg], "-s") == 0)
+        {
+            askForStats = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (arg >= argc && catalog.empty())
+    {
+        fprintf(stderr, "usage: %s [-p port] [-c catalog.bin] [-s] song.mid [song.mid ...]\n", argv[0]);
+        return 1;
+    }
+    for (; arg < argc; arg++)
+    {
+        Song song;
+        song.path = argv[arg];
+        if (!readFile(song.path, song.bytes))
+        {
+            fprintf(stderr, "can't read %s\n", argv[arg]);
+            return 1;
+        }
+        songs.push_back(song);
+    }
+
+    signal(SIGPIPE, SIG_IGN); // a device that hangs up shows as a failed write
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+    {
+        perror("can't listen");
+        return 1;
+    }
+    printf("Serving %zu songs on port %d\n", songs.size(), port);
+    fflush(stdout);
+
+    std::vector<Connection> connections;
+    for (;;)
+    {
+        std::vector<pollfd> fds(1 + connections.size());
+        fds[0] = {listener, POLLIN, 0};
+        for (size_t i = 0; i < connections.size(); i++)
+        {
+            bool sending = !connections[i].out.empty() || !connections[i].queue.empty();
+            fds[1 + i] = {connections[i].fd, static_cast<short>(POLLIN | (sending ? POLLOUT : 0)), 0};
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            return 1;
+        }
+
+        for (size_t i = connections.size(); i-- > 0;)
+        {
+            if (fds[1 + i].revents != 0 && !service(connections[i], fds[1 + i].revents))
+            {
+                printf("[%d] closed\n", connections[i].fd);
+                close(connections[i].fd);
+                connections.erase(connections.begin() + i);
+            }
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                Connection c;
+                c.fd = fd;
+                if (askForStats)
+                {
+                    queueMessage(c, c.nextId++, SESSION_STAT, SESSION_OK, std::string());
+                }
+                connections.push_back(std::move(c));
+                printf("[%d] connected\n", fd);
+            }
+        }
+        fflush(stdout);
+    }
+}